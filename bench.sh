@@ -0,0 +1,113 @@
+#!/bin/bash
+#  Copyright 2012-2015 University of Chicago and Argonne National Laboratory
+# 
+#  Licensed under the Apache License, Version 2.0 (the "License");
+#  you may not use this file except in compliance with the License.
+#  You may obtain a copy of the License at
+# 
+#      http://www.apache.org/licenses/LICENSE-2.0
+# 
+#  Unless required by applicable law or agreed to in writing, software
+#  distributed under the License is distributed on an "AS IS" BASIS,
+#  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#  See the License for the specific language governing permissions and
+#  limitations under the License
+
+# Benchmarks for the standalone solver.  Build first with
+# ./build-standalone.sh, using the BLOCK_WIDTH that matches the puzzles.
+#
+# Usage: ./bench.sh <benchmark> puzzle files...
+#   heuristics: every branching heuristic / value order combination
+#   engines:    generic and bitboard engines (9x9 and 16x16 builds only)
+#   batch:      one puzzle at a time against SIMD lanes (--batch)
+#   dist:       sudoku_dist throughput with 1, 2, 4, 8 and 16 workers
+#   threads:    independent solves on 1, 2, 4, 8 and 16 threads
+#   server:     sudoku_server latency and throughput with 1 to 16 clients
+#   layout:     the default board layout against one built with
+#               CC="cc -DINTERLEAVED_MASKS" and saved as sudoku_interleaved,
+#               with cache counters from perf stat if perf is installed
+
+SCRIPTDIR=$(dirname $0)
+SUDOKU=${SUDOKU:-${SCRIPTDIR}/sudoku}
+SUDOKU_DIST=${SUDOKU_DIST:-${SCRIPTDIR}/sudoku_dist}
+SUDOKU_SERVER=${SUDOKU_SERVER:-${SCRIPTDIR}/sudoku_server}
+SUDOKU_LOADGEN=${SUDOKU_LOADGEN:-${SCRIPTDIR}/sudoku_loadgen}
+SUDOKU_INTERLEAVED=${SUDOKU_INTERLEAVED:-${SCRIPTDIR}/sudoku_interleaved}
+
+BENCH=$1
+shift
+
+if [[ -z "${BENCH}" || $# == 0 ]]
+then
+  echo "Usage: $0 <benchmark> puzzle files..."
+  exit 1
+fi
+
+case ${BENCH} in
+  heuristics)
+    for BRANCH in mrv degree unit
+    do
+      for VALUES in default lowest lcv
+      do
+        ${SUDOKU} --branch=${BRANCH} --values=${VALUES} "$@" \
+          2>&1 > /dev/null | grep "^Summary:"
+      done
+    done
+    ;;
+  engines)
+    for ENGINE in generic bitboard
+    do
+      ${SUDOKU} --engine=${ENGINE} "$@" 2>&1 > /dev/null | grep "^Summary:"
+    done
+    ;;
+  batch)
+    for OPTS in "" "--batch"
+    do
+      ${SUDOKU} ${OPTS} "$@" 2>&1 > /dev/null | grep "^Summary:"
+    done
+    ;;
+  dist)
+    for WORKERS in 1 2 4 8 16
+    do
+      ${SUDOKU_DIST} --workers=${WORKERS} "$@" \
+        2>&1 > /dev/null | grep "^Summary:"
+    done
+    ;;
+  threads)
+    for THREADS in 1 2 4 8 16
+    do
+      ${SUDOKU} --threads=${THREADS} "$@" \
+        2>&1 > /dev/null | grep "^Summary:"
+    done
+    ;;
+  server)
+    SOCKET=$(mktemp -u /tmp/sudoku_server.XXXXXX)
+    ${SUDOKU_SERVER} --socket=${SOCKET} --threads=${THREADS:-4} &
+    SERVER_PID=$!
+    while [[ ! -S ${SOCKET} ]]
+    do
+      sleep 0.1
+    done
+    ${SUDOKU_LOADGEN} --socket=${SOCKET} --concurrency=1,2,4,8,16 \
+      --requests=${REQUESTS:-1000} "$@" 2>&1 | grep "^Summary:"
+    kill ${SERVER_PID}
+    rm -f ${SOCKET}
+    ;;
+  layout)
+    PERF=""
+    if command -v perf > /dev/null
+    then
+      PERF="perf stat -e cache-references,cache-misses,L1-dcache-load-misses"
+    fi
+    for BIN in ${SUDOKU} ${SUDOKU_INTERLEAVED}
+    do
+      echo "${BIN}"
+      ${PERF} ${BIN} "$@" 2>&1 > /dev/null | \
+        grep -E "^Summary:|cache-|L1-dcache"
+    done
+    ;;
+  *)
+    echo "Unknown benchmark ${BENCH}"
+    exit 1
+    ;;
+esac
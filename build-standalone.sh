@@ -54,10 +54,34 @@ else
 fi
 
 # Compile the user code
-${CC} -std=c99 -Wall -g ${CC_OPTS} \
+${CC} -std=c99 -Wall -g ${CC_OPTS} -pthread \
     -DBLOCK_WIDTH=$BLOCK_WIDTH -c ${USER_C}
 check
 
 # Compile the test program
-${CC} -std=c99 -Wall -DBLOCK_WIDTH=$BLOCK_WIDTH ${USER_O} sudoku.c -o sudoku
+${CC} -std=c99 -Wall -pthread -DBLOCK_WIDTH=$BLOCK_WIDTH ${USER_O} sudoku.c \
+    -o sudoku
+check
+
+# Compile the multi-process solver
+${CC} -std=c99 -Wall -pthread -DBLOCK_WIDTH=$BLOCK_WIDTH ${USER_O} \
+    sudoku_dist.c -o sudoku_dist
+check
+
+# Compile the solver service and its load generator
+${CC} -std=c99 -Wall -pthread -DBLOCK_WIDTH=$BLOCK_WIDTH ${USER_O} \
+    sudoku_server.c -o sudoku_server
+check
+
+${CC} -std=c99 -Wall -pthread sudoku_loadgen.c -o sudoku_loadgen
+check
+
+# Compile the puzzle set generator
+${CC} -std=c99 -Wall -pthread -DBLOCK_WIDTH=$BLOCK_WIDTH ${USER_O} \
+    sudoku_gen.c -o sudoku_gen
+check
+
+# Compile the search trace converter
+${CC} -std=c99 -Wall -pthread -DBLOCK_WIDTH=$BLOCK_WIDTH sudoku_trace.c \
+    -o sudoku_trace
 check
@@ -108,7 +108,7 @@ echo TURBINE_LIBS=${TURBINE_LIBS}
 
 # Compile the main program
 OBJS="${LEAF_O} ${USER_O}"
-${CC} -std=c99 -Wall -g ${LEAF_MAIN_C} \
+${CC} -std=c99 -Wall -g -pthread ${LEAF_MAIN_C} \
       ${OBJS} \
       -I. ${TURBINE_INCLUDES} ${TURBINE_LIBS} \
       -o ${LEAF_MAIN}
@@ -14,29 +14,646 @@
  * limitations under the License
  */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include "sudoku_solve.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <assert.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/resource.h>
 
 #define BUF_SIZE (BOARD_CELLS * 10)
+// Puzzles read from a file before solving them
+#define BATCH_SIZE 4096
+// Puzzles claimed at a time by a thread in --batch mode
+#define BATCH_CHUNK 256
 
 #ifndef BFS
 #define BFS (false)
 #endif
+// Boards to split each puzzle into breadth-first before searching
+// depth-first, by default
+#define DEFAULT_SPLIT (BFS ? 32 : 0)
+// Nodes a puzzle triaged as inline may take before it is restarted on the
+// strong route, by default
+#define DEFAULT_ESCALATE (100 * BOARD_WIDTH)
+// Depth-first passes between checks of the node budget, times half the
+// frontier size
+#define BUDGET_SLICE 4
+
+struct puzzle {
+  char *text;
+  cell_t *cells;
+  struct board *solution; // NULL if none found
+  double time;
+  struct solver_stats stats;
+  struct triage triage;
+  bool escalated;         // took too long inline, so solved as strong
+};
+
+/* Puzzles shared between solver threads, which claim them in order */
+struct batch {
+  struct puzzle *puzzles;
+  int n;
+  int next;
+  enum branch_heuristic heuristic;
+  enum value_order order;
+  int probe_depth;
+  int probe_width;
+  int split;
+  bool compact;
+  int bfs_threads;
+  enum solver_engine engine;
+  bool lanes;
+  struct trace_log *trace;
+  double progress;
+  double progress_cpu;
+  bool triage;
+  int triage_inline;    // -1 for the library's defaults
+  int triage_strong;
+  long escalate;        // node budget of the inline route, -1 for none
+  char *spill_dir;
+  size_t spill_mem;     // bytes of frontier kept in memory, 0 for no limit
+};
+
+static void usage(char *prog) {
+  fprintf(stderr, "usage: %s [options] puzzle files...\n"
+      "  -b, --branch=mrv|degree|unit    branching heuristic (default mrv)\n"
+      "  -v, --values=default|lowest|lcv value ordering (default default)\n"
+      "  -p, --probe=DEPTH               rounds of failed-literal probing\n"
+      "                                  before branching (default 0: off)\n"
+      "  -w, --probe-width=N             cells probed per round (default 4)\n"
+      "  -j, --threads=N                 puzzles solved in parallel, each\n"
+      "                                  thread with its own context\n"
+      "  -s, --split=N                   split breadth-first into N boards\n"
+      "                                  before searching depth-first\n"
+      "  -c, --compact                   store the frontier as deltas from\n"
+      "                                  parent boards\n"
+      "  -t, --bfs-threads=N             threads expanding each level of\n"
+      "                                  the breadth-first split\n"
+      "  -e, --engine=generic|bitboard   search implementation; bitboard\n"
+      "                                  is for 9x9 and 16x16 boards\n"
+      "  -l, --batch                     solve 9x9 puzzles several at a time\n"
+      "                                  in SIMD lanes; times are averages\n"
+      "  -T, --trace=FILE                write a binary log of the search\n"
+      "                                  tree, for sudoku_trace\n"
+      "  -P, --progress=SECONDS          report estimated progress of each\n"
+      "                                  depth-first search this often\n"
+      "  -C, --progress-cpu=FRACTION     most of the time to spend on\n"
+      "                                  progress estimates (default 0.05)\n"
+      "  -r, --triage[=INLINE,STRONG[,NODES]]\n"
+      "                                  route puzzles by the cells left\n"
+      "                                  empty by propagation: solve those\n"
+      "                                  with up to INLINE as usual, up to\n"
+      "                                  STRONG with unit branching, the\n"
+      "                                  rest after the batch with a\n"
+      "                                  portfolio of --threads strategies.\n"
+      "                                  Inline puzzles taking more than\n"
+      "                                  NODES nodes (default %d) are\n"
+      "                                  restarted with unit branching\n"
+      "  -m, --spill-mem=MB              keep at most MB of each frontier in\n"
+      "                                  memory and write the rest to files\n"
+      "  -d, --spill-dir=DIR             where to write them (default /tmp)\n"
+      "  -V, --verify [PUZZLES] SOLUTIONS\n"
+      "                                  check each line of SOLUTIONS is a\n"
+      "                                  valid solution of the same line of\n"
+      "                                  PUZZLES, instead of solving\n",
+      prog, DEFAULT_ESCALATE);
+}
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* True if line holds nothing but whitespace */
+static bool blank_line(const char *line) {
+  return line[strspn(line, " \t\r\n")] == '\0';
+}
+
+/* Read the next line of in that isn't blank into buf, which holds BUF_SIZE
+ * bytes, adding the lines read to *line and, unless bytes is NULL, their
+ * length to *bytes.  Returns false at the end of the file */
+static bool read_board_line(FILE *in, char *buf, long *line, size_t *bytes) {
+  while (fgets(buf, BUF_SIZE, in) != NULL) {
+    (*line)++;
+    if (bytes != NULL) {
+      *bytes += strlen(buf);
+    }
+    if (!blank_line(buf)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+ * Check the solutions in one file against the puzzles in another, in
+ * order, or just check they are valid if puzzle_file is NULL.  Blank lines
+ * are skipped.  Failures are printed to stdout with their line numbers.
+ * Returns the number of failures
+ */
+static long verify_files(char *puzzle_file, char *solution_file) {
+  FILE *puzzles = NULL;
+  if (puzzle_file != NULL && (puzzles = fopen(puzzle_file, "r")) == NULL) {
+    fprintf(stderr, "Could not open input file %s, exiting\n", puzzle_file);
+    exit(1);
+  }
+  FILE *solutions = fopen(solution_file, "r");
+  if (solutions == NULL) {
+    fprintf(stderr, "Could not open input file %s, exiting\n", solution_file);
+    exit(1);
+  }
+  char *pbuf = malloc(BUF_SIZE), *sbuf = malloc(BUF_SIZE);
+  assert(pbuf != NULL && sbuf != NULL);
+  cell_t puzzle[BOARD_CELLS], solution[BOARD_CELLS];
+
+  long nsolutions = 0, failed = 0;
+  long sline = 0, pline = 0;
+  size_t bytes = 0;
+  double start_time = now_seconds();
+  while (read_board_line(solutions, sbuf, &sline, &bytes)) {
+    nsolutions++;
+    char why[128];
+    if (puzzles != NULL) {
+      if (!read_board_line(puzzles, pbuf, &pline, &bytes)) {
+        printf("%s:%ld: no puzzle\n", solution_file, sline);
+        failed++;
+        continue;
+      }
+      if (!board_text_read_explain(pbuf, puzzle, why, sizeof(why))) {
+        printf("%s:%ld: could not parse puzzle: %s\n", puzzle_file, pline,
+               why);
+        failed++;
+        continue;
+      }
+    }
+    if (!board_text_read_explain(sbuf, solution, why, sizeof(why))) {
+      printf("%s:%ld: could not parse solution: %s\n", solution_file, sline,
+             why);
+      failed++;
+    } else if (!board_verify_explain(puzzles != NULL ? puzzle : NULL,
+                                     solution, why, sizeof(why))) {
+      printf("%s:%ld: %s\n", solution_file, sline, why);
+      failed++;
+    }
+  }
+  if (puzzles != NULL && read_board_line(puzzles, pbuf, &pline, &bytes)) {
+    printf("%s:%ld: no solution\n", puzzle_file, pline);
+    failed++;
+  }
+  double time = now_seconds() - start_time;
+  fprintf(stderr, "Verify: solutions=%ld failed=%ld time=%.6fs "
+          "solutions/s=%.0f MB/s=%.1f\n", nsolutions, failed, time,
+          nsolutions / time, bytes / time / 1e6);
+
+  if (puzzles != NULL) {
+    fclose(puzzles);
+  }
+  fclose(solutions);
+  free(pbuf);
+  free(sbuf);
+  return failed;
+}
+
+/* Search b depth-first until it is solved or shown to have no solution,
+ * or until ctx's statistics count budget nodes, in which case *exceeded
+ * is set.  A negative budget is no limit */
+static struct boardlist *search_budget(struct sudoku_ctx *ctx,
+                                       struct board *b, long budget,
+                                       bool *exceeded) {
+  if (budget < 0) {
+    return sudoku_solver_ctx(ctx, b, false, -1);
+  }
+  struct boardlist *l = sudoku_solver_ctx(ctx, b, false, BUDGET_SLICE);
+  while (l != NULL && !boardlist_solved(l)) {
+    struct solver_stats st;
+    get_solver_stats_ctx(ctx, &st);
+    if (st.nodes >= budget) {
+      *exceeded = true;
+      free_boardlist_ctx(ctx, l, true);
+      return NULL;
+    }
+    l = sudoku_solver_resume_ctx(ctx, l, false, BUDGET_SLICE);
+  }
+  return l;
+}
+
+/* Returns the solved board, or NULL if there is no solution or the search
+ * took more than budget nodes (see search_budget) */
+static struct board *solve_puzzle(struct sudoku_ctx *ctx, cell_t *cells,
+                                  int split, long budget, bool *exceeded) {
+  struct board *init = create_board_ctx(ctx, cells);
+  struct boardlist *prog = NULL;
+  if (split > 0) {
+    struct boardlist *candidates;
+    candidates = sudoku_solver_ctx(ctx, init, true, split);
+    if (candidates != NULL) {
+      if (boardlist_solved(candidates)) {
+        prog = candidates;
+      } else {
+        // Boards the split spilled are read back once the rest are done
+        do {
+          for (int i = 0; i < boardlist_len(candidates); i++) {
+            struct board *b = boardlist_get(candidates, i);
+            candidates->arr[i] = NULL;
+            prog = search_budget(ctx, b, budget, exceeded);
+            if (prog != NULL || *exceeded) {
+              // found a solution
+              break;
+            }
+          }
+        } while (prog == NULL && !*exceeded &&
+                 boardlist_refill_ctx(ctx, candidates));
+        free_boardlist_ctx(ctx, candidates, true);
+      }
+    }
+  } else {
+    prog = search_budget(ctx, init, budget, exceeded);
+  }
+
+  if (prog == NULL) {
+    return NULL;
+  }
+  struct board *solution = prog->arr[prog->len - 1];
+  prog->len--;
+  free_boardlist_ctx(ctx, prog, true);
+  return solution;
+}
+
+/* Solve as the route chosen by triage says, except for ROUTE_PORTFOLIO,
+ * which is left for solve_deferred */
+static struct board *solve_routed(struct sudoku_ctx *ctx, struct batch *batch,
+                                  struct puzzle *p) {
+  struct board *init = create_board_ctx(ctx, p->cells);
+  triage_board_ctx(ctx, init, &p->triage);
+  free_board_ctx(ctx, init);
+  bool exceeded = false;
+  switch (p->triage.route) {
+    case ROUTE_INLINE: {
+      // The bitboard engine can't stop part way, but rarely needs to
+      long budget = batch->engine == SOLVER_BITBOARD ? -1 : batch->escalate;
+      struct board *solution = solve_puzzle(ctx, p->cells, batch->split,
+                                            budget, &exceeded);
+      if (!exceeded) {
+        return solution;
+      }
+      p->escalated = true;
+    }
+    // fall through
+    case ROUTE_STRONG: {
+      set_branch_heuristic_ctx(ctx, BRANCH_UNIT);
+      struct board *solution = solve_puzzle(ctx, p->cells, batch->split, -1,
+                                            &exceeded);
+      set_branch_heuristic_ctx(ctx, batch->heuristic);
+      return solution;
+    }
+    case ROUTE_PORTFOLIO:
+      break;
+  }
+  return NULL;
+}
+
+/* Solve the puzzles triage sent to ROUTE_PORTFOLIO one at a time, each
+ * with nthreads strategies */
+static void solve_deferred(struct sudoku_ctx *ctx, struct batch *batch,
+                           int nthreads) {
+  for (int i = 0; i < batch->n; i++) {
+    struct puzzle *p = &batch->puzzles[i];
+    if (p->triage.route != ROUTE_PORTFOLIO) {
+      continue;
+    }
+    struct solver_stats st;
+    reset_solver_stats_ctx(ctx);
+    double start_time = now_seconds();
+    p->solution = sudoku_solve_portfolio_ctx(ctx,
+        create_board_ctx(ctx, p->cells), nthreads);
+    p->time += now_seconds() - start_time;
+    get_solver_stats_ctx(ctx, &st);
+    p->stats.nodes += st.nodes;
+    p->stats.branches += st.branches;
+    p->stats.deadends += st.deadends;
+    p->stats.probes += st.probes;
+    p->stats.eliminated += st.eliminated;
+    p->stats.forced += st.forced;
+    p->stats.spilled += st.spilled;
+    p->stats.spill_lost += st.spill_lost;
+  }
+}
+
+/* Solve chunks of the batch with sudoku_solve_batch_ctx */
+static void solve_chunks(struct sudoku_ctx *ctx, struct batch *batch) {
+  cell_t *cells = malloc(CELLS_MEM * BATCH_CHUNK);
+  cell_t *solutions = malloc(CELLS_MEM * BATCH_CHUNK);
+  bool solved[BATCH_CHUNK];
+  struct solver_stats stats[BATCH_CHUNK];
+  assert(cells != NULL && solutions != NULL);
+
+  int first;
+  while ((first = __atomic_fetch_add(&batch->next, BATCH_CHUNK,
+                                     __ATOMIC_RELAXED)) < batch->n) {
+    int n = batch->n - first < BATCH_CHUNK ? batch->n - first : BATCH_CHUNK;
+    for (int i = 0; i < n; i++) {
+      memcpy(cells + i * BOARD_CELLS, batch->puzzles[first + i].cells,
+             CELLS_MEM);
+    }
+    double start_time = now_seconds();
+    sudoku_solve_batch_ctx(ctx, cells, n, solutions, solved, stats);
+    double time = (now_seconds() - start_time) / n;
+    for (int i = 0; i < n; i++) {
+      struct puzzle *p = &batch->puzzles[first + i];
+      p->solution = solved[i] ?
+          create_board_ctx(ctx, solutions + i * BOARD_CELLS) : NULL;
+      p->time = time;
+      p->stats = stats[i];
+    }
+  }
+  free(cells);
+  free(solutions);
+}
+
+static void *solve_thread(void *arg) {
+  struct batch *batch = arg;
+  struct sudoku_ctx *ctx = sudoku_ctx_create(0);
+  set_branch_heuristic_ctx(ctx, batch->heuristic);
+  set_value_order_ctx(ctx, batch->order);
+  set_probing_ctx(ctx, batch->probe_depth, batch->probe_width);
+  set_compact_frontier_ctx(ctx, batch->compact);
+  set_bfs_threads_ctx(ctx, batch->bfs_threads);
+  set_solver_engine_ctx(ctx, batch->engine);
+  set_trace_log_ctx(ctx, batch->trace);
+  set_progress_ctx(ctx, batch->progress, batch->progress_cpu);
+  set_frontier_spill_ctx(ctx, batch->spill_dir, batch->spill_mem);
+  if (batch->triage_inline >= 0) {
+    set_triage_thresholds_ctx(ctx, batch->triage_inline, batch->triage_strong);
+  }
+
+  if (batch->lanes) {
+    solve_chunks(ctx, batch);
+    sudoku_ctx_free(ctx);
+    return NULL;
+  }
+
+  int i;
+  while ((i = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED))
+         < batch->n) {
+    struct puzzle *p = &batch->puzzles[i];
+    reset_solver_stats_ctx(ctx);
+    double start_time = now_seconds();
+    if (batch->triage) {
+      p->solution = solve_routed(ctx, batch, p);
+    } else {
+      bool exceeded = false;
+      p->solution = solve_puzzle(ctx, p->cells, batch->split, -1, &exceeded);
+    }
+    p->time = now_seconds() - start_time;
+    get_solver_stats_ctx(ctx, &p->stats);
+  }
+  sudoku_ctx_free(ctx);
+  return NULL;
+}
 
 int main(int argc, char **argv) {
   init_solver(0);
 
+  static struct option long_opts[] = {
+    {"branch", required_argument, NULL, 'b'},
+    {"values", required_argument, NULL, 'v'},
+    {"probe", required_argument, NULL, 'p'},
+    {"probe-width", required_argument, NULL, 'w'},
+    {"threads", required_argument, NULL, 'j'},
+    {"split", required_argument, NULL, 's'},
+    {"compact", no_argument, NULL, 'c'},
+    {"bfs-threads", required_argument, NULL, 't'},
+    {"engine", required_argument, NULL, 'e'},
+    {"batch", no_argument, NULL, 'l'},
+    {"trace", required_argument, NULL, 'T'},
+    {"progress", required_argument, NULL, 'P'},
+    {"progress-cpu", required_argument, NULL, 'C'},
+    {"triage", optional_argument, NULL, 'r'},
+    {"spill-mem", required_argument, NULL, 'm'},
+    {"spill-dir", required_argument, NULL, 'd'},
+    {"verify", no_argument, NULL, 'V'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0}
+  };
+  enum branch_heuristic heuristic = BRANCH_MRV;
+  enum value_order order = VALUE_ORDER_DEFAULT;
+  int probe_depth = 0, probe_width = 4;
+  int nthreads = 1;
+  int split = DEFAULT_SPLIT;
+  bool compact = false;
+  int bfs_threads = 1;
+  enum solver_engine engine = SOLVER_GENERIC;
+  bool lanes = false;
+  char *trace_file = NULL;
+  double progress = 0, progress_cpu = 0.05;
+  bool triage = false;
+  int triage_inline = -1, triage_strong = -1;
+  long escalate = DEFAULT_ESCALATE;
+  char *spill_dir = "/tmp";
+  double spill_mb = 0;
+  bool verify = false;
+  int opt;
+  while ((opt = getopt_long(argc, argv, "b:v:p:w:j:s:ct:e:lT:P:C:r::m:d:Vh", long_opts,
+                            NULL))
+         != -1) {
+    int val;
+    switch (opt) {
+      case 'b':
+        val = branch_heuristic_from_name(optarg);
+        if (val < 0) {
+          fprintf(stderr, "Unknown branching heuristic %s\n", optarg);
+          exit(1);
+        }
+        heuristic = val;
+        break;
+      case 'v':
+        val = value_order_from_name(optarg);
+        if (val < 0) {
+          fprintf(stderr, "Unknown value order %s\n", optarg);
+          exit(1);
+        }
+        order = val;
+        break;
+      case 'p':
+        probe_depth = atoi(optarg);
+        if (probe_depth < 0) {
+          fprintf(stderr, "Invalid probe depth %s\n", optarg);
+          exit(1);
+        }
+        break;
+      case 'w':
+        probe_width = atoi(optarg);
+        if (probe_width <= 0 || probe_width > MAX_PROBE_WIDTH) {
+          fprintf(stderr, "Probe width must be between 1 and %d\n",
+                  MAX_PROBE_WIDTH);
+          exit(1);
+        }
+        break;
+      case 'j':
+        nthreads = atoi(optarg);
+        if (nthreads <= 0) {
+          fprintf(stderr, "Invalid number of threads %s\n", optarg);
+          exit(1);
+        }
+        break;
+      case 's':
+        split = atoi(optarg);
+        if (split < 0) {
+          fprintf(stderr, "Invalid split %s\n", optarg);
+          exit(1);
+        }
+        break;
+      case 'c':
+        compact = true;
+        break;
+      case 't':
+        bfs_threads = atoi(optarg);
+        if (bfs_threads <= 0) {
+          fprintf(stderr, "Invalid number of BFS threads %s\n", optarg);
+          exit(1);
+        }
+        break;
+      case 'e':
+        val = solver_engine_from_name(optarg);
+        if (val < 0) {
+          fprintf(stderr, "Unknown engine %s\n", optarg);
+          exit(1);
+        }
+        engine = val;
+        break;
+      case 'l':
+        lanes = true;
+        break;
+      case 'T':
+        trace_file = optarg;
+        break;
+      case 'P':
+        progress = atof(optarg);
+        if (progress <= 0) {
+          fprintf(stderr, "Invalid progress interval %s\n", optarg);
+          exit(1);
+        }
+        break;
+      case 'C':
+        progress_cpu = atof(optarg);
+        if (progress_cpu <= 0 || progress_cpu > 1) {
+          fprintf(stderr, "Progress CPU fraction must be in (0, 1]\n");
+          exit(1);
+        }
+        break;
+      case 'r':
+        triage = true;
+        if (optarg != NULL &&
+            (sscanf(optarg, "%d,%d,%ld", &triage_inline, &triage_strong,
+                    &escalate) < 2 ||
+             triage_inline < 0 || triage_strong < triage_inline)) {
+          fprintf(stderr, "Invalid triage thresholds %s\n", optarg);
+          exit(1);
+        }
+        break;
+      case 'm':
+        spill_mb = atof(optarg);
+        if (spill_mb <= 0) {
+          fprintf(stderr, "Invalid spill memory %s\n", optarg);
+          exit(1);
+        }
+        break;
+      case 'd':
+        spill_dir = optarg;
+        break;
+      case 'V':
+        verify = true;
+        break;
+      case 'h':
+        usage(argv[0]);
+        return 0;
+      default:
+        usage(argv[0]);
+        exit(1);
+    }
+  }
+  if (engine == SOLVER_BITBOARD && BLOCK_WIDTH > 4) {
+    fprintf(stderr, "The bitboard engine needs a 9x9 or 16x16 build\n");
+    exit(1);
+  }
+  if (engine == SOLVER_BITBOARD &&
+      (heuristic != BRANCH_MRV || order != VALUE_ORDER_DEFAULT ||
+       probe_depth > 0)) {
+    // It has its own branching, so these would be reported but not used
+    fprintf(stderr, "--branch, --values and --probe are not supported by "
+            "the bitboard engine\n");
+    exit(1);
+  }
+  if (verify) {
+    if (argc - optind < 1 || argc - optind > 2) {
+      usage(argv[0]);
+      exit(1);
+    }
+    char *puzzle_file = argc - optind == 2 ? argv[optind] : NULL;
+    return verify_files(puzzle_file, argv[argc - 1]) > 0;
+  }
   fprintf(stderr, "Sudoku solver for %ix%i boards\n", BOARD_WIDTH, BOARD_WIDTH);
 
-  if (argc == 1)
+  if (optind == argc)
   {
     fprintf(stderr, "No input puzzles provided\n");
     return 0;
   }
 
-  for (int arg = 1; arg < argc; arg++) {
+  int npuzzles = 0, nsolved = 0;
+  double total_time = 0.0;
+  struct solver_stats total_stats = {0, 0, 0, 0, 0, 0, 0};
+  double wall_start = now_seconds();
+
+  struct batch batch;
+  batch.puzzles = malloc(sizeof(struct puzzle) * BATCH_SIZE);
+  assert(batch.puzzles != NULL);
+  batch.heuristic = heuristic;
+  batch.order = order;
+  batch.probe_depth = probe_depth;
+  batch.probe_width = probe_width;
+  batch.split = split;
+  batch.compact = compact;
+  batch.bfs_threads = bfs_threads;
+  batch.engine = engine;
+  batch.lanes = lanes;
+  batch.progress = progress;
+  batch.progress_cpu = progress_cpu;
+  // SIMD lanes solve every puzzle the same way
+  batch.triage = triage && !lanes;
+  batch.triage_inline = triage_inline;
+  batch.triage_strong = triage_strong;
+  batch.escalate = escalate;
+  batch.spill_dir = spill_dir;
+  batch.spill_mem = (size_t)(spill_mb * 1024 * 1024);
+  batch.trace = NULL;
+  if (trace_file != NULL) {
+    batch.trace = trace_log_open(trace_file);
+    if (batch.trace == NULL) {
+      fprintf(stderr, "Could not create trace file %s, exiting\n", trace_file);
+      exit(1);
+    }
+  }
+  pthread_t *threads = malloc(sizeof(pthread_t) * nthreads);
+  assert(threads != NULL);
+  // Solves the puzzles triage routes to a portfolio
+  struct sudoku_ctx *portfolio_ctx = NULL;
+  int routes[ROUTE_PORTFOLIO + 1] = {0};
+  int escalated = 0;
+  if (batch.triage) {
+    portfolio_ctx = sudoku_ctx_create(0);
+    set_probing_ctx(portfolio_ctx, 0, probe_width);
+    set_trace_log_ctx(portfolio_ctx, batch.trace);
+  }
+
+  for (int arg = optind; arg < argc; arg++) {
     FILE * in = fopen(argv[arg], "r");
     if (in == NULL) {
       fprintf(stderr, "Could not open input file %s, exiting\n",
@@ -47,51 +664,148 @@ int main(int argc, char **argv) {
     fprintf(stderr, "Solving puzzles in input file %s\n", argv[arg]);
 
     char buf[BUF_SIZE];
+    long line = 0;
+    bool eof = false;
 
-    while (fgets(buf, BUF_SIZE, in) != NULL) {
-      cell_t *sud = board_text_to_bin(buf);
-      if (sud == NULL) {
-        fprintf(stderr, "Couldn't parse board, skipping\n");
+    while (!eof) {
+      // Read a batch of puzzles, solve them on all threads, then report
+      // results in input order
+      batch.n = 0;
+      batch.next = 0;
+      while (batch.n < BATCH_SIZE) {
+        if (!read_board_line(in, buf, &line, NULL)) {
+          eof = true;
+          break;
+        }
+        cell_t *sud = malloc(sizeof(cell_t) * BOARD_CELLS);
+        assert(sud != NULL);
+        char why[128];
+        if (!board_text_read_explain(buf, sud, why, sizeof(why))) {
+          fprintf(stderr, "%s:%ld: could not parse board: %s, skipping\n",
+                  argv[arg], line, why);
+          free(sud);
+          continue;
+        }
+        if (!board_givens_consistent(sud, why, sizeof(why))) {
+          fprintf(stderr, "%s:%ld: conflicting givens: %s, skipping\n",
+                  argv[arg], line, why);
+          free(sud);
+          continue;
+        }
+        struct puzzle *p = &batch.puzzles[batch.n++];
+        p->text = strdup(buf);
+        p->cells = sud;
+        p->solution = NULL;
+        p->triage.route = ROUTE_INLINE;
+        p->escalated = false;
+      }
+      if (batch.n == 0) {
         continue;
       }
-      struct board *init = create_board(sud);
-      printf("Start board:\n");
-      print_board(stdout, init);
-      struct boardlist *prog = NULL;
-      if (BFS) {
-        struct boardlist *candidates;
-        candidates = sudoku_solver(init, true, /*1024 * 128*/ 32);
-        if (candidates != NULL) {
-          if (candidates->len == 1 && 
-             candidates->arr[0]->nfilled == BOARD_CELLS) {
-            prog = candidates;
-          } else {
-            for (int i = 0; i < candidates->len; i++) {
-              prog = sudoku_solver(candidates->arr[i], false, -1);
-              candidates->arr[i] = NULL;
-              if (prog != NULL) {
-                // found a solution
-                free_boardlist(candidates, true);
-                break;
-              }
-            }
-          }
-        }
+
+      if (nthreads == 1) {
+        solve_thread(&batch);
       } else {
-        prog = sudoku_solver(init, false, -1);
+        for (int t = 0; t < nthreads; t++) {
+          pthread_create(&threads[t], NULL, solve_thread, &batch);
+        }
+        for (int t = 0; t < nthreads; t++) {
+          pthread_join(threads[t], NULL);
+        }
+      }
+      if (batch.triage) {
+        solve_deferred(portfolio_ctx, &batch, nthreads);
       }
 
-      if (prog == NULL) {
-        fprintf(stderr, "could not solve!\n");
-        printf("unsolved:%s\n", buf);
-      } else {
-        assert(prog->arr[prog->len - 1]->nfilled == BOARD_CELLS);
-        printf("Solved!\n");
-        print_board(stdout, prog->arr[prog->len - 1]);
-        free_boardlist(prog, true);
+      for (int i = 0; i < batch.n; i++) {
+        struct puzzle *p = &batch.puzzles[i];
+        struct board *init = create_board(p->cells);
+        printf("Start board:\n");
+        print_board(stdout, init);
+        free_board(init);
+
+        struct solver_stats *st = &p->stats;
+        fprintf(stderr, "%.6fs %ld nodes %ld branches %ld dead ends "
+                "%ld probes %ld forced", p->time, st->nodes, st->branches,
+                st->deadends, st->probes, st->forced);
+        if (batch.triage) {
+          fprintf(stderr, " %d empty %s%s", p->triage.empty,
+                  solve_route_name(p->triage.route),
+                  p->escalated ? " escalated" : "");
+          routes[p->triage.route]++;
+          escalated += p->escalated;
+        }
+        fprintf(stderr, "\n");
+        npuzzles++;
+        total_time += p->time;
+        total_stats.nodes += st->nodes;
+        total_stats.branches += st->branches;
+        total_stats.deadends += st->deadends;
+        total_stats.probes += st->probes;
+        total_stats.eliminated += st->eliminated;
+        total_stats.forced += st->forced;
+        total_stats.spilled += st->spilled;
+        total_stats.spill_lost += st->spill_lost;
+
+        char why[128];
+        if (p->solution == NULL) {
+          fprintf(stderr, "could not solve!\n");
+          printf("unsolved:%s\n", p->text);
+        } else if (!board_verify_explain(p->cells, p->solution->board, why,
+                                         sizeof(why))) {
+          fprintf(stderr, "invalid solution: %s\n", why);
+          printf("invalid:%s\n", p->text);
+          free_board(p->solution);
+        } else {
+          nsolved++;
+          printf("Solved!\n");
+          print_board(stdout, p->solution);
+          free_board(p->solution);
+        }
+        free(p->cells);
+        free(p->text);
       }
-      free(sud);
     }
     fclose(in);
   }
+  double wall_time = now_seconds() - wall_start;
+  if (portfolio_ctx != NULL) {
+    sudoku_ctx_free(portfolio_ctx);
+  }
+  if (batch.trace != NULL && !trace_log_close(batch.trace)) {
+    fprintf(stderr, "Error writing trace file %s\n", trace_file);
+  }
+  free(threads);
+  free(batch.puzzles);
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  bool generic = engine == SOLVER_GENERIC;
+  char probe_opts[32];
+  snprintf(probe_opts, sizeof(probe_opts), "%d,%d", probe_depth, probe_width);
+  fprintf(stderr, "Summary: engine=%s batch=%d branch=%s values=%s "
+          "probe=%s threads=%d "
+          "split=%d compact=%d bfs-threads=%d "
+          "puzzles=%d solved=%d nodes=%ld branches=%ld deadends=%ld "
+          "probes=%ld eliminated=%ld forced=%ld time=%.6fs wall=%.6fs "
+          "puzzles/s=%.1f ns/node=%.1f maxrss=%ldKB\n",
+          solver_engine_name(engine), lanes,
+          generic ? branch_heuristic_name(heuristic) : "n/a",
+          generic ? value_order_name(order) : "n/a",
+          generic ? probe_opts : "n/a", nthreads, split, compact, bfs_threads, npuzzles,
+          nsolved, total_stats.nodes, total_stats.branches,
+          total_stats.deadends, total_stats.probes, total_stats.eliminated,
+          total_stats.forced, total_time, wall_time, npuzzles / wall_time,
+          total_stats.nodes > 0 ? 1e9 * total_time / total_stats.nodes : 0.0,
+          usage.ru_maxrss);
+  if (batch.spill_mem > 0) {
+    fprintf(stderr, "Spill: mem=%.1fMB dir=%s boards=%ld lost=%ld\n",
+            spill_mb, spill_dir, total_stats.spilled, total_stats.spill_lost);
+  }
+  if (batch.triage) {
+    fprintf(stderr, "Triage: inline=%d escalated=%d strong=%d "
+            "portfolio=%d\n", routes[ROUTE_INLINE], escalated,
+            routes[ROUTE_STRONG], routes[ROUTE_PORTFOLIO]);
+  }
+  return 0;
 }
@@ -0,0 +1,590 @@
+/*
+ * Copyright 2012-2015 University of Chicago and Argonne National Laboratory
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License
+ */
+
+/*
+ * Multi-process solver for a single host.  The coordinator splits the
+ * search with a breadth-first pass, then hands boards to worker processes
+ * over Unix-domain sockets.  Workers search depth-first for up to a quota
+ * of nodes and send back what is left of their stack, which the
+ * coordinator redistributes.  As soon as one worker finds a solution, the
+ * others are told to drop their work.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "sudoku_solve.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define BUF_SIZE (BOARD_CELLS * 10)
+
+// Passes of DFS between checks for a termination message
+#define CHECK_INTERVAL 64
+// Boards are sent with their masks, which saves the receiver rebuilding
+// them from the cells
+#define WIRE_FLAGS BOARD_WIRE_MASKS
+#define WIRE_SIZE board_serialized_size(WIRE_FLAGS)
+
+enum msg_type {
+  MSG_WORK,       // coordinator -> worker: one board to search
+  MSG_TERM,       // coordinator -> worker: drop work for this epoch
+  MSG_EXIT,       // coordinator -> worker: shut down
+  MSG_SOLVED,     // worker -> coordinator: one solved board
+  MSG_DEADEND,    // worker -> coordinator: subtree has no solution
+  MSG_FRONTIER,   // worker -> coordinator: quota hit, unexplored boards
+  MSG_ABANDONED,  // worker -> coordinator: work dropped after MSG_TERM
+};
+
+/* Followed by count boards serialized with WIRE_FLAGS */
+struct msg_header {
+  uint32_t type;
+  uint32_t epoch; // puzzle number, so stale replies can be discarded
+  uint32_t count;
+  uint32_t pad;
+  uint64_t nodes; // nodes expanded by the worker for this message
+};
+
+struct worker {
+  pid_t pid;
+  int fd;
+  bool busy;
+};
+
+struct workqueue {
+  unsigned char **arr;  // serialized boards
+  int len;
+  int size;
+};
+
+static void usage(char *prog) {
+  fprintf(stderr, "usage: %s [options] puzzle files...\n"
+      "  -n, --workers=N      worker processes (default 4)\n"
+      "  -s, --split=N        boards generated by BFS before distributing\n"
+      "                       (default 4 * workers)\n"
+      "  -q, --quota=N        nodes a worker searches before returning its\n"
+      "                       frontier (default 25000)\n"
+      "  -b, --branch=NAME    branching heuristic, as for sudoku\n"
+      "  -v, --values=NAME    value ordering, as for sudoku\n"
+      "  -p, --probe=DEPTH    probing depth, as for sudoku\n"
+      "  -w, --probe-width=N  probing width, as for sudoku\n",
+      prog);
+}
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static bool write_all(int fd, const void *buf, size_t len) {
+  const char *p = buf;
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+static bool read_all(int fd, void *buf, size_t len) {
+  char *p = buf;
+  while (len > 0) {
+    ssize_t n = read(fd, p, len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+static bool send_msg(int fd, enum msg_type type, uint32_t epoch,
+                     uint64_t nodes, unsigned char **boards, uint32_t count) {
+  struct msg_header h;
+  memset(&h, 0, sizeof(h));
+  h.type = type;
+  h.epoch = epoch;
+  h.count = count;
+  h.nodes = nodes;
+  if (!write_all(fd, &h, sizeof(h))) {
+    return false;
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    if (!write_all(fd, boards[i], WIRE_SIZE)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/* Read the boards following a header.  Returns a malloced array of count
+ * malloced serialized boards, or NULL on error */
+static unsigned char **recv_boards(int fd, uint32_t count) {
+  unsigned char **boards = malloc(sizeof(unsigned char *) *
+                                  (count > 0 ? count : 1));
+  assert(boards != NULL);
+  for (uint32_t i = 0; i < count; i++) {
+    boards[i] = malloc(WIRE_SIZE);
+    assert(boards[i] != NULL);
+    if (!read_all(fd, boards[i], WIRE_SIZE)) {
+      for (uint32_t j = 0; j <= i; j++) {
+        free(boards[j]);
+      }
+      free(boards);
+      return NULL;
+    }
+  }
+  return boards;
+}
+
+static void queue_push(struct workqueue *q, unsigned char *board) {
+  if (q->len == q->size) {
+    q->size = q->size == 0 ? 1024 : q->size * 2;
+    q->arr = realloc(q->arr, sizeof(unsigned char *) * q->size);
+    assert(q->arr != NULL);
+  }
+  q->arr[q->len++] = board;
+}
+
+static void queue_clear(struct workqueue *q) {
+  for (int i = 0; i < q->len; i++) {
+    free(q->arr[i]);
+  }
+  q->len = 0;
+}
+
+/* Returns true if a termination message for epoch is waiting */
+static bool term_pending(int fd, uint32_t epoch) {
+  struct pollfd pfd = {fd, POLLIN, 0};
+  if (poll(&pfd, 1, 0) <= 0) {
+    return false;
+  }
+  struct msg_header h;
+  if (!read_all(fd, &h, sizeof(h))) {
+    exit(1);
+  }
+  // Only termination messages are sent to a busy worker
+  assert(h.type == MSG_TERM);
+  return h.epoch == epoch;
+}
+
+/*
+ * Worker process main loop: search each board received depth-first for
+ * up to quota nodes.
+ */
+static void worker_main(int fd, long quota) {
+  unsigned char *in = malloc(WIRE_SIZE);
+  assert(in != NULL);
+  while (true) {
+    struct msg_header h;
+    if (!read_all(fd, &h, sizeof(h))) {
+      exit(1);
+    }
+    if (h.type == MSG_EXIT) {
+      exit(0);
+    } else if (h.type == MSG_TERM) {
+      // Work for this epoch already finished
+      continue;
+    }
+    assert(h.type == MSG_WORK && h.count == 1);
+    // Decoded straight from the receive buffer into a pooled board
+    struct board *b;
+    if (!read_all(fd, in, WIRE_SIZE) ||
+        (b = board_deserialize(in, WIRE_SIZE)) == NULL) {
+      exit(1);
+    }
+
+    reset_solver_stats();
+
+    struct boardlist *l = sudoku_solver(b, false, CHECK_INTERVAL);
+    struct solver_stats st;
+    bool terminated = false;
+    while (l != NULL && !boardlist_solved(l)) {
+      get_solver_stats(&st);
+      if (st.nodes >= quota) {
+        break;
+      }
+      if (term_pending(fd, h.epoch)) {
+        terminated = true;
+        break;
+      }
+      l = sudoku_solver_resume(l, false, CHECK_INTERVAL);
+    }
+    get_solver_stats(&st);
+
+    bool ok;
+    if (terminated) {
+      free_boardlist(l, true);
+      ok = send_msg(fd, MSG_ABANDONED, h.epoch, st.nodes, NULL, 0);
+    } else if (l == NULL) {
+      ok = send_msg(fd, MSG_DEADEND, h.epoch, st.nodes, NULL, 0);
+    } else {
+      int n = boardlist_len(l);
+      unsigned char **out = malloc(sizeof(unsigned char *) * n);
+      assert(out != NULL);
+      for (int i = 0; i < n; i++) {
+        out[i] = board_serialize_alloc(boardlist_get(l, i), WIRE_FLAGS);
+      }
+      ok = send_msg(fd, boardlist_solved(l) ? MSG_SOLVED : MSG_FRONTIER,
+                    h.epoch, st.nodes, out, n);
+      for (int i = 0; i < n; i++) {
+        free(out[i]);
+      }
+      free(out);
+      free_boardlist(l, true);
+    }
+    if (!ok) {
+      exit(1);
+    }
+  }
+}
+
+static struct worker *start_workers(int nworkers, long quota) {
+  struct worker *workers = malloc(sizeof(struct worker) * nworkers);
+  assert(workers != NULL);
+  for (int i = 0; i < nworkers; i++) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+      perror("socketpair");
+      exit(1);
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+      perror("fork");
+      exit(1);
+    } else if (pid == 0) {
+      close(fds[0]);
+      // Don't hold the coordinator ends of earlier workers' sockets
+      for (int j = 0; j < i; j++) {
+        close(workers[j].fd);
+      }
+      worker_main(fds[1], quota);
+      exit(0);
+    }
+    close(fds[1]);
+    workers[i].pid = pid;
+    workers[i].fd = fds[0];
+    workers[i].busy = false;
+  }
+  return workers;
+}
+
+static void stop_workers(struct worker *workers, int nworkers) {
+  for (int i = 0; i < nworkers; i++) {
+    send_msg(workers[i].fd, MSG_EXIT, 0, 0, NULL, 0);
+    close(workers[i].fd);
+  }
+  for (int i = 0; i < nworkers; i++) {
+    waitpid(workers[i].pid, NULL, 0);
+  }
+  free(workers);
+}
+
+/*
+ * Solve one puzzle with the worker pool.  Returns a malloced solution,
+ * or NULL if there is none.  Adds nodes expanded to *nodes.
+ */
+static cell_t *solve_distributed(struct worker *workers, int nworkers,
+        cell_t *puzzle, long split, uint32_t epoch, long *nodes) {
+  struct workqueue queue = {NULL, 0, 0};
+  cell_t *solution = NULL;
+
+  reset_solver_stats();
+  struct boardlist *candidates = sudoku_solver(create_board(puzzle), true,
+                                               split);
+  struct solver_stats st;
+  get_solver_stats(&st);
+  *nodes += st.nodes;
+  if (candidates == NULL) {
+    return NULL;
+  }
+  if (boardlist_solved(candidates)) {
+    solution = malloc(CELLS_MEM);
+    assert(solution != NULL);
+    memcpy(solution, boardlist_get(candidates, 0)->board, CELLS_MEM);
+    free_boardlist(candidates, true);
+    return solution;
+  }
+  // Push in reverse so boards are handed out in BFS order
+  for (int i = boardlist_len(candidates) - 1; i >= 0; i--) {
+    queue_push(&queue,
+               board_serialize_alloc(boardlist_get(candidates, i), WIRE_FLAGS));
+  }
+  free_boardlist(candidates, true);
+
+  struct pollfd *pfds = malloc(sizeof(struct pollfd) * nworkers);
+  assert(pfds != NULL);
+  int nbusy = 0;
+  while (true) {
+    // Hand out work to idle workers, deepest boards first
+    for (int i = 0; i < nworkers && solution == NULL && queue.len > 0; i++) {
+      if (!workers[i].busy) {
+        unsigned char *board = queue.arr[--queue.len];
+        if (!send_msg(workers[i].fd, MSG_WORK, epoch, 0, &board, 1)) {
+          fprintf(stderr, "Lost worker %d\n", i);
+          exit(1);
+        }
+        free(board);
+        workers[i].busy = true;
+        nbusy++;
+      }
+    }
+    if (nbusy == 0) {
+      break;
+    }
+
+    for (int i = 0; i < nworkers; i++) {
+      pfds[i].fd = workers[i].fd;
+      pfds[i].events = workers[i].busy ? POLLIN : 0;
+      pfds[i].revents = 0;
+    }
+    if (poll(pfds, nworkers, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("poll");
+      exit(1);
+    }
+
+    for (int i = 0; i < nworkers; i++) {
+      if ((pfds[i].revents & (POLLIN | POLLHUP | POLLERR)) == 0) {
+        continue;
+      }
+      struct msg_header h;
+      unsigned char **boards = NULL;
+      if (!read_all(workers[i].fd, &h, sizeof(h)) ||
+          (boards = recv_boards(workers[i].fd, h.count)) == NULL) {
+        fprintf(stderr, "Lost worker %d\n", i);
+        exit(1);
+      }
+      assert(h.epoch == epoch);
+      workers[i].busy = false;
+      nbusy--;
+      *nodes += h.nodes;
+
+      if (h.type == MSG_SOLVED && solution == NULL) {
+        assert(h.count == 1);
+        struct board *b = board_deserialize(boards[0], WIRE_SIZE);
+        if (b == NULL) {
+          fprintf(stderr, "Bad solution from worker %d\n", i);
+          exit(1);
+        }
+        solution = malloc(CELLS_MEM);
+        assert(solution != NULL);
+        memcpy(solution, b->board, CELLS_MEM);
+        free_board(b);
+        // Tell everyone else to stop
+        for (int j = 0; j < nworkers; j++) {
+          if (workers[j].busy) {
+            send_msg(workers[j].fd, MSG_TERM, epoch, 0, NULL, 0);
+          }
+        }
+        queue_clear(&queue);
+      } else if (h.type == MSG_FRONTIER && solution == NULL) {
+        // Boards are in stack order, so the last is explored next
+        for (uint32_t j = 0; j < h.count; j++) {
+          queue_push(&queue, boards[j]);
+          boards[j] = NULL;
+        }
+      }
+      for (uint32_t j = 0; j < h.count; j++) {
+        free(boards[j]);
+      }
+      free(boards);
+    }
+  }
+  free(pfds);
+  free(queue.arr);
+  return solution;
+}
+
+int main(int argc, char **argv) {
+  init_solver(0);
+
+  static struct option long_opts[] = {
+    {"workers", required_argument, NULL, 'n'},
+    {"split", required_argument, NULL, 's'},
+    {"quota", required_argument, NULL, 'q'},
+    {"branch", required_argument, NULL, 'b'},
+    {"values", required_argument, NULL, 'v'},
+    {"probe", required_argument, NULL, 'p'},
+    {"probe-width", required_argument, NULL, 'w'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0}
+  };
+  int nworkers = 4;
+  long split = -1;
+  long quota = 25000;
+  int probe_depth = 0, probe_width = 4;
+  int opt;
+  while ((opt = getopt_long(argc, argv, "n:s:q:b:v:p:w:h", long_opts,
+                            NULL)) != -1) {
+    int val;
+    switch (opt) {
+      case 'n':
+        nworkers = atoi(optarg);
+        break;
+      case 's':
+        split = atol(optarg);
+        break;
+      case 'q':
+        quota = atol(optarg);
+        break;
+      case 'b':
+        val = branch_heuristic_from_name(optarg);
+        if (val < 0) {
+          fprintf(stderr, "Unknown branching heuristic %s\n", optarg);
+          exit(1);
+        }
+        set_branch_heuristic(val);
+        break;
+      case 'v':
+        val = value_order_from_name(optarg);
+        if (val < 0) {
+          fprintf(stderr, "Unknown value order %s\n", optarg);
+          exit(1);
+        }
+        set_value_order(val);
+        break;
+      case 'p':
+        probe_depth = atoi(optarg);
+        break;
+      case 'w':
+        probe_width = atoi(optarg);
+        break;
+      case 'h':
+        usage(argv[0]);
+        return 0;
+      default:
+        usage(argv[0]);
+        exit(1);
+    }
+  }
+  if (nworkers <= 0 || quota <= 0 || probe_depth < 0 ||
+      probe_width <= 0 || probe_width > MAX_PROBE_WIDTH) {
+    usage(argv[0]);
+    exit(1);
+  }
+  if (split < 0) {
+    split = 4 * nworkers;
+  }
+  set_probing(probe_depth, probe_width);
+
+  fprintf(stderr, "Distributed sudoku solver for %ix%i boards, %d workers\n",
+          BOARD_WIDTH, BOARD_WIDTH, nworkers);
+  if (optind == argc) {
+    fprintf(stderr, "No input puzzles provided\n");
+    return 0;
+  }
+
+  // Workers inherit the solver settings above
+  signal(SIGPIPE, SIG_IGN);
+  struct worker *workers = start_workers(nworkers, quota);
+
+  int npuzzles = 0, nsolved = 0;
+  long total_nodes = 0;
+  double total_time = 0.0;
+  uint32_t epoch = 0;
+  for (int arg = optind; arg < argc; arg++) {
+    FILE *in = fopen(argv[arg], "r");
+    if (in == NULL) {
+      fprintf(stderr, "Could not open input file %s, exiting\n", argv[arg]);
+      exit(1);
+    }
+    fprintf(stderr, "Solving puzzles in input file %s\n", argv[arg]);
+
+    char buf[BUF_SIZE];
+    long line = 0;
+    while (fgets(buf, BUF_SIZE, in) != NULL) {
+      line++;
+      if (buf[strspn(buf, " \t\r\n")] == '\0') {
+        continue;
+      }
+      cell_t *sud = malloc(sizeof(cell_t) * BOARD_CELLS);
+      assert(sud != NULL);
+      char why[128];
+      if (!board_text_read_explain(buf, sud, why, sizeof(why))) {
+        fprintf(stderr, "%s:%ld: could not parse board: %s, skipping\n",
+                argv[arg], line, why);
+        free(sud);
+        continue;
+      }
+      if (!board_givens_consistent(sud, why, sizeof(why))) {
+        fprintf(stderr, "%s:%ld: conflicting givens: %s, skipping\n",
+                argv[arg], line, why);
+        free(sud);
+        continue;
+      }
+      struct board *init = create_board(sud);
+      printf("Start board:\n");
+      print_board(stdout, init);
+      free_board(init);
+
+      long nodes = 0;
+      double start_time = now_seconds();
+      cell_t *solution = solve_distributed(workers, nworkers, sud, split,
+                                           epoch++, &nodes);
+      double elapsed = now_seconds() - start_time;
+      fprintf(stderr, "%.6fs %ld nodes %.0f nodes/s\n", elapsed, nodes,
+              nodes / elapsed);
+      npuzzles++;
+      total_nodes += nodes;
+      total_time += elapsed;
+
+      if (solution == NULL) {
+        fprintf(stderr, "could not solve!\n");
+        printf("unsolved:%s\n", buf);
+      } else {
+        nsolved++;
+        struct board *b = create_board(solution);
+        printf("Solved!\n");
+        print_board(stdout, b);
+        free_board(b);
+        free(solution);
+      }
+      free(sud);
+    }
+    fclose(in);
+  }
+  stop_workers(workers, nworkers);
+
+  fprintf(stderr, "Summary: workers=%d split=%ld quota=%ld puzzles=%d "
+          "solved=%d nodes=%ld time=%.6fs nodes/s=%.0f\n",
+          nworkers, split, quota, npuzzles, nsolved, total_nodes,
+          total_time, total_time > 0 ? total_nodes / total_time : 0.0);
+  return 0;
+}
@@ -0,0 +1,203 @@
+/*
+ * Copyright 2012-2015 University of Chicago and Argonne National Laboratory
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License
+ */
+
+/*
+ * Generate puzzle sets for benchmarking, one puzzle per line.
+ *
+ * Given seed puzzle files, each output puzzle is a random seed puzzle with
+ * its values relabelled and its rows, columns, bands and stacks shuffled,
+ * which keeps the difficulty of the seed.  Otherwise, each puzzle is a
+ * shuffled complete grid with all but --givens cells cleared; these may
+ * have several solutions.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "sudoku_solve.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <getopt.h>
+
+#define BUF_SIZE (BOARD_CELLS * 10)
+
+static uint64_t rng_state;
+
+static void usage(char *prog) {
+  fprintf(stderr, "usage: %s [options] [seed puzzle files...]\n"
+      "  -n, --count=N    puzzles to generate (default 1000000)\n"
+      "  -s, --seed=N     random seed (default 1)\n"
+      "  -g, --givens=N   cells left filled in when there are no seed\n"
+      "                   puzzles (default 37%% of the board)\n",
+      prog);
+}
+
+static uint32_t rng_next(void) {
+  // xorshift64*
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return (uint32_t)((rng_state * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+static void shuffle(int *perm, int n) {
+  for (int i = 0; i < n; i++) {
+    perm[i] = i;
+  }
+  for (int i = n - 1; i > 0; i--) {
+    int j = rng_next() % (i + 1);
+    int tmp = perm[i];
+    perm[i] = perm[j];
+    perm[j] = tmp;
+  }
+}
+
+/* A random permutation of rows (or columns) that keeps bands together */
+static void band_shuffle(int *perm) {
+  int bands[BLOCK_WIDTH], within[BLOCK_WIDTH];
+  shuffle(bands, BLOCK_WIDTH);
+  for (int b = 0; b < BLOCK_WIDTH; b++) {
+    shuffle(within, BLOCK_WIDTH);
+    for (int i = 0; i < BLOCK_WIDTH; i++) {
+      perm[b * BLOCK_WIDTH + i] = bands[b] * BLOCK_WIDTH + within[i];
+    }
+  }
+}
+
+/* Write a random puzzle equivalent to src to dst */
+static void transform(cell_t *src, cell_t *dst) {
+  int rows[BOARD_WIDTH], cols[BOARD_WIDTH], values[BOARD_WIDTH];
+  band_shuffle(rows);
+  band_shuffle(cols);
+  shuffle(values, BOARD_WIDTH);
+  bool transpose = rng_next() & 1;
+  for (int row = 0; row < BOARD_WIDTH; row++) {
+    for (int col = 0; col < BOARD_WIDTH; col++) {
+      int srow = rows[row], scol = cols[col];
+      cell_t val = transpose ? src[scol * BOARD_WIDTH + srow] :
+                               src[srow * BOARD_WIDTH + scol];
+      dst[row * BOARD_WIDTH + col] = val == 0 ? 0 : values[val - 1] + 1;
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  static struct option long_opts[] = {
+    {"count", required_argument, NULL, 'n'},
+    {"seed", required_argument, NULL, 's'},
+    {"givens", required_argument, NULL, 'g'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0}
+  };
+  long count = 1000000;
+  unsigned long seed = 1;
+  int givens = BOARD_CELLS * 37 / 100;
+  int opt;
+  while ((opt = getopt_long(argc, argv, "n:s:g:h", long_opts, NULL)) != -1) {
+    switch (opt) {
+      case 'n':
+        count = atol(optarg);
+        break;
+      case 's':
+        seed = strtoul(optarg, NULL, 10);
+        break;
+      case 'g':
+        givens = atoi(optarg);
+        break;
+      case 'h':
+        usage(argv[0]);
+        return 0;
+      default:
+        usage(argv[0]);
+        exit(1);
+    }
+  }
+  if (count < 0 || givens < 0 || givens > BOARD_CELLS) {
+    usage(argv[0]);
+    exit(1);
+  }
+  rng_state = (seed * 0x9E3779B97F4A7C15ULL) | 1;
+
+  cell_t **seeds = NULL;
+  int nseeds = 0;
+  char *buf = malloc(BUF_SIZE);
+  assert(buf != NULL);
+  for (int arg = optind; arg < argc; arg++) {
+    FILE *in = fopen(argv[arg], "r");
+    if (in == NULL) {
+      fprintf(stderr, "Could not open input file %s, exiting\n", argv[arg]);
+      exit(1);
+    }
+    long line = 0;
+    while (fgets(buf, BUF_SIZE, in) != NULL) {
+      line++;
+      if (buf[strspn(buf, " \t\r\n")] == '\0') {
+        continue;
+      }
+      cell_t *cells = malloc(sizeof(cell_t) * BOARD_CELLS);
+      assert(cells != NULL);
+      char why[128];
+      if (!board_text_read_explain(buf, cells, why, sizeof(why))) {
+        fprintf(stderr, "%s:%ld: could not parse seed: %s, skipping\n",
+                argv[arg], line, why);
+        free(cells);
+        continue;
+      }
+      seeds = realloc(seeds, sizeof(cell_t *) * (nseeds + 1));
+      assert(seeds != NULL);
+      seeds[nseeds++] = cells;
+    }
+    fclose(in);
+  }
+  if (optind < argc && nseeds == 0) {
+    fprintf(stderr, "No seed puzzles read\n");
+    exit(1);
+  }
+
+  // Complete grid to shuffle when there are no seeds
+  cell_t grid[BOARD_CELLS];
+  for (int row = 0; row < BOARD_WIDTH; row++) {
+    for (int col = 0; col < BOARD_WIDTH; col++) {
+      grid[row * BOARD_WIDTH + col] = (BLOCK_WIDTH * (row % BLOCK_WIDTH) +
+                                       row / BLOCK_WIDTH + col) % BOARD_WIDTH + 1;
+    }
+  }
+
+  cell_t out[BOARD_CELLS];
+  int order[BOARD_CELLS];
+  for (long i = 0; i < count; i++) {
+    if (nseeds > 0) {
+      transform(seeds[rng_next() % nseeds], out);
+    } else {
+      transform(grid, out);
+      shuffle(order, BOARD_CELLS);
+      for (int j = givens; j < BOARD_CELLS; j++) {
+        out[order[j]] = 0;
+      }
+    }
+    char *text = board_bin_to_text(out);
+    puts(text);
+    free(text);
+  }
+
+  for (int s = 0; s < nseeds; s++) {
+    free(seeds[s]);
+  }
+  free(seeds);
+  free(buf);
+  return 0;
+}
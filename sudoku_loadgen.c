@@ -0,0 +1,253 @@
+/*
+ * Copyright 2012-2015 University of Chicago and Argonne National Laboratory
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License
+ */
+
+/*
+ * Load generator for sudoku_server.  At each concurrency level, that many
+ * clients each open a connection and send puzzles one at a time, waiting
+ * for each reply before sending the next.  Reports latency percentiles
+ * and throughput per level.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define MAX_LEVELS 32
+
+struct level {
+  int concurrency;
+  long nrequests;
+  long next;          // next request to claim
+  double *latency;    // seconds, per request
+  long ok;
+  long failed;        // TIMEOUT, LIMIT, UNSOLVABLE or ERROR replies
+};
+
+static char *socket_path = NULL;
+static char **puzzles = NULL;
+static int npuzzles = 0;
+static char *request_opts = "";
+
+static void usage(char *prog) {
+  fprintf(stderr, "usage: %s [options] puzzle files...\n"
+      "  -s, --socket=PATH         server socket\n"
+      "  -c, --concurrency=LIST    comma-separated client counts "
+                                  "(default 1,2,4,8,16)\n"
+      "  -n, --requests=N          requests per level (default 1000)\n"
+      "  -o, --options=OPTS        key=value options sent with each request,\n"
+      "                            e.g. \"deadline=100 engine=bfs\"\n",
+      prog);
+}
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int connect_unix(const char *path) {
+  struct sockaddr_un addr;
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    perror("socket");
+    exit(1);
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    perror(path);
+    exit(1);
+  }
+  return fd;
+}
+
+static void *client_thread(void *arg) {
+  struct level *lv = arg;
+  int fd = connect_unix(socket_path);
+  FILE *in = fdopen(fd, "r");
+  FILE *out = fdopen(dup(fd), "w");
+  assert(in != NULL && out != NULL);
+  char *line = NULL;
+  size_t size = 0;
+  long ok = 0, failed = 0;
+
+  while (true) {
+    long i = __atomic_fetch_add(&lv->next, 1, __ATOMIC_RELAXED);
+    if (i >= lv->nrequests) {
+      break;
+    }
+    double start = now_seconds();
+    fprintf(out, "id=%ld %s %s\n", i, request_opts, puzzles[i % npuzzles]);
+    fflush(out);
+    if (getline(&line, &size, in) < 0) {
+      fprintf(stderr, "Server closed connection\n");
+      exit(1);
+    }
+    lv->latency[i] = now_seconds() - start;
+    char *status = strchr(line, ' ');
+    if (status != NULL && strncmp(status + 1, "OK ", 3) == 0) {
+      ok++;
+    } else {
+      failed++;
+    }
+  }
+  __atomic_fetch_add(&lv->ok, ok, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&lv->failed, failed, __ATOMIC_RELAXED);
+  free(line);
+  fclose(in);
+  fclose(out);
+  return NULL;
+}
+
+static int cmp_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+static void run_level(struct level *lv) {
+  lv->next = 0;
+  lv->ok = lv->failed = 0;
+  lv->latency = calloc(lv->nrequests, sizeof(double));
+  assert(lv->latency != NULL);
+  pthread_t *threads = malloc(sizeof(pthread_t) * lv->concurrency);
+  assert(threads != NULL);
+
+  double start = now_seconds();
+  for (int t = 0; t < lv->concurrency; t++) {
+    pthread_create(&threads[t], NULL, client_thread, lv);
+  }
+  for (int t = 0; t < lv->concurrency; t++) {
+    pthread_join(threads[t], NULL);
+  }
+  double elapsed = now_seconds() - start;
+
+  qsort(lv->latency, lv->nrequests, sizeof(double), cmp_double);
+  double p50 = lv->latency[(lv->nrequests - 1) * 50 / 100];
+  double p99 = lv->latency[(lv->nrequests - 1) * 99 / 100];
+  fprintf(stderr, "Summary: concurrency=%d requests=%ld ok=%ld failed=%ld "
+          "p50=%.3fms p99=%.3fms max=%.3fms time=%.3fs req/s=%.1f\n",
+          lv->concurrency, lv->nrequests, lv->ok, lv->failed,
+          p50 * 1000, p99 * 1000, lv->latency[lv->nrequests - 1] * 1000,
+          elapsed, lv->nrequests / elapsed);
+  free(threads);
+  free(lv->latency);
+}
+
+static void read_puzzles(const char *file) {
+  FILE *in = fopen(file, "r");
+  if (in == NULL) {
+    fprintf(stderr, "Could not open input file %s, exiting\n", file);
+    exit(1);
+  }
+  char *line = NULL;
+  size_t size = 0;
+  ssize_t len;
+  while ((len = getline(&line, &size, in)) >= 0) {
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+      line[--len] = '\0';
+    }
+    if (len == 0) {
+      continue;
+    }
+    puzzles = realloc(puzzles, sizeof(char *) * (npuzzles + 1));
+    assert(puzzles != NULL);
+    puzzles[npuzzles++] = strdup(line);
+  }
+  free(line);
+  fclose(in);
+}
+
+int main(int argc, char **argv) {
+  static struct option long_opts[] = {
+    {"socket", required_argument, NULL, 's'},
+    {"concurrency", required_argument, NULL, 'c'},
+    {"requests", required_argument, NULL, 'n'},
+    {"options", required_argument, NULL, 'o'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0}
+  };
+  char *levels_arg = "1,2,4,8,16";
+  long nrequests = 1000;
+  int opt;
+  while ((opt = getopt_long(argc, argv, "s:c:n:o:h", long_opts,
+                            NULL)) != -1) {
+    switch (opt) {
+      case 's':
+        socket_path = optarg;
+        break;
+      case 'c':
+        levels_arg = optarg;
+        break;
+      case 'n':
+        nrequests = atol(optarg);
+        break;
+      case 'o':
+        request_opts = optarg;
+        break;
+      case 'h':
+        usage(argv[0]);
+        return 0;
+      default:
+        usage(argv[0]);
+        exit(1);
+    }
+  }
+  if (socket_path == NULL || optind >= argc || nrequests <= 0) {
+    usage(argv[0]);
+    exit(1);
+  }
+  for (int arg = optind; arg < argc; arg++) {
+    read_puzzles(argv[arg]);
+  }
+  if (npuzzles == 0) {
+    fprintf(stderr, "No puzzles read\n");
+    exit(1);
+  }
+  signal(SIGPIPE, SIG_IGN);
+
+  struct level levels[MAX_LEVELS];
+  int nlevels = 0;
+  char *levels_copy = strdup(levels_arg);
+  for (char *tok = strtok(levels_copy, ","); tok != NULL && nlevels < MAX_LEVELS;
+       tok = strtok(NULL, ",")) {
+    int c = atoi(tok);
+    if (c <= 0) {
+      usage(argv[0]);
+      exit(1);
+    }
+    levels[nlevels].concurrency = c;
+    levels[nlevels].nrequests = nrequests;
+    nlevels++;
+  }
+  free(levels_copy);
+
+  for (int i = 0; i < nlevels; i++) {
+    run_level(&levels[i]);
+  }
+  return 0;
+}
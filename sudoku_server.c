@@ -0,0 +1,557 @@
+/*
+ * Copyright 2012-2015 University of Chicago and Argonne National Laboratory
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License
+ */
+
+/*
+ * Long-running solver service.  Requests are read one per line from a
+ * Unix-domain socket (or stdin) and solved by a pool of threads, each
+ * with its own warm solver context.
+ *
+ * Request:  [key=value ...] <board in board_text_to_bin format>
+ *   id=STRING     echoed in the reply (default: request number on the
+ *                 connection, starting at 1)
+ *   deadline=MS   give up after this many milliseconds
+ *   limit=N       give up after expanding this many nodes
+ *   engine=NAME   dfs (default), or bfs to split breadth-first first
+ *
+ * Reply:    <id> OK <ms> <solution>
+ *           <id> UNSOLVABLE <ms>
+ *           <id> TIMEOUT <ms>
+ *           <id> LIMIT <ms>
+ *           <id> ERROR <message>
+ *
+ * Replies on a connection may arrive out of order when several requests
+ * are in flight; match them up by id.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "sudoku_solve.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <assert.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// DFS passes between deadline and limit checks
+#define CHECK_INTERVAL 256
+// Boards generated breadth-first by engine=bfs
+#define BFS_SPLIT 32
+#define MAX_ID_LEN 64
+
+enum engine {
+  ENGINE_DFS,
+  ENGINE_BFS,
+};
+
+static const char *engine_names[] = {"dfs", "bfs"};
+#define N_ENGINES ((int)(sizeof(engine_names) / sizeof(engine_names[0])))
+
+/* A client connection.  Freed once the reader and all requests from it
+ * are done */
+struct conn {
+  int infd;
+  int outfd;
+  pthread_mutex_t lock; // protects writes to outfd and refs
+  int refs;
+};
+
+struct request {
+  struct conn *conn;
+  char *line;
+  long seq;
+  struct request *next;
+};
+
+/* FIFO of requests waiting for a solver thread */
+struct queue {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct request *head;
+  struct request *tail;
+};
+
+struct options {
+  enum branch_heuristic heuristic;
+  enum value_order order;
+  int probe_depth;
+  int probe_width;
+};
+
+static struct queue queue = {PTHREAD_MUTEX_INITIALIZER,
+                             PTHREAD_COND_INITIALIZER, NULL, NULL};
+static struct options options = {BRANCH_MRV, VALUE_ORDER_DEFAULT, 0, 4};
+
+static void usage(char *prog) {
+  fprintf(stderr, "usage: %s [options]\n"
+      "  -s, --socket=PATH    listen on a Unix-domain socket\n"
+      "  -i, --stdin          read requests from stdin, reply on stdout\n"
+      "  -j, --threads=N      solver threads (default 4)\n"
+      "  -b, --branch=NAME    branching heuristic, as for sudoku\n"
+      "  -v, --values=NAME    value ordering, as for sudoku\n"
+      "  -p, --probe=DEPTH    probing depth, as for sudoku\n"
+      "  -w, --probe-width=N  probing width, as for sudoku\n",
+      prog);
+}
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static bool write_all(int fd, const void *buf, size_t len) {
+  const char *p = buf;
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+static void conn_release(struct conn *conn) {
+  pthread_mutex_lock(&conn->lock);
+  bool last = --conn->refs == 0;
+  pthread_mutex_unlock(&conn->lock);
+  if (last) {
+    if (conn->infd != STDIN_FILENO) {
+      close(conn->infd);
+    }
+    pthread_mutex_destroy(&conn->lock);
+    free(conn);
+  }
+}
+
+static void send_reply(struct conn *conn, const char *reply) {
+  pthread_mutex_lock(&conn->lock);
+  // Client may have gone away, in which case the reply is dropped
+  write_all(conn->outfd, reply, strlen(reply));
+  pthread_mutex_unlock(&conn->lock);
+}
+
+static void queue_push(struct request *req) {
+  pthread_mutex_lock(&queue.lock);
+  req->next = NULL;
+  if (queue.tail == NULL) {
+    queue.head = req;
+  } else {
+    queue.tail->next = req;
+  }
+  queue.tail = req;
+  pthread_cond_signal(&queue.cond);
+  pthread_mutex_unlock(&queue.lock);
+}
+
+static struct request *queue_pop(void) {
+  pthread_mutex_lock(&queue.lock);
+  while (queue.head == NULL) {
+    pthread_cond_wait(&queue.cond, &queue.lock);
+  }
+  struct request *req = queue.head;
+  queue.head = req->next;
+  if (queue.head == NULL) {
+    queue.tail = NULL;
+  }
+  pthread_mutex_unlock(&queue.lock);
+  return req;
+}
+
+/* DFS quota until the next check: CHECK_INTERVAL, or fewer if that
+ * would overshoot the node limit */
+static long check_quota(struct sudoku_ctx *ctx, long limit) {
+  if (limit < 0) {
+    return CHECK_INTERVAL;
+  }
+  struct solver_stats st;
+  get_solver_stats_ctx(ctx, &st);
+  long left = limit - st.nodes;
+  return left < 1 ? 1 : (left < CHECK_INTERVAL ? left : CHECK_INTERVAL);
+}
+
+enum result {
+  RESULT_SOLVED,
+  RESULT_UNSOLVABLE,
+  RESULT_TIMEOUT,
+  RESULT_LIMIT,
+};
+
+/*
+ * Solve a puzzle, checking the deadline (absolute, in seconds, or < 0)
+ * and node limit (< 0 for none) every CHECK_INTERVAL passes.  The solution
+ * is copied into solution.
+ */
+static enum result solve_request(struct sudoku_ctx *ctx, cell_t *cells,
+        enum engine engine, double deadline, long limit, cell_t *solution) {
+  reset_solver_stats_ctx(ctx);
+  struct board *init = create_board_ctx(ctx, cells);
+  struct boardlist *l;
+  if (engine == ENGINE_BFS) {
+    // Search the breadth-first frontier depth-first
+    l = sudoku_solver_ctx(ctx, init, true, BFS_SPLIT);
+  } else {
+    l = sudoku_solver_ctx(ctx, init, false, check_quota(ctx, limit));
+  }
+
+  while (l != NULL && !boardlist_solved(l)) {
+    struct solver_stats st;
+    get_solver_stats_ctx(ctx, &st);
+    if (limit >= 0 && st.nodes >= limit) {
+      free_boardlist_ctx(ctx, l, true);
+      return RESULT_LIMIT;
+    }
+    if (deadline >= 0 && now_seconds() >= deadline) {
+      free_boardlist_ctx(ctx, l, true);
+      return RESULT_TIMEOUT;
+    }
+    l = sudoku_solver_resume_ctx(ctx, l, false, check_quota(ctx, limit));
+  }
+  if (l == NULL) {
+    return RESULT_UNSOLVABLE;
+  }
+  memcpy(solution, boardlist_get(l, 0)->board, CELLS_MEM);
+  free_boardlist_ctx(ctx, l, true);
+  return RESULT_SOLVED;
+}
+
+/*
+ * Parse the key=value options at the start of a request line and return
+ * a pointer to the board text, or NULL with an error message in err.
+ */
+static char *parse_options(char *line, long seq, char *id, double *deadline_ms,
+                           long *limit, enum engine *engine, const char **err) {
+  snprintf(id, MAX_ID_LEN, "%ld", seq);
+  *deadline_ms = -1;
+  *limit = -1;
+  *engine = ENGINE_DFS;
+
+  char *p = line;
+  while (true) {
+    while (isspace((unsigned char)*p)) {
+      p++;
+    }
+    char *end = p;
+    while (*end != '\0' && !isspace((unsigned char)*end)) {
+      end++;
+    }
+    char *eq = memchr(p, '=', end - p);
+    if (eq == NULL) {
+      return p;
+    }
+    char saved = *end;
+    *end = '\0';
+    *eq = '\0';
+    char *key = p, *val = eq + 1;
+    if (strcmp(key, "id") == 0) {
+      snprintf(id, MAX_ID_LEN, "%s", val);
+    } else if (strcmp(key, "deadline") == 0) {
+      *deadline_ms = atof(val);
+    } else if (strcmp(key, "limit") == 0) {
+      *limit = atol(val);
+    } else if (strcmp(key, "engine") == 0) {
+      int e;
+      for (e = 0; e < N_ENGINES; e++) {
+        if (strcmp(val, engine_names[e]) == 0) {
+          break;
+        }
+      }
+      if (e == N_ENGINES) {
+        *err = "unknown engine";
+        return NULL;
+      }
+      *engine = e;
+    } else {
+      *err = "unknown option";
+      return NULL;
+    }
+    *end = saved;
+    p = end;
+  }
+}
+
+static void handle_request(struct sudoku_ctx *ctx, struct request *req) {
+  double start = now_seconds();
+  char id[MAX_ID_LEN];
+  double deadline_ms;
+  long limit;
+  enum engine engine;
+  const char *err = NULL;
+  char *text = parse_options(req->line, req->seq, id, &deadline_ms, &limit,
+                             &engine, &err);
+  cell_t *cells = NULL;
+  char err_buf[160];
+  if (text != NULL) {
+    char why[128];
+    cells = malloc(sizeof(cell_t) * BOARD_CELLS);
+    assert(cells != NULL);
+    if (!board_text_read_explain(text, cells, why, sizeof(why))) {
+      free(cells);
+      cells = NULL;
+      snprintf(err_buf, sizeof(err_buf), "could not parse board: %s",
+               why);
+      err = err_buf;
+    } else if (!board_givens_consistent(cells, why, sizeof(why))) {
+      free(cells);
+      cells = NULL;
+      snprintf(err_buf, sizeof(err_buf), "conflicting givens: %s", why);
+      err = err_buf;
+    }
+  }
+
+  char *reply;
+  size_t reply_size;
+  if (cells == NULL) {
+    reply_size = MAX_ID_LEN + strlen(err) + 16;
+    reply = malloc(reply_size);
+    snprintf(reply, reply_size, "%s ERROR %s\n", id, err);
+  } else {
+    cell_t solution[BOARD_CELLS];
+    double deadline = deadline_ms < 0 ? -1 : start + deadline_ms / 1000.0;
+    enum result res = solve_request(ctx, cells, engine, deadline, limit,
+                                    solution);
+    double ms = (now_seconds() - start) * 1000.0;
+    static const char *status[] = {"OK", "UNSOLVABLE", "TIMEOUT", "LIMIT"};
+    char why[128];
+    if (res == RESULT_SOLVED &&
+        !board_verify_explain(cells, solution, why, sizeof(why))) {
+      // Never serve a wrong solution
+      reply_size = MAX_ID_LEN + strlen(why) + 64;
+      reply = malloc(reply_size);
+      snprintf(reply, reply_size, "%s ERROR invalid solution: %s\n", id, why);
+    } else if (res == RESULT_SOLVED) {
+      char *soltext = board_bin_to_text(solution);
+      reply_size = MAX_ID_LEN + strlen(soltext) + 64;
+      reply = malloc(reply_size);
+      snprintf(reply, reply_size, "%s OK %.3f %s\n", id, ms, soltext);
+      free(soltext);
+    } else {
+      reply_size = MAX_ID_LEN + 64;
+      reply = malloc(reply_size);
+      snprintf(reply, reply_size, "%s %s %.3f\n", id, status[res], ms);
+    }
+    free(cells);
+  }
+  send_reply(req->conn, reply);
+  free(reply);
+}
+
+static void *solver_thread(void *arg) {
+  struct sudoku_ctx *ctx = sudoku_ctx_create(0);
+  set_branch_heuristic_ctx(ctx, options.heuristic);
+  set_value_order_ctx(ctx, options.order);
+  set_probing_ctx(ctx, options.probe_depth, options.probe_width);
+  while (true) {
+    struct request *req = queue_pop();
+    handle_request(ctx, req);
+    conn_release(req->conn);
+    free(req->line);
+    free(req);
+  }
+  return NULL;
+}
+
+/* Read request lines from a connection and queue them */
+static void *reader_thread(void *arg) {
+  struct conn *conn = arg;
+  FILE *in = fdopen(dup(conn->infd), "r");
+  if (in == NULL) {
+    conn_release(conn);
+    return NULL;
+  }
+  char *line = NULL;
+  size_t size = 0;
+  long seq = 0;
+  ssize_t len;
+  while ((len = getline(&line, &size, in)) >= 0) {
+    // Skip blank lines
+    if (strspn(line, " \t\r\n") == (size_t)len) {
+      continue;
+    }
+    struct request *req = malloc(sizeof(struct request));
+    assert(req != NULL);
+    req->conn = conn;
+    req->line = strdup(line);
+    req->seq = ++seq;
+    pthread_mutex_lock(&conn->lock);
+    conn->refs++;
+    pthread_mutex_unlock(&conn->lock);
+    queue_push(req);
+  }
+  free(line);
+  fclose(in);
+  conn_release(conn);
+  return NULL;
+}
+
+static struct conn *new_conn(int infd, int outfd) {
+  struct conn *conn = malloc(sizeof(struct conn));
+  assert(conn != NULL);
+  conn->infd = infd;
+  conn->outfd = outfd;
+  conn->refs = 1; // held by the reader
+  pthread_mutex_init(&conn->lock, NULL);
+  return conn;
+}
+
+static int listen_unix(const char *path) {
+  struct sockaddr_un addr;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path too long: %s\n", path);
+    exit(1);
+  }
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    perror("socket");
+    exit(1);
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  unlink(path);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      listen(fd, 128) != 0) {
+    perror(path);
+    exit(1);
+  }
+  return fd;
+}
+
+int main(int argc, char **argv) {
+  init_solver(0);
+
+  static struct option long_opts[] = {
+    {"socket", required_argument, NULL, 's'},
+    {"stdin", no_argument, NULL, 'i'},
+    {"threads", required_argument, NULL, 'j'},
+    {"branch", required_argument, NULL, 'b'},
+    {"values", required_argument, NULL, 'v'},
+    {"probe", required_argument, NULL, 'p'},
+    {"probe-width", required_argument, NULL, 'w'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0}
+  };
+  char *socket_path = NULL;
+  bool use_stdin = false;
+  int nthreads = 4;
+  int opt;
+  while ((opt = getopt_long(argc, argv, "s:ij:b:v:p:w:h", long_opts,
+                            NULL)) != -1) {
+    int val;
+    switch (opt) {
+      case 's':
+        socket_path = optarg;
+        break;
+      case 'i':
+        use_stdin = true;
+        break;
+      case 'j':
+        nthreads = atoi(optarg);
+        break;
+      case 'b':
+        val = branch_heuristic_from_name(optarg);
+        if (val < 0) {
+          fprintf(stderr, "Unknown branching heuristic %s\n", optarg);
+          exit(1);
+        }
+        options.heuristic = val;
+        break;
+      case 'v':
+        val = value_order_from_name(optarg);
+        if (val < 0) {
+          fprintf(stderr, "Unknown value order %s\n", optarg);
+          exit(1);
+        }
+        options.order = val;
+        break;
+      case 'p':
+        options.probe_depth = atoi(optarg);
+        break;
+      case 'w':
+        options.probe_width = atoi(optarg);
+        break;
+      case 'h':
+        usage(argv[0]);
+        return 0;
+      default:
+        usage(argv[0]);
+        exit(1);
+    }
+  }
+  if ((socket_path == NULL) == !use_stdin || nthreads <= 0 ||
+      options.probe_depth < 0 || options.probe_width <= 0 ||
+      options.probe_width > MAX_PROBE_WIDTH) {
+    usage(argv[0]);
+    exit(1);
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+  fprintf(stderr, "Sudoku server for %ix%i boards, %d threads\n",
+          BOARD_WIDTH, BOARD_WIDTH, nthreads);
+
+  for (int i = 0; i < nthreads; i++) {
+    pthread_t t;
+    pthread_create(&t, NULL, solver_thread, NULL);
+    pthread_detach(t);
+  }
+
+  if (use_stdin) {
+    struct conn *conn = new_conn(STDIN_FILENO, STDOUT_FILENO);
+    // Keep conn alive until all replies are written
+    conn->refs++;
+    reader_thread(conn);
+    while (true) {
+      pthread_mutex_lock(&conn->lock);
+      int refs = conn->refs;
+      pthread_mutex_unlock(&conn->lock);
+      if (refs == 1) {
+        break;
+      }
+      struct timespec ts = {0, 1000000};
+      nanosleep(&ts, NULL);
+    }
+    return 0;
+  }
+
+  int listenfd = listen_unix(socket_path);
+  fprintf(stderr, "Listening on %s\n", socket_path);
+  while (true) {
+    int fd = accept(listenfd, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      perror("accept");
+      exit(1);
+    }
+    struct conn *conn = new_conn(fd, fd);
+    pthread_t t;
+    pthread_create(&t, NULL, reader_thread, conn);
+    pthread_detach(t);
+  }
+}
@@ -14,6 +14,8 @@
  * limitations under the License
  */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include "sudoku_solve.h"
 
 #include <stdio.h>
@@ -24,6 +26,14 @@
 #include <math.h>
 #include <assert.h>
 #include <time.h>
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #ifdef TRACE
 #define DPRINTF(...) fprintf(stderr,  __VA_ARGS__)
@@ -38,14 +48,98 @@
  * Constants and constant data structures
  ******************************************************************************/
 #define BUF_SIZE (BOARD_CELLS * 10)
-static mask_t num_masks[N_VALUES];
-bool solver_init = false;
+// Boards kept for reuse by each context
+#define BOARD_POOL_MAX 1024
+#define CHANGESTACK_INIT_SIZE 1024
+// Trace events are handed to the writer thread in blocks of this many
+#define TRACE_BLOCK_EVENTS 1024
+// Events recorded between clock reads
+#define TRACE_CLOCK_EVENTS 16
+// Blocks per log, shared by the contexts writing to it
+#define TRACE_BLOCKS 256
+// Full blocks queued before the writer thread is woken
+#define TRACE_WRITE_BLOCKS 32
+// Boards in a batch written to one spill file, as a fraction of the most
+// kept in memory
+#define SPILL_BATCH_DIVISOR 4
+// Boards per writev or readv of a spill file, the least IOV_MAX allowed
+#define SPILL_IOV_BOARDS 16
+// Bits per cell in the board wire format, enough for 0 to N_VALUES
+#define WIRE_CELL_BITS \
+    (N_VALUES < 4 ? 2 : N_VALUES < 8 ? 3 : N_VALUES < 16 ? 4 : \
+     N_VALUES < 32 ? 5 : N_VALUES < 64 ? 6 : N_VALUES < 128 ? 7 : 8)
+#define WIRE_CELL_MASK ((((uint64_t)1) << WIRE_CELL_BITS) - 1)
+// Packed cells, in whole 64-bit words, and masks of a serialized board
+#define WIRE_CELLS_SIZE \
+    ((((size_t)BOARD_CELLS * WIRE_CELL_BITS + 63) / 64) * sizeof(uint64_t))
+#define WIRE_MASKS_SIZE (3 * sizeof(mask_t) * BOARD_WIDTH)
+// Triage thresholds, in cells left empty by propagation.  Bigger boards
+// branch over more cells, so a smaller fraction of them makes a hard
+// puzzle: 54 and all 81 cells for 9x9, 2000 and 3000 for 100x100
+#define TRIAGE_INLINE_DEFAULT (2 * BOARD_CELLS / BLOCK_WIDTH)
+#define TRIAGE_STRONG_DEFAULT \
+    (3 * BOARD_CELLS / BLOCK_WIDTH < BOARD_CELLS ? \
+     3 * BOARD_CELLS / BLOCK_WIDTH : BOARD_CELLS)
+// Depth-first passes a portfolio member runs between checks for another
+// member having finished, times half the frontier size (see the DFS loop)
+#define PORTFOLIO_SLICE 4
+
+static const char *branch_heuristic_names[] = {"mrv", "degree", "unit"};
+static const char *value_order_names[] = {"default", "lowest", "lcv"};
+static const char *solver_engine_names[] = {"generic", "bitboard"};
+static const char *solve_route_names[] = {"inline", "strong", "portfolio"};
+#define N_BRANCH_HEURISTICS \
+    ((int)(sizeof(branch_heuristic_names) / sizeof(branch_heuristic_names[0])))
+#define N_VALUE_ORDERS \
+    ((int)(sizeof(value_order_names) / sizeof(value_order_names[0])))
+#define N_SOLVER_ENGINES \
+    ((int)(sizeof(solver_engine_names) / sizeof(solver_engine_names[0])))
+
+// The bitboard engine needs a board that fits a few 64-bit words
+#if BLOCK_WIDTH <= 4
+#define BITBOARD_ENGINE
+#endif
+// The SIMD batch engine keeps 9-bit masks in 16-bit lanes.  Vectors wider
+// than the target's registers are passed differently, so 256-bit vectors
+// need AVX
+#if BLOCK_WIDTH == 3
+#define SIMD_ENGINE
+#ifndef SIMD_LANES
+#ifdef __AVX__
+#define SIMD_LANES 16
+#else
+#define SIMD_LANES 8
+#endif
+#endif
+#endif
+// The 9x9 verifier shifts a bit into each 16-bit lane by that lane's
+// value, which takes one instruction with AVX-512BW and is slower than the
+// scalar loop without it
+#if BLOCK_WIDTH == 3 && defined(__AVX512BW__) && defined(__AVX512VL__)
+#define SIMD_VERIFY
+#endif
 
 /******************************************************************************
  * Solver data structures
  ******************************************************************************/
 #define MASK_MASK ((((uint64_t)1) << (N_VALUES % MASK_ELEM_BITS)) - 1)
 
+// A board's unit masks, in either layout.  Block b lies in band
+// b / BLOCK_WIDTH, like the rows of that band
+#ifdef INTERLEAVED_MASKS
+#define ROW_MASK(b, row) \
+    ((b)->bands[(row) / BLOCK_WIDTH].rows[(row) % BLOCK_WIDTH])
+#define BLOCK_MASK(b, block) \
+    ((b)->bands[(block) / BLOCK_WIDTH].blocks[(block) % BLOCK_WIDTH])
+#define CELL_BLOCK_MASK(b, row, col) \
+    ((b)->bands[(row) / BLOCK_WIDTH].blocks[(col) / BLOCK_WIDTH])
+#else
+#define ROW_MASK(b, row) ((b)->row_masks[row])
+#define BLOCK_MASK(b, block) ((b)->block_masks[block])
+#define CELL_BLOCK_MASK(b, row, col) ((b)->block_masks[get_block(row, col)])
+#endif
+#define COL_MASK(b, col) ((b)->col_masks[col])
+
 struct cell {
     int row;
     int col;
@@ -57,27 +151,380 @@ struct changestack {
     int size;
 };
 
+// Where to branch: either every candidate value of one cell, or every
+// candidate position of one value within a unit (row, col or block)
+struct branch {
+    int nchoices; // number of boards the branch creates, 0 => dead end
+    bool unit;
+    struct cell cell;
+    int value;
+    struct cell positions[BOARD_WIDTH];
+};
+
+#define N_UNITS (3 * BOARD_WIDTH)
+
+// A cell whose candidates were narrowed down by probing
+struct refined {
+    struct cell cell;
+    mask_t mask;
+    int nchoices; // 0 if no cell was refined
+};
+
+#if BOARD_CELLS > 65535
+typedef uint32_t cellpos_t;
+#else
+typedef uint16_t cellpos_t;
+#endif
+
+// A cell filled in, as recorded by a frontier node
+struct delta {
+    cellpos_t pos;   // row * BOARD_WIDTH + col
+    cell_t val;
+};
+
+/* Compact frontier entry: the parent node's board plus deltas.  A node is
+ * shared by its children and freed with the last reference to it.  A cell
+ * is filled in at most once along a path, so the deltas of a node and its
+ * ancestors can be applied in any order. */
+struct frontier_node {
+    struct frontier_node *parent;
+    uint64_t trace_id;  // of the board expanded into this node, if traced
+    int depth;
+    int refs;
+    int ndeltas;
+    struct delta deltas[];
+};
+
+enum expansion {
+    EXPAND_DEADEND,
+    EXPAND_SOLVED,
+    EXPAND_BRANCH,
+};
+
+#ifdef BITBOARD_ENGINE
+#define BB_WORDS ((BOARD_CELLS + 63) / 64)
+
+// One bit per cell, cell row * BOARD_WIDTH + col in bit 0 upwards
+struct bitboard {
+    uint64_t w[BB_WORDS];
+};
+typedef struct bitboard bitboard_t;
+
+struct bb_board {
+    bitboard_t cand[N_VALUES];    // empty cells where each value can go
+    bitboard_t placed[N_VALUES];  // cells holding each value
+    cell_t cells[BOARD_CELLS];
+    int nfilled;
+};
+
+// Cells of each unit, and of each cell's row, col and block together
+static bitboard_t bb_units[N_UNITS];
+static bitboard_t bb_peers[BOARD_CELLS];
+static bitboard_t bb_all;
+static pthread_once_t bb_tables_once = PTHREAD_ONCE_INIT;
+#endif
+
+#ifdef SIMD_ENGINE
+// Lane l of a vector belongs to the puzzle in lane l
+typedef uint16_t vmask_t __attribute__((vector_size(2 * SIMD_LANES)));
+
+struct simd_lanes {
+    vmask_t cells[BOARD_CELLS];   // bit of the value in each cell, 0 if empty
+    vmask_t row[BOARD_WIDTH];     // used values, as in struct board
+    vmask_t col[BOARD_WIDTH];
+    vmask_t block[BOARD_WIDTH];
+};
+
+// One lane's board, saved for backtracking
+struct simd_lane_state {
+    uint16_t cells[BOARD_CELLS];
+    uint16_t row[BOARD_WIDTH];
+    uint16_t col[BOARD_WIDTH];
+    uint16_t block[BOARD_WIDTH];
+};
+
+static uint8_t simd_row[BOARD_CELLS];
+static uint8_t simd_col[BOARD_CELLS];
+static uint8_t simd_block[BOARD_CELLS];
+static pthread_once_t simd_tables_once = PTHREAD_ONCE_INIT;
+#endif
+
+// Events recorded by one context, written out as a struct trace_block
+struct trace_buf {
+    struct trace_event events[TRACE_BLOCK_EVENTS];
+    int n;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+/* Trace events in flight.  Each attached context fills a buffer from the
+ * free stack and passes it to the writer thread through the full ring. */
+struct trace_log {
+    FILE *out;
+    uint64_t start_ns;
+    uint64_t next_id;
+    uint32_t next_thread;
+    int attached;           // contexts holding a buffer
+    bool closing;
+    bool error;
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t filled;  // buffers were queued for writing, or closing
+    pthread_cond_t freed;   // a buffer was returned to the free stack
+    struct trace_buf *bufs;
+    // Empty buffers, the one last written out on top, so that only as many
+    // are touched as are in flight
+    int free_stack[TRACE_BLOCKS];
+    int nfree;
+    // Full buffers and the thread each came from
+    int full_ring[TRACE_BLOCKS];
+    uint32_t full_thread[TRACE_BLOCKS];
+    int full_head, nfull;
+};
+
+/* One file of boards spilled from a frontier */
+struct spill_batch {
+    char *path;
+    int nboards;
+};
+
+/* Spilled part of a boardlist.  Depth-first, batches are a stack below the
+ * in-memory boards; breadth-first, a queue between the in-memory boards
+ * and the tail, where children go while older boards are spilled */
+struct frontier_spill {
+    struct spill_batch *batches;    // oldest first
+    int first;                      // oldest batch not yet read back
+    int nbatches;
+    int size;
+    long nboards;                   // boards in batches [first, nbatches)
+    bool lifo;                      // read back newest batch first
+    struct board **tail;
+    int tail_len;
+    int tail_size;
+};
+
+/* Progress of the depth-first search in sudoku_solver_resume_ctx.  Subtree
+ * estimates are summed up until the next report */
+struct progress_state {
+    uint64_t start_ns;
+    uint64_t last_report_ns;
+    uint64_t probe_ns;      // time spent on random probes
+    long start_nodes;
+    double sum;
+    long nsamples;
+    struct solver_progress last;
+};
+
+struct sudoku_ctx {
+    mask_t num_masks[N_VALUES];
+    uint64_t rng;
+
+    enum branch_heuristic branch_heuristic;
+    enum value_order value_order;
+    int probe_depth;
+    int probe_width;
+    bool compact_frontier;
+    int bfs_threads;
+    enum solver_engine engine;
+
+    struct solver_stats stats;
+
+    // Freed boards, reused by clone_board, up to pool_max of them
+    struct board **pool;
+    int pool_len;
+    int pool_max;
+
+    // Scratch space for solve_step
+    struct changestack stack;
+    struct changestack trail;
+    // Cells of a compact frontier entry before it was expanded
+    cell_t before[BOARD_CELLS];
+
+    // Most boardlist entries kept in memory before spilling, 0 if off, and
+    // where the spill files go
+    long spill_max;
+    char *spill_dir;
+    // Set once a spill file could not be written, after which frontiers
+    // stay in memory
+    bool spill_failed;
+
+    // Triage thresholds, in cells left empty by propagation
+    int triage_inline;
+    int triage_strong;
+
+    // Contexts for the extra threads of parallel BFS and the members of a
+    // portfolio search, created on first use
+    struct sudoku_ctx **bfs_workers;
+    int n_bfs_workers;
+
+    // Search stack of the bitboard engine, allocated on first use
+    struct bb_board *bb_stack;
+
+    // Trace log, with the buffer being filled and this context's thread
+    // number in it, or NULL if not tracing
+    struct trace_log *trace;
+    int trace_buf;
+    uint32_t trace_thread;
+    // Id of the board last expanded, the end of the block of ids taken
+    // from the log, and why the board was a dead end if it was
+    uint64_t trace_id;
+    uint64_t trace_id_end;
+    enum trace_outcome trace_dead;
+    // Events waiting for their times, and the clock reading they followed
+    struct trace_event trace_untimed_events[TRACE_CLOCK_EVENTS];
+    int trace_untimed;
+    uint64_t trace_clock_ns;
+
+    // Progress reporting, 0 interval if off.  Probes use their own random
+    // number stream, so that reporting doesn't change the search
+    double progress_interval;
+    double progress_cpu;
+    uint64_t progress_rng;
+    struct progress_state progress;
+};
+
+/* One BFS level being expanded in parallel.  Entries [0, next) of cur are
+ * expanded, each into the output list of the thread that claimed it.
+ * Serial BFS stops after the first entry that is solved or takes the next
+ * level past the quota; that entry, the cut-off, is found by walking the
+ * expanded entries in order.  Entries claimed past it are put back
+ * unexpanded */
+struct bfs_level {
+    struct boardlist *cur;
+    int n;
+    long quota;
+    int next;                   // next entry to claim
+    bool stop;                  // cut-off found, claim nothing more
+    // Where the children of entry i went: out[owner[i]], from start[i]
+    int *owner;
+    int *start;
+    int *count;
+    // Each claimed entry as it was before it was expanded
+    struct board **orig;
+    struct frontier_node **orig_nodes;
+    // Guarded by lock
+    pthread_mutex_t lock;
+    char *state;                // BFS_PENDING, BFS_EXPANDED or BFS_SOLVED
+    int prefix;                 // entries [0, prefix) expanded, no cut-off
+    long prefix_generated;      // children of entries [0, prefix)
+    int cutoff;                 // -1 until found
+};
+
+enum bfs_entry_state {
+    BFS_PENDING,
+    BFS_EXPANDED,
+    BFS_SOLVED,                 // its only child is a solution
+};
+
+/* A worker's statistics before it expanded entry i, so that expansions
+ * past the cut-off can be taken out again */
+struct bfs_claim {
+    int i;
+    struct solver_stats stats;
+};
+
+struct bfs_worker {
+    struct bfs_level *level;
+    struct sudoku_ctx *ctx;
+    int id;
+    struct boardlist out;
+    // Claims not yet known to be before the cut-off, oldest first
+    struct bfs_claim *claims;
+    int claims_head;
+    int claims_len;
+    int claims_size;
+};
+
+/* Options of one member of a portfolio search */
+struct portfolio_strategy {
+    enum branch_heuristic branch;
+    enum value_order order;
+    int probe_depth;
+};
+
+/* Members are started in this order, so the strategies that do best
+ * across the puzzles/ corpus come first */
+static const struct portfolio_strategy portfolio_strategies[MAX_PORTFOLIO] = {
+    {BRANCH_UNIT, VALUE_ORDER_DEFAULT, 0},
+    {BRANCH_UNIT, VALUE_ORDER_DEFAULT, 1},
+    {BRANCH_MRV, VALUE_ORDER_DEFAULT, 0},
+    {BRANCH_UNIT, VALUE_ORDER_LCV, 1},
+    {BRANCH_MRV_DEGREE, VALUE_ORDER_LOWEST, 1},
+    {BRANCH_UNIT, VALUE_ORDER_LOWEST, 0},
+    {BRANCH_MRV, VALUE_ORDER_LCV, 2},
+    {BRANCH_MRV_DEGREE, VALUE_ORDER_DEFAULT, 0},
+};
+
+/* A portfolio search.  The first member to find a solution, or to run out
+ * of boards, sets done and the others stop at the end of their slice */
+struct portfolio {
+    bool done;
+    struct board *solution;
+};
+
+struct portfolio_member {
+    struct portfolio *pf;
+    struct sudoku_ctx *ctx;
+    struct board *start;
+};
+
+// Used by the functions without a _ctx suffix
+static struct sudoku_ctx default_ctx;
+bool solver_init = false;
+static pthread_mutex_t init_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /******************************************************************************
  * Data structure helper functions
  ******************************************************************************/
-static inline struct board *clone_board(struct board *board);
+static void ctx_init(struct sudoku_ctx *ctx, unsigned seed);
+static inline uint32_t ctx_rand(struct sudoku_ctx *ctx);
+static inline uint64_t clock_ns(void);
+static inline struct board *clone_board(struct sudoku_ctx *ctx,
+                                        struct board *board);
+static struct board *new_board(void);
+static int rebuild_masks(struct sudoku_ctx *ctx, struct board *b);
+static inline void clear_masks(struct board *b);
+static void masks_to_wire(struct board *b, unsigned char *out);
+static void masks_from_wire(struct board *b, const unsigned char *in);
+#ifndef NDEBUG
+static bool wire_masks_valid(struct sudoku_ctx *ctx, struct board *b,
+                             const unsigned char *in);
+#endif
+static inline uint64_t load_le64(const unsigned char *in);
+static bool verify_units(const cell_t *cells);
+static inline void store_le64(unsigned char *out, uint64_t word);
 
 static inline void mask_or(mask_t *mask1, mask_t mask2);
 static inline void mask_not(mask_t *mask);
 static inline void mask_and(mask_t *mask1, mask_t mask2);
+static inline void mask_andnot(mask_t *mask1, mask_t mask2);
 static inline mask_t get_mask(struct board *b, int row, int col);
 static inline void dump_mask(mask_t mask);
 static inline int mask_popcount(mask_t mask);
+static inline bool mask_test(mask_t mask, int val);
+static inline int mask_values(mask_t mask, int *values);
 
 #define get_cell(board, row, col) (board[row * BOARD_WIDTH + col])
-static inline void set_cell(struct board *b, int row, int col, int val);
+static inline void set_cell(struct sudoku_ctx *ctx, struct board *b, int row,
+                            int col, int val);
+static inline void unset_cell(struct sudoku_ctx *ctx, struct board *b,
+                              int row, int col);
 static inline int get_block(int row, int col);
 static inline int block_start_col(int block);
+static inline int block_start_row(int block);
+static inline struct cell unit_cell(int unit, int i);
+static inline mask_t unit_mask(struct board *b, int unit);
 static inline void change_push(struct changestack *stack, int row, int col);
 static inline struct cell change_pop(struct changestack *stack);
 
 static inline void add_board(struct boardlist *list, struct board *board);
-static inline struct board *remove_last_board(struct boardlist *list);
+static inline void add_node(struct boardlist *list, struct frontier_node *node);
+static inline struct board *take_entry(struct sudoku_ctx *ctx,
+        struct boardlist *list, int i, struct frontier_node **node);
+static inline void free_entry(struct sudoku_ctx *ctx, struct boardlist *list,
+                              int i);
+static struct frontier_node *new_node(struct frontier_node *parent,
+                                      int ndeltas);
+static void release_node(struct frontier_node *node);
+static void materialize_node(struct frontier_node *node, struct board *b);
 static inline void bump_boards(struct boardlist *list, int bump);
 static void init_boardlist(struct boardlist *list, int init_size);
 static inline void boardlist_resize(struct boardlist *boards, int neededsize);
@@ -85,27 +532,474 @@ static inline void boardlist_resize(struct boardlist *boards, int neededsize);
 /******************************************************************************
  * Core solver algorithm
  ******************************************************************************/
-static void solve_step(struct board *start, struct boardlist *boards);
-static bool check_cell(struct board *b, int row, int col, struct changestack *stack, bool firstpass);
+static void solve_step(struct sudoku_ctx *ctx, struct board *start,
+           struct boardlist *boards);
+static void compact_step(struct sudoku_ctx *ctx, struct board *start,
+           struct frontier_node *node, struct boardlist *boards);
+static enum expansion expand_board(struct sudoku_ctx *ctx, struct board *start,
+           struct branch *br, mask_t *mask);
+static enum expansion expand_untraced(struct sudoku_ctx *ctx,
+           struct board *start, struct branch *br, mask_t *mask);
+static bool parallel_bfs_level(struct sudoku_ctx *ctx,
+           struct boardlist *boards, long quota);
+static void *bfs_worker_run(void *arg);
+static void bfs_claim_push(struct bfs_worker *w, int i);
+static int bfs_level_advance(struct bfs_level *level, int i, bool solved);
+static struct frontier_node *copy_node(struct frontier_node *node);
+static void grow_workers(struct sudoku_ctx *ctx, int n);
+static void add_worker_stats(struct sudoku_ctx *ctx,
+           struct sudoku_ctx *worker);
+static void *portfolio_member_run(void *arg);
+
+/******************************************************************************
+ * Frontier spilling
+ ******************************************************************************/
+static inline int spill_batch_size(struct sudoku_ctx *ctx);
+static struct frontier_spill *get_spill(struct boardlist *list, bool lifo);
+static bool spill_io(int fd, struct board **boards, int n, bool write);
+static bool spill_write(struct sudoku_ctx *ctx, struct frontier_spill *spill,
+           struct board **boards, int n);
+static bool spill_read(struct sudoku_ctx *ctx, struct spill_batch *b,
+           struct boardlist *list);
+static bool spill_entries(struct sudoku_ctx *ctx, struct boardlist *list,
+           int from, int n, bool lifo);
+static void spill_children(struct sudoku_ctx *ctx, struct boardlist *list,
+           int from);
+static bool spill_refill(struct sudoku_ctx *ctx, struct boardlist *list);
+static void spill_free(struct sudoku_ctx *ctx, struct frontier_spill *spill);
+static bool spill_bfs(struct sudoku_ctx *ctx, struct boardlist *boards,
+           long quota);
+
+/******************************************************************************
+ * Progress estimation
+ ******************************************************************************/
+static struct board *copy_entry(struct sudoku_ctx *ctx,
+           struct boardlist *list, int i);
+static double probe_path(struct sudoku_ctx *ctx, struct board *b);
+static void progress_start(struct sudoku_ctx *ctx);
+static void progress_tick(struct sudoku_ctx *ctx, struct boardlist *boards);
+
+/******************************************************************************
+ * Search trace log
+ ******************************************************************************/
+static int trace_take_buf(struct trace_log *log);
+static void trace_submit(struct trace_log *log, int buf, uint32_t thread);
+static void trace_expansion(struct sudoku_ctx *ctx, struct board *b,
+           enum expansion e, int propagated, int nchoices);
+static void trace_end_events(struct sudoku_ctx *ctx, uint64_t now);
+static inline void trace_copy_event(struct trace_event *dst,
+           const struct trace_event *src);
+static void *trace_writer_run(void *arg);
+
+#ifdef BITBOARD_ENGINE
+/******************************************************************************
+ * Bitboard engine
+ ******************************************************************************/
+static void bitboard_init_tables(void);
+static inline bool bb_test(bitboard_t b, int pos);
+static inline void bb_set(bitboard_t *b, int pos);
+static inline void bb_clear(bitboard_t *b, int pos);
+static inline void bb_or(bitboard_t *a, bitboard_t b);
+static inline void bb_andnot(bitboard_t *a, bitboard_t b);
+static inline bitboard_t bb_and(bitboard_t a, bitboard_t b);
+static inline bool bb_empty(bitboard_t b);
+static inline int bb_popcount(bitboard_t b);
+static inline int bb_first(bitboard_t b);
+static inline void bb_place(struct bb_board *b, int pos, int val);
+static bool bb_load(struct bb_board *b, cell_t *cells);
+static inline void bb_count(struct bb_board *b, bitboard_t *ones,
+                            bitboard_t *twos, bitboard_t *threes);
+static bool bb_propagate(struct bb_board *b);
+static int bb_branch_cell(struct bb_board *b);
+static struct boardlist *bitboard_solver(struct sudoku_ctx *ctx,
+                                         struct board *start);
+#endif
+
+#ifdef SIMD_ENGINE
+/******************************************************************************
+ * SIMD batch engine
+ ******************************************************************************/
+static void simd_init_tables(void);
+static inline vmask_t vmask_popcount(vmask_t x);
+static inline bool vmask_any(vmask_t x);
+static inline void simd_lane_place(struct simd_lanes *s, int l, int pos,
+                                   uint16_t bit);
+static inline void simd_lane_save(struct simd_lanes *s, int l,
+                                  struct simd_lane_state *st);
+static inline void simd_lane_restore(struct simd_lanes *s, int l,
+                                     struct simd_lane_state *st);
+static bool simd_lane_load(struct simd_lanes *s, int l, cell_t *cells);
+static vmask_t simd_sweep(struct simd_lanes *s, vmask_t active,
+                          vmask_t *dead, vmask_t *best_cell);
+#endif
+static bool fill_singles(struct sudoku_ctx *ctx, struct board *b);
+static bool check_cell(struct sudoku_ctx *ctx, struct board *b, int row, int col,
+           struct changestack *stack, bool firstpass, struct changestack *trail);
+static bool propagate(struct sudoku_ctx *ctx, struct board *b,
+           struct changestack *stack, struct changestack *trail);
 static void trace_effects(struct board *b, int row, int col, mask_t changemask,
            struct changestack *stack);
-static struct cell best_branchpoint(struct board *b);
-static void do_branches(struct board *start, int row, int col, mask_t mask,
-        struct boardlist *boards);
+static void trace_peers(struct board *b, int row, int col, mask_t changemask,
+           struct changestack *stack);
+static bool assign(struct sudoku_ctx *ctx, struct board *b, int row, int col,
+           int val, struct changestack *stack, struct changestack *trail);
+static void undo_trail(struct sudoku_ctx *ctx, struct board *b,
+           struct changestack *trail);
+static int probe_candidates(struct sudoku_ctx *ctx, struct board *b,
+           struct cell *cells);
+static bool probe_board(struct sudoku_ctx *ctx, struct board *b,
+           struct changestack *stack, struct changestack *trail,
+           struct refined *best);
+static struct cell best_branchpoint(struct sudoku_ctx *ctx, struct board *b);
+static int empty_peers(struct board *b, int row, int col);
+static bool best_unit_branch(struct board *b, struct branch *br);
+static void choose_branch(struct sudoku_ctx *ctx, struct board *b,
+        struct branch *br);
+static int order_values(struct sudoku_ctx *ctx, struct board *b, int row,
+        int col, mask_t mask, int *values);
+static int branch_choices(struct sudoku_ctx *ctx, struct board *start,
+        struct branch *br, mask_t mask, struct cell *cells, int *values);
 
 
+static void ctx_init(struct sudoku_ctx *ctx, unsigned seed) {
+    memset(ctx, 0, sizeof(struct sudoku_ctx));
+    for (int i = 0; i < N_VALUES; i++) {
+        int off = i / MASK_ELEM_BITS;
+        assert(off < MASK_SIZE);
+        ctx->num_masks[i].vec[off] = ((uint64_t)1) << (i % MASK_ELEM_BITS);
+        //DPRINTF("mask %i: ", i); DDUMP_MASK(ctx->num_masks[i]);
+    }
+    // xorshift state must be non-zero
+    ctx->rng = ((uint64_t)seed * 0x9E3779B97F4A7C15ULL) | 1;
+
+    ctx->branch_heuristic = BRANCH_MRV;
+    ctx->value_order = VALUE_ORDER_DEFAULT;
+    ctx->probe_depth = 0;
+    ctx->probe_width = 4;
+    ctx->bfs_threads = 1;
+    ctx->engine = SOLVER_GENERIC;
+    ctx->progress_interval = 0;
+    ctx->progress_cpu = 0.05;
+    ctx->progress_rng = (ctx->rng ^ 0xD1B54A32D192ED03ULL) | 1;
+    ctx->triage_inline = TRIAGE_INLINE_DEFAULT;
+    ctx->triage_strong = TRIAGE_STRONG_DEFAULT;
+
+    ctx->pool = malloc(sizeof(struct board *) * BOARD_POOL_MAX);
+    assert(ctx->pool != NULL);
+    ctx->pool_len = 0;
+    ctx->pool_max = BOARD_POOL_MAX;
+
+    ctx->stack.size = CHANGESTACK_INIT_SIZE;
+    ctx->stack.len = 0;
+    ctx->stack.arr = malloc(sizeof(struct cell) * ctx->stack.size);
+    assert(ctx->stack.arr != NULL);
+    ctx->trail.size = CHANGESTACK_INIT_SIZE;
+    ctx->trail.len = 0;
+    ctx->trail.arr = malloc(sizeof(struct cell) * ctx->trail.size);
+    assert(ctx->trail.arr != NULL);
+}
+
 void init_solver(unsigned seed) {
+    pthread_mutex_lock(&init_lock);
     if (!solver_init) {
-        srand(seed);
-        for (int i = 0; i < N_VALUES; i++) {
-            memset(&(num_masks[i]), 0, sizeof(mask_t));
-            int off = i / MASK_ELEM_BITS;
-            assert(off < MASK_SIZE);
-            num_masks[i].vec[off] = ((uint64_t)1) << (i % MASK_ELEM_BITS);
-            //DPRINTF("mask %i: ", i); DDUMP_MASK(num_masks[i]);
-        }
+        ctx_init(&default_ctx, seed);
         solver_init = true;
     }
+    pthread_mutex_unlock(&init_lock);
+}
+
+struct sudoku_ctx *sudoku_ctx_create(unsigned seed) {
+    struct sudoku_ctx *ctx = malloc(sizeof(struct sudoku_ctx));
+    assert(ctx != NULL);
+    ctx_init(ctx, seed);
+    return ctx;
+}
+
+void sudoku_ctx_free(struct sudoku_ctx *ctx) {
+    set_trace_log_ctx(ctx, NULL);
+    for (int i = 0; i < ctx->pool_len; i++) {
+        free(ctx->pool[i]);
+    }
+    free(ctx->pool);
+    free(ctx->stack.arr);
+    free(ctx->trail.arr);
+    for (int i = 0; i < ctx->n_bfs_workers; i++) {
+        sudoku_ctx_free(ctx->bfs_workers[i]);
+    }
+    free(ctx->bfs_workers);
+    free(ctx->bb_stack);
+    free(ctx->spill_dir);
+    free(ctx);
+}
+
+struct sudoku_ctx *default_sudoku_ctx(void) {
+    assert(solver_init);
+    return &default_ctx;
+}
+
+/* xorshift64*, so each context has its own random stream */
+static inline uint32_t ctx_rand(struct sudoku_ctx *ctx) {
+    uint64_t x = ctx->rng;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    ctx->rng = x;
+    return (uint32_t)((x * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+static inline uint64_t clock_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void set_branch_heuristic_ctx(struct sudoku_ctx *ctx, enum branch_heuristic h) {
+    assert(h >= 0 && h < N_BRANCH_HEURISTICS);
+    ctx->branch_heuristic = h;
+}
+
+void set_value_order_ctx(struct sudoku_ctx *ctx, enum value_order o) {
+    assert(o >= 0 && o < N_VALUE_ORDERS);
+    ctx->value_order = o;
+}
+
+void set_probing_ctx(struct sudoku_ctx *ctx, int depth, int width) {
+    assert(depth >= 0);
+    assert(width > 0 && width <= MAX_PROBE_WIDTH);
+    ctx->probe_depth = depth;
+    ctx->probe_width = width;
+}
+
+void set_compact_frontier_ctx(struct sudoku_ctx *ctx, bool enable) {
+    ctx->compact_frontier = enable;
+}
+
+void set_bfs_threads_ctx(struct sudoku_ctx *ctx, int nthreads) {
+    assert(nthreads >= 1);
+    ctx->bfs_threads = nthreads;
+}
+
+void set_bfs_threads(int nthreads) {
+    set_bfs_threads_ctx(&default_ctx, nthreads);
+}
+
+void set_trace_log_ctx(struct sudoku_ctx *ctx, struct trace_log *log) {
+    for (int i = 0; i < ctx->n_bfs_workers; i++) {
+        set_trace_log_ctx(ctx->bfs_workers[i], log);
+    }
+    if (ctx->trace == log) {
+        return;
+    }
+    if (ctx->trace != NULL) {
+        trace_end_events(ctx, clock_ns());
+        trace_submit(ctx->trace, ctx->trace_buf, ctx->trace_thread);
+        __atomic_sub_fetch(&ctx->trace->attached, 1, __ATOMIC_RELAXED);
+    }
+    ctx->trace = log;
+    ctx->trace_id = 0;
+    ctx->trace_id_end = 0;
+    ctx->trace_untimed = 0;
+    if (log != NULL) {
+        // Each attached context holds a buffer, so some must be left over
+        int attached = __atomic_add_fetch(&log->attached, 1, __ATOMIC_RELAXED);
+        assert(attached <= TRACE_BLOCKS / 2);
+        (void)attached;
+        ctx->trace_thread = __atomic_fetch_add(&log->next_thread, 1,
+                                               __ATOMIC_RELAXED);
+        ctx->trace_buf = trace_take_buf(log);
+    }
+}
+
+void set_trace_log(struct trace_log *log) {
+    set_trace_log_ctx(&default_ctx, log);
+}
+
+void set_frontier_spill_ctx(struct sudoku_ctx *ctx, const char *dir,
+                            size_t max_bytes) {
+    free(ctx->spill_dir);
+    ctx->spill_dir = NULL;
+    ctx->spill_failed = false;
+    ctx->spill_max = max_bytes / sizeof(struct board);
+    ctx->pool_max = BOARD_POOL_MAX;
+    if (max_bytes > 0) {
+        assert(dir != NULL);
+        // The pool of freed boards counts towards the cap, at up to half
+        // a batch
+        long pool_max = ctx->spill_max / (2 * SPILL_BATCH_DIVISOR);
+        if (pool_max < ctx->pool_max) {
+            ctx->pool_max = (int)pool_max;
+        }
+        ctx->spill_max -= ctx->pool_max;
+        // Room for a batch and what a board can branch into
+        if (ctx->spill_max < 2 * SPILL_BATCH_DIVISOR * N_VALUES) {
+            ctx->spill_max = 2 * SPILL_BATCH_DIVISOR * N_VALUES;
+        }
+        ctx->spill_dir = strdup(dir);
+        assert(ctx->spill_dir != NULL);
+    }
+    while (ctx->pool_len > ctx->pool_max) {
+        free(ctx->pool[--ctx->pool_len]);
+    }
+}
+
+void set_frontier_spill(const char *dir, size_t max_bytes) {
+    set_frontier_spill_ctx(&default_ctx, dir, max_bytes);
+}
+
+void set_progress_ctx(struct sudoku_ctx *ctx, double interval,
+                      double cpu_fraction) {
+    assert(interval >= 0);
+    assert(cpu_fraction > 0 && cpu_fraction <= 1);
+    ctx->progress_interval = interval;
+    ctx->progress_cpu = cpu_fraction;
+}
+
+void set_progress(double interval, double cpu_fraction) {
+    set_progress_ctx(&default_ctx, interval, cpu_fraction);
+}
+
+void get_solver_progress_ctx(struct sudoku_ctx *ctx,
+                             struct solver_progress *out) {
+    *out = ctx->progress.last;
+}
+
+void get_solver_progress(struct solver_progress *out) {
+    get_solver_progress_ctx(&default_ctx, out);
+}
+
+void set_triage_thresholds_ctx(struct sudoku_ctx *ctx, int inline_empty,
+                               int strong_empty) {
+    assert(inline_empty >= 0 && strong_empty >= inline_empty);
+    ctx->triage_inline = inline_empty;
+    ctx->triage_strong = strong_empty;
+}
+
+void set_triage_thresholds(int inline_empty, int strong_empty) {
+    set_triage_thresholds_ctx(&default_ctx, inline_empty, strong_empty);
+}
+
+void triage_board_ctx(struct sudoku_ctx *ctx, struct board *b,
+                      struct triage *out) {
+    memset(out, 0, sizeof(struct triage));
+    struct board *copy = clone_board(ctx, b);
+    // Propagation counts towards no statistics
+    struct solver_stats stats = ctx->stats;
+    bool ok = fill_singles(ctx, copy);
+    ctx->stats = stats;
+    if (!ok) {
+        // Found to have no solution already, so nothing to route
+        out->empty = -1;
+        out->route = ROUTE_INLINE;
+    } else {
+        for (int row = 0; row < BOARD_WIDTH; row++) {
+            for (int col = 0; col < BOARD_WIDTH; col++) {
+                if (get_cell(copy->board, row, col) == 0) {
+                    out->empty++;
+                    out->candidates[mask_popcount(get_mask(copy, row, col))]++;
+                }
+            }
+        }
+        if (out->empty <= ctx->triage_inline) {
+            out->route = ROUTE_INLINE;
+        } else if (out->empty <= ctx->triage_strong) {
+            out->route = ROUTE_STRONG;
+        } else {
+            out->route = ROUTE_PORTFOLIO;
+        }
+    }
+    free_board_ctx(ctx, copy);
+}
+
+void triage_board(struct board *b, struct triage *out) {
+    assert(solver_init);
+    triage_board_ctx(&default_ctx, b, out);
+}
+
+const char *solve_route_name(enum solve_route r) {
+    assert(r >= 0 && r <= ROUTE_PORTFOLIO);
+    return solve_route_names[r];
+}
+
+void set_solver_engine_ctx(struct sudoku_ctx *ctx, enum solver_engine e) {
+    ctx->engine = e;
+}
+
+void set_solver_engine(enum solver_engine e) {
+    set_solver_engine_ctx(&default_ctx, e);
+}
+
+int solver_engine_from_name(const char *name) {
+    for (int i = 0; i < N_SOLVER_ENGINES; i++) {
+        if (strcmp(name, solver_engine_names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+const char *solver_engine_name(enum solver_engine e) {
+    assert(e >= 0 && e < N_SOLVER_ENGINES);
+    return solver_engine_names[e];
+}
+
+void set_compact_frontier(bool enable) {
+    set_compact_frontier_ctx(&default_ctx, enable);
+}
+
+void set_branch_heuristic(enum branch_heuristic h) {
+    set_branch_heuristic_ctx(&default_ctx, h);
+}
+
+void set_value_order(enum value_order o) {
+    set_value_order_ctx(&default_ctx, o);
+}
+
+void set_probing(int depth, int width) {
+    set_probing_ctx(&default_ctx, depth, width);
+}
+
+int branch_heuristic_from_name(const char *name) {
+    for (int i = 0; i < N_BRANCH_HEURISTICS; i++) {
+        if (strcmp(name, branch_heuristic_names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int value_order_from_name(const char *name) {
+    for (int i = 0; i < N_VALUE_ORDERS; i++) {
+        if (strcmp(name, value_order_names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+const char *branch_heuristic_name(enum branch_heuristic h) {
+    assert(h >= 0 && h < N_BRANCH_HEURISTICS);
+    return branch_heuristic_names[h];
+}
+
+const char *value_order_name(enum value_order o) {
+    assert(o >= 0 && o < N_VALUE_ORDERS);
+    return value_order_names[o];
+}
+
+void get_solver_stats_ctx(struct sudoku_ctx *ctx, struct solver_stats *out) {
+    *out = ctx->stats;
+}
+
+void reset_solver_stats_ctx(struct sudoku_ctx *ctx) {
+    memset(&ctx->stats, 0, sizeof(ctx->stats));
+}
+
+void get_solver_stats(struct solver_stats *out) {
+    get_solver_stats_ctx(&default_ctx, out);
+}
+
+void reset_solver_stats(void) {
+    reset_solver_stats_ctx(&default_ctx);
 }
 
 static inline void change_push(struct changestack *stack, int row, int col) {
@@ -146,31 +1040,73 @@ static inline int block_start_row(int block) {
     return ( (block / BLOCK_WIDTH) * BLOCK_WIDTH);
 }
 
-static inline void set_cell(struct board *b, int row, int col, int val) {
+/* Units are numbered rows first, then columns, then blocks.
+ * Returns the i-th cell of the unit */
+static inline struct cell unit_cell(int unit, int i) {
+    struct cell c;
+    if (unit < BOARD_WIDTH) {
+        c.row = unit;
+        c.col = i;
+    } else if (unit < 2 * BOARD_WIDTH) {
+        c.row = i;
+        c.col = unit - BOARD_WIDTH;
+    } else {
+        int block = unit - 2 * BOARD_WIDTH;
+        c.row = block_start_row(block) + i / BLOCK_WIDTH;
+        c.col = block_start_col(block) + i % BLOCK_WIDTH;
+    }
+    return c;
+}
+
+static inline mask_t unit_mask(struct board *b, int unit) {
+    if (unit < BOARD_WIDTH) {
+        return ROW_MASK(b, unit);
+    } else if (unit < 2 * BOARD_WIDTH) {
+        return COL_MASK(b, unit - BOARD_WIDTH);
+    } else {
+        return BLOCK_MASK(b, unit - 2 * BOARD_WIDTH);
+    }
+}
+
+static inline void set_cell(struct sudoku_ctx *ctx, struct board *b, int row,
+                            int col, int val) {
     if (get_cell(b->board, row, col) != 0) {
         DPRINTF("was %d\n", (int)get_cell(b->board, row, col));
     }
     assert(get_cell(b->board, row, col) == 0);
-    mask_t valmask = num_masks[val-1];
+    mask_t valmask = ctx->num_masks[val-1];
 #ifndef NDEBUG
     mask_t tmp;
     tmp = valmask;
-    mask_and(&tmp, b->col_masks[col]);
+    mask_and(&tmp, COL_MASK(b, col));
     assert(mask_popcount(tmp) == 0);
     tmp = valmask;
-    mask_and(&tmp, b->row_masks[row]);
+    mask_and(&tmp, ROW_MASK(b, row));
     assert(mask_popcount(tmp) == 0);
     tmp = valmask;
-    mask_and(&tmp, b->block_masks[get_block(row, col)]);
+    mask_and(&tmp, CELL_BLOCK_MASK(b, row, col));
     assert(mask_popcount(tmp) == 0);
 #endif
     get_cell(b->board, row, col) = val;
 
-    mask_or(&(b->col_masks[col]), valmask);
-    mask_or(&(b->row_masks[row]), valmask);
-    int block = get_block(row, col);
-    mask_or(&(b->block_masks[block]), valmask);
+    mask_or(&(COL_MASK(b, col)), valmask);
+    mask_or(&(ROW_MASK(b, row)), valmask);
+    mask_or(&(CELL_BLOCK_MASK(b, row, col)), valmask);
     b->nfilled++;
+    b->propagated = false;
+}
+
+static inline void unset_cell(struct sudoku_ctx *ctx, struct board *b,
+                              int row, int col) {
+    int val = get_cell(b->board, row, col);
+    assert(val != 0);
+    mask_t valmask = ctx->num_masks[val-1];
+    get_cell(b->board, row, col) = 0;
+    mask_andnot(&(COL_MASK(b, col)), valmask);
+    mask_andnot(&(ROW_MASK(b, row)), valmask);
+    mask_andnot(&(CELL_BLOCK_MASK(b, row, col)), valmask);
+    b->nfilled--;
+    b->propagated = false;
 }
 
 static inline void mask_or(mask_t *mask1, mask_t mask2) {
@@ -203,6 +1139,12 @@ static inline void mask_and(mask_t *mask1, mask_t mask2) {
     }
 }
 
+static inline void mask_andnot(mask_t *mask1, mask_t mask2) {
+    for (int i = 0; i < MASK_SIZE; i++) {
+        mask1->vec[i] &= ~mask2.vec[i];
+    }
+}
+
 static inline void mask_not(mask_t *mask) {
     for (int i = 0; i < MASK_SIZE; i++) {
         mask->vec[i] = ~(mask->vec[i]);
@@ -214,9 +1156,9 @@ static inline void mask_not(mask_t *mask) {
 static inline mask_t get_mask(struct board *b, int row, int col) {
     mask_t mask;
     memset(&mask, 0, sizeof(mask_t));
-    mask_or(&mask, b->col_masks[col]);
-    mask_or(&mask, b->row_masks[row]);
-    mask_or(&mask, b->block_masks[get_block(row, col)]);
+    mask_or(&mask, COL_MASK(b, col));
+    mask_or(&mask, ROW_MASK(b, row));
+    mask_or(&mask, CELL_BLOCK_MASK(b, row, col));
     // Mask now have 1 for each possible position
     mask_not(&mask);
     //DPRINTF("[%d][%d]", row, col); DDUMP_MASK(mask);
@@ -232,11 +1174,16 @@ cell_t *read_sudoku_file(char *file) {
     char buf[10 * BOARD_CELLS];
     if (fgets(buf, BUF_SIZE, in) == NULL) {
         fprintf(stderr, "could not read line from file %s\n", file);
+        fclose(in);
         return NULL;
     }
-    cell_t *sud = board_text_to_bin(buf);
-    if (sud == NULL) {
-        // error message already printed
+    fclose(in);
+    cell_t *sud = malloc(sizeof(cell_t) * BOARD_CELLS);
+    assert(sud != NULL);
+    char why[128];
+    if (!board_text_read_explain(buf, sud, why, sizeof(why))) {
+        fprintf(stderr, "could not parse board in file %s: %s\n", file, why);
+        free(sud);
         return NULL;
     }
     return sud;
@@ -278,45 +1225,66 @@ char *board_bin_to_text(cell_t *src) {
 
 cell_t *board_text_to_bin(char *src) {
     cell_t *dst = malloc(sizeof(cell_t) * BOARD_CELLS);
-    int pos = 0;
+    assert(dst != NULL);
+    if (!board_text_read(src, dst)) {
+        free(dst);
+        return NULL;
+    }
+    return dst;
+}
+
+bool board_text_read(char *src, cell_t *dst) {
+    char why[64];
+    return board_text_read_explain(src, dst, why, sizeof(why));
+}
+
+bool board_text_read_explain(char *src, cell_t *dst, char *why,
+                             size_t size) {
+    // One pass over the text, accumulating numbers as they are scanned
+    const unsigned char *p = (const unsigned char *)src;
     int nread = 0;
-    while (src[pos] != '\0') {
-        while(isspace(src[pos])) {
-            pos++;
+    while (true) {
+        while (isspace(*p)) {
+            p++;
         }
-        if (src[pos] == '\0') {
+        if (*p == '\0') {
             break;
         }
         if (nread >= BOARD_CELLS) {
-            free(dst);
-            fprintf(stderr, "wrong number of cells: %d last cell %c\n", nread, src[pos]);
-            return NULL;
+            snprintf(why, size, "more than %d cells", BOARD_CELLS);
+            return false;
         }
-        if (src[pos] == '.') {
+        if (*p == '.') {
             dst[nread++] = 0;
-            pos++;
-        } else if (isdigit(src[pos])) {
-            int val = atoi(src + pos);
-            if (val < 0 || val > N_VALUES) {
-                fprintf(stderr, "invalid value %d at cell %d\n", val, pos);
+            p++;
+        } else if (isdigit(*p)) {
+            int val = 0;
+            do {
+                // Stop accumulating once out of range, so it can't overflow
+                if (val <= N_VALUES) {
+                    val = val * 10 + (*p - '0');
+                }
+                p++;
+            } while (isdigit(*p));
+            if (val > N_VALUES) {
+                snprintf(why, size, "invalid value %d at cell %d", val, nread);
                 return false;
             }
-            while(isdigit(src[pos])) {
-                pos++;
-            }
             dst[nread++] = val;
+        } else if (isprint(*p)) {
+            snprintf(why, size, "invalid character '%c' at cell %d", *p,
+                     nread);
+            return false;
         } else {
-            free(dst);
-            fprintf(stderr, "invalid character %c in string\n", src[pos]);
-            return NULL;
+            snprintf(why, size, "invalid byte 0x%02x at cell %d", *p, nread);
+            return false;
         }
     }
     if (nread < BOARD_CELLS) {
-        free(dst);
-        fprintf(stderr, "not enough cells: %d/%d \n", nread, BOARD_CELLS);
-        return NULL;
+        snprintf(why, size, "only %d of %d cells", nread, BOARD_CELLS);
+        return false;
     }
-    return dst;
+    return true;
 }
 
 void free_cells(cell_t *cells) {
@@ -330,40 +1298,285 @@ cell_t *cells_convert(uint64_t ptr) {
   return (cell_t *) ptr;
 }
 
-struct board *create_board(cell_t *init_board) {
-    struct board *b = (struct board*)malloc(sizeof(struct board));
-    assert(b != NULL);
-
-    memcpy(b->board, init_board, BOARD_CELLS * sizeof(cell_t));
+bool board_verify(cell_t *puzzle, cell_t *solution) {
+    // No early exit, so that the compiler can vectorize the loop
+    int changed = 0;
+    if (puzzle != NULL) {
+        for (int i = 0; i < BOARD_CELLS; i++) {
+            changed |= puzzle[i] != 0 && puzzle[i] != solution[i];
+        }
+    }
+    return !changed && verify_units(solution);
+}
 
-    memset(b->col_masks, 0, sizeof(b->col_masks));
-    memset(b->row_masks, 0, sizeof(b->row_masks));
-    memset(b->block_masks, 0, sizeof(b->block_masks));
+/*
+ * True if every row, column and block of cells holds each value once.
+ * Each cell's value becomes a one-bit mask, ORed into the masks of its
+ * units: a unit of BOARD_WIDTH cells that covers all N_VALUES values
+ * repeats none.  Empty cells and values out of range set no bit.
+ */
+#ifdef SIMD_VERIFY
+/*
+ * 9x9 boards use explicit vectors.  Each row is loaded a column per lane,
+ * so the column masks build up in one vector.  Rotating the lanes by one
+ * and two puts the mask of each block's three cells of the row in lanes
+ * 0, 3 and 6; ORing those across the band gives the block masks, and
+ * rotating by three and six gives the row mask in lane 0.
+ */
+typedef uint16_t vrow_t __attribute__((vector_size(32)));
+typedef uint8_t vrow_cells_t __attribute__((vector_size(16)));
 
-    int filled = 0;
-    for (int row = 0; row < BOARD_WIDTH; row++) {
+static bool verify_units(const cell_t *cells) {
+    const uint16_t all = (1 << N_VALUES) - 1;
+    const vrow_t full = {all, all, all, all, all, all, all, all, all};
+    const vrow_cells_t row_cells = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+                                    0xFF, 0xFF, 0xFF};
+    const vrow_t row_lanes = {0xFFFF};
+    const vrow_t block_lanes = {0xFFFF, 0, 0, 0xFFFF, 0, 0, 0xFFFF};
+    vrow_t cols = {0}, bad = {0};
+    for (int brow = 0; brow < BLOCK_WIDTH; brow++) {
+        vrow_t band = {0};
+        for (int row = brow * BLOCK_WIDTH; row < (brow + 1) * BLOCK_WIDTH;
+             row++) {
+            // Whole vectors are loaded, the last row together with the
+            // cells before it so as not to read past the board
+            vrow_cells_t r;
+            if (row < BOARD_WIDTH - 1) {
+                memcpy(&r, cells + row * BOARD_WIDTH, sizeof(r));
+            } else {
+                memcpy(&r, cells + BOARD_CELLS - sizeof(r), sizeof(r));
+                r = __builtin_shufflevector(r, r, 7, 8, 9, 10, 11, 12, 13,
+                                            14, 15, 0, 0, 0, 0, 0, 0, 0);
+            }
+            r &= row_cells;
+            // Wraps around for an empty cell, as do the unused lanes
+            vrow_t shift = __builtin_convertvector(r, vrow_t) - 1;
+            vrow_t bit = (((vrow_t){0} + 1) << (shift & 15)) &
+                         (vrow_t)(shift < N_VALUES);
+            cols |= bit;
+            vrow_t triple = bit |
+                __builtin_shufflevector(bit, bit, 1, 2, 3, 4, 5, 6, 7, 8, 9,
+                                        10, 11, 12, 13, 14, 15, 0) |
+                __builtin_shufflevector(bit, bit, 2, 3, 4, 5, 6, 7, 8, 9, 10,
+                                        11, 12, 13, 14, 15, 0, 1);
+            band |= triple;
+            vrow_t row_mask = triple |
+                __builtin_shufflevector(triple, triple, 3, 4, 5, 6, 7, 8, 9,
+                                        10, 11, 12, 13, 14, 15, 0, 1, 2) |
+                __builtin_shufflevector(triple, triple, 6, 7, 8, 9, 10, 11,
+                                        12, 13, 14, 15, 0, 1, 2, 3, 4, 5);
+            bad |= (row_mask ^ full) & row_lanes;
+        }
+        bad |= (band ^ full) & block_lanes;
+    }
+    bad |= cols ^ full;
+    uint16_t any = 0;
+    for (int l = 0; l < 16; l++) {
+        any |= bad[l];
+    }
+    return any == 0;
+}
+#else
+/*
+ * Otherwise the columns and the blocks of the current band of rows are
+ * accumulated across the rows in arrays indexed by column, one mask word
+ * at a time.
+ */
+static bool verify_units(const cell_t *cells) {
+    uint64_t cols[MASK_SIZE][BOARD_WIDTH];
+    uint64_t band[MASK_SIZE][BOARD_WIDTH];
+    uint64_t full[MASK_SIZE];
+    for (int w = 0; w < MASK_SIZE; w++) {
+        int nvalues = N_VALUES - w * MASK_ELEM_BITS;
+        full[w] = nvalues >= MASK_ELEM_BITS ? ~(uint64_t)0 :
+                  (((uint64_t)1) << nvalues) - 1;
+    }
+    memset(cols, 0, sizeof(cols));
+
+    uint64_t bad = 0;
+    for (int brow = 0; brow < BLOCK_WIDTH; brow++) {
+        memset(band, 0, sizeof(band));
+        for (int row = brow * BLOCK_WIDTH; row < (brow + 1) * BLOCK_WIDTH;
+             row++) {
+            const cell_t *r = cells + row * BOARD_WIDTH;
+            for (int w = 0; w < MASK_SIZE; w++) {
+                uint64_t row_mask = 0;
+                for (int col = 0; col < BOARD_WIDTH; col++) {
+                    // Wraps around for an empty cell, which sets no bit
+                    uint64_t shift = (uint64_t)r[col] - 1 - w * MASK_ELEM_BITS;
+                    uint64_t bit = ((uint64_t)(shift < MASK_ELEM_BITS)) <<
+                                   (shift % MASK_ELEM_BITS);
+                    cols[w][col] |= bit;
+                    band[w][col] |= bit;
+                    row_mask |= bit;
+                }
+                bad |= row_mask ^ full[w];
+            }
+        }
+        for (int bcol = 0; bcol < BLOCK_WIDTH; bcol++) {
+            for (int w = 0; w < MASK_SIZE; w++) {
+                uint64_t block_mask = 0;
+                for (int i = 0; i < BLOCK_WIDTH; i++) {
+                    block_mask |= band[w][bcol * BLOCK_WIDTH + i];
+                }
+                bad |= block_mask ^ full[w];
+            }
+        }
+    }
+    for (int w = 0; w < MASK_SIZE; w++) {
         for (int col = 0; col < BOARD_WIDTH; col++) {
-            int val = get_cell(b->board, row, col);
-            if (val != 0) {
-                mask_t mask = num_masks[val-1];
-                mask_or(&(b->col_masks[col]), mask);
-                mask_or(&(b->row_masks[row]), mask);
-                int block = get_block(row, col);
-                mask_or(&(b->block_masks[block]), mask);
-                filled++;
+            bad |= cols[w][col] ^ full[w];
+        }
+    }
+    return bad == 0;
+}
+#endif
+
+bool board_verify_explain(cell_t *puzzle, cell_t *solution, char *why,
+                          size_t size) {
+    if (board_verify(puzzle, solution)) {
+        return true;
+    }
+    // Find the first problem cell by cell, which only failures pay for
+    for (int i = 0; i < BOARD_CELLS; i++) {
+        int row = i / BOARD_WIDTH, col = i % BOARD_WIDTH;
+        if (puzzle != NULL && puzzle[i] != 0 && puzzle[i] != solution[i]) {
+            snprintf(why, size, "cell r%dc%d is %d, given as %d", row, col,
+                     solution[i], puzzle[i]);
+            return false;
+        } else if (solution[i] == 0) {
+            snprintf(why, size, "cell r%dc%d is empty", row, col);
+            return false;
+        } else if (solution[i] > N_VALUES) {
+            snprintf(why, size, "cell r%dc%d has invalid value %d", row, col,
+                     solution[i]);
+            return false;
+        }
+    }
+    static const char *unit_names[] = {"row", "column", "block"};
+    for (int unit = 0; unit < N_UNITS; unit++) {
+        bool seen[N_VALUES + 1];
+        memset(seen, 0, sizeof(seen));
+        for (int i = 0; i < BOARD_WIDTH; i++) {
+            struct cell c = unit_cell(unit, i);
+            int val = get_cell(solution, c.row, c.col);
+            if (seen[val]) {
+                snprintf(why, size, "%s %d repeats %d",
+                         unit_names[unit / BOARD_WIDTH],
+                         unit % BOARD_WIDTH, val);
+                return false;
             }
+            seen[val] = true;
         }
     }
-    b->nfilled = filled;
-    return b;
+    snprintf(why, size, "invalid");
+    return false;
+}
+
+bool board_givens_consistent(cell_t *puzzle, char *why, size_t size) {
+    static const char *unit_names[] = {"row", "column", "block"};
+    for (int unit = 0; unit < N_UNITS; unit++) {
+        bool seen[N_VALUES + 1];
+        memset(seen, 0, sizeof(seen));
+        for (int i = 0; i < BOARD_WIDTH; i++) {
+            struct cell c = unit_cell(unit, i);
+            int val = get_cell(puzzle, c.row, c.col);
+            if (val != 0 && seen[val]) {
+                if (why != NULL) {
+                    snprintf(why, size, "%s %d repeats %d",
+                             unit_names[unit / BOARD_WIDTH],
+                             unit % BOARD_WIDTH, val);
+                }
+                return false;
+            }
+            seen[val] = true;
+        }
+    }
+    return true;
 }
 
-static inline struct board *clone_board(struct board *board) {
-    struct board *newboard = (struct board*)malloc(sizeof(struct board));
-    if (newboard == NULL) {
-        fprintf(stderr, "Ran out of memory in clone_board\n");
+/* Allocate a board aligned to a cache line, as its layout assumes.  It is
+ * freed with free() */
+static struct board *new_board(void) {
+    void *b;
+    if (posix_memalign(&b, CACHE_LINE_SIZE, sizeof(struct board)) != 0) {
+        fprintf(stderr, "Ran out of memory allocating board\n");
         exit(1);
     }
+    return (struct board*)b;
+}
+
+/* Take a board from the context's pool, or allocate a new one */
+static inline struct board *alloc_board(struct sudoku_ctx *ctx) {
+    if (ctx->pool_len > 0) {
+        return ctx->pool[--ctx->pool_len];
+    }
+    return new_board();
+}
+
+struct board *create_board(cell_t *init_board) {
+    return create_board_ctx(&default_ctx, init_board);
+}
+
+struct board *create_board_ctx(struct sudoku_ctx *ctx, cell_t *init_board) {
+    struct board *b = alloc_board(ctx);
+
+    memcpy(b->board, init_board, BOARD_CELLS * sizeof(cell_t));
+    b->nfilled = rebuild_masks(ctx, b);
+    b->trace_parent = 0;
+    b->depth = 0;
+    b->branch_pos = -1;
+    b->branch_val = 0;
+    b->propagated = false;
+    return b;
+}
+
+/* Set b's masks from its cells.  Returns the number of cells filled in */
+static int rebuild_masks(struct sudoku_ctx *ctx, struct board *b) {
+    clear_masks(b);
+    // Indexed by value, with an empty mask for empty cells, so that there
+    // is no branch per cell to mispredict
+    mask_t val_masks[N_VALUES + 1];
+    memset(&val_masks[0], 0, sizeof(mask_t));
+    memcpy(&val_masks[1], ctx->num_masks, sizeof(mask_t) * N_VALUES);
+
+    int filled = 0;
+    for (int row = 0; row < BOARD_WIDTH; row++) {
+        mask_t row_mask = val_masks[0];
+        int block_row = get_block(row, 0);
+        for (int bcol = 0; bcol < BLOCK_WIDTH; bcol++) {
+            // Gather the row's part of the block first, rather than update
+            // the block's mask in memory for every cell
+            mask_t part = val_masks[0];
+            for (int col = bcol * BLOCK_WIDTH; col < (bcol + 1) * BLOCK_WIDTH;
+                 col++) {
+                int val = get_cell(b->board, row, col);
+                mask_t mask = val_masks[val];
+                mask_or(&part, mask);
+                mask_or(&(COL_MASK(b, col)), mask);
+                filled += val != 0;
+            }
+            mask_or(&(BLOCK_MASK(b, block_row + bcol)), part);
+            mask_or(&row_mask, part);
+        }
+        ROW_MASK(b, row) = row_mask;
+    }
+    return filled;
+}
+
+static inline void clear_masks(struct board *b) {
+#ifdef INTERLEAVED_MASKS
+    memset(b->bands, 0, sizeof(b->bands));
+#else
+    memset(b->row_masks, 0, sizeof(b->row_masks));
+    memset(b->block_masks, 0, sizeof(b->block_masks));
+#endif
+    memset(b->col_masks, 0, sizeof(b->col_masks));
+}
+
+static inline struct board *clone_board(struct sudoku_ctx *ctx,
+                                        struct board *board) {
+    struct board *newboard = alloc_board(ctx);
     memcpy(newboard, board, sizeof(struct board));
     return newboard;
 }
@@ -375,6 +1588,11 @@ static inline void boardlist_resize(struct boardlist *boards, int neededsize) {
         boards->arr=realloc(boards->arr,
                         boards->size * sizeof(struct board*));
         assert(boards->arr != NULL);
+        if (boards->nodes != NULL) {
+            boards->nodes = realloc(boards->nodes,
+                            boards->size * sizeof(struct frontier_node*));
+            assert(boards->nodes != NULL);
+        }
     }
 }
 
@@ -383,22 +1601,122 @@ void init_boardlist(struct boardlist *list, int init_size) {
     assert(list->arr != NULL);
     list->size = init_size;
     list->len = 0;
+    list->nodes = NULL;
+    list->spill = NULL;
 }
 
 static inline void add_board(struct boardlist *list, struct board *board) {
     boardlist_resize(list, list->len + 1);
     list->arr[list->len] = board;
+    if (list->nodes != NULL) {
+        list->nodes[list->len] = NULL;
+    }
     list->len++;
 }
 
-static inline struct board *remove_last_board(struct boardlist *list) {
-    assert(list->len > 0);
-    struct board *result = list->arr[list->len - 1];
-#ifndef NDEBUG
-    list->arr[list->len - 1] = NULL;
-#endif
-    list->len--;
-    return result;
+static inline void add_node(struct boardlist *list, struct frontier_node *node) {
+    assert(list->nodes != NULL);
+    boardlist_resize(list, list->len + 1);
+    list->arr[list->len] = NULL;
+    list->nodes[list->len] = node;
+    list->len++;
+}
+
+/*
+ * Remove entry i from the list, leaving the slot empty.  If it is a
+ * frontier node, the board is materialized and the reference to the node
+ * passed to the caller in *node, otherwise *node is set to NULL.
+ */
+static inline struct board *take_entry(struct sudoku_ctx *ctx,
+        struct boardlist *list, int i, struct frontier_node **node) {
+    struct board *b = list->arr[i];
+    list->arr[i] = NULL;
+    *node = NULL;
+    if (b == NULL) {
+        assert(list->nodes != NULL && list->nodes[i] != NULL);
+        *node = list->nodes[i];
+        list->nodes[i] = NULL;
+        b = alloc_board(ctx);
+        materialize_node(*node, b);
+    }
+    return b;
+}
+
+static inline void free_entry(struct sudoku_ctx *ctx, struct boardlist *list,
+                              int i) {
+    if (list->arr[i] != NULL) {
+        free_board_ctx(ctx, list->arr[i]);
+        list->arr[i] = NULL;
+    }
+    if (list->nodes != NULL && list->nodes[i] != NULL) {
+        release_node(list->nodes[i]);
+        list->nodes[i] = NULL;
+    }
+}
+
+static struct frontier_node *new_node(struct frontier_node *parent,
+                                      int ndeltas) {
+    struct frontier_node *node = malloc(sizeof(struct frontier_node) +
+                                        sizeof(struct delta) * ndeltas);
+    assert(node != NULL);
+    node->parent = parent;
+    node->trace_id = 0;
+    node->depth = 0;
+    node->refs = 1;
+    node->ndeltas = ndeltas;
+    if (parent != NULL) {
+        // Siblings may be expanded on different threads by parallel BFS
+        __atomic_add_fetch(&parent->refs, 1, __ATOMIC_RELAXED);
+    }
+    return node;
+}
+
+/* A new node with the same parent and deltas as node */
+static struct frontier_node *copy_node(struct frontier_node *node) {
+    struct frontier_node *copy = new_node(node->parent, node->ndeltas);
+    copy->trace_id = node->trace_id;
+    copy->depth = node->depth;
+    memcpy(copy->deltas, node->deltas, sizeof(struct delta) * node->ndeltas);
+    return copy;
+}
+
+/* Drop a reference to node, freeing it and any ancestors no longer used */
+static void release_node(struct frontier_node *node) {
+    while (node != NULL &&
+           __atomic_sub_fetch(&node->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        struct frontier_node *parent = node->parent;
+        free(node);
+        node = parent;
+    }
+}
+
+/* Rebuild the full board b from node and its ancestors.  The branch that
+ * created a node is its first delta */
+static void materialize_node(struct frontier_node *node, struct board *b) {
+    b->trace_parent = node->parent != NULL ? node->parent->trace_id : 0;
+    b->depth = node->depth;
+    b->branch_pos = node->parent != NULL ? (int)node->deltas[0].pos : -1;
+    b->branch_val = node->parent != NULL ? node->deltas[0].val : 0;
+    b->propagated = false;
+    memset(b->board, 0, CELLS_MEM);
+    clear_masks(b);
+    int filled = 0;
+    for (; node != NULL; node = node->parent) {
+        for (int i = 0; i < node->ndeltas; i++) {
+            int pos = node->deltas[i].pos;
+            int val = node->deltas[i].val;
+            int row = pos / BOARD_WIDTH, col = pos % BOARD_WIDTH;
+            int off = (val - 1) / MASK_ELEM_BITS;
+            uint64_t bit = ((uint64_t)1) << ((val - 1) % MASK_ELEM_BITS);
+            assert(b->board[pos] == 0);
+            b->board[pos] = val;
+            ROW_MASK(b, row).vec[off] |= bit;
+            COL_MASK(b, col).vec[off] |= bit;
+            CELL_BLOCK_MASK(b, row, col).vec[off] |= bit;
+        }
+        filled += node->ndeltas;
+    }
+    b->nfilled = filled;
 }
 
 // NOTE: doesn't free bumped boards
@@ -414,6 +1732,10 @@ static inline void bump_boards(struct boardlist *list, int bump) {
         list->arr[i] = NULL;
 #endif
     }
+    if (list->nodes != NULL) {
+        memmove(list->nodes, list->nodes + bump,
+                sizeof(struct frontier_node*) * (list->len - bump));
+    }
     list->len -= bump;
 }
 
@@ -421,6 +1743,15 @@ void free_board(struct board *board) {
     free(board);
 }
 
+/* Return board to the context's pool for reuse */
+void free_board_ctx(struct sudoku_ctx *ctx, struct board *board) {
+    if (ctx->pool_len < ctx->pool_max) {
+        ctx->pool[ctx->pool_len++] = board;
+    } else {
+        free(board);
+    }
+}
+
 void free_boardlist(struct boardlist *l, bool free_boards) {
     if (free_boards) {
         for (int i = 0; i < l->len; i++) {
@@ -429,6 +1760,38 @@ void free_boardlist(struct boardlist *l, bool free_boards) {
            }
         }
     }
+    // Nodes are always owned by the list
+    if (l->nodes != NULL) {
+        for (int i = 0; i < l->len; i++) {
+            release_node(l->nodes[i]);
+        }
+        free(l->nodes);
+    }
+    if (l->spill != NULL) {
+        spill_free(NULL, l->spill);
+    }
+    free(l->arr);
+    free(l);
+}
+
+void free_boardlist_ctx(struct sudoku_ctx *ctx, struct boardlist *l,
+                        bool free_boards) {
+    if (free_boards) {
+        for (int i = 0; i < l->len; i++) {
+           if (l->arr[i] != NULL) {
+               free_board_ctx(ctx, l->arr[i]);
+           }
+        }
+    }
+    if (l->nodes != NULL) {
+        for (int i = 0; i < l->len; i++) {
+            release_node(l->nodes[i]);
+        }
+        free(l->nodes);
+    }
+    if (l->spill != NULL) {
+        spill_free(ctx, l->spill);
+    }
     free(l->arr);
     free(l);
 }
@@ -438,12 +1801,247 @@ int board_nfilled(struct board *b) {
     return b->nfilled;
 }
 
+static inline uint64_t load_le64(const unsigned char *in) {
+    uint64_t word;
+    memcpy(&word, in, sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    return word;
+}
+
+static inline void store_le64(unsigned char *out, uint64_t word) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    memcpy(out, &word, sizeof(word));
+}
+
+/* The wire format has the row, column and block masks in that order,
+ * whatever the layout of struct board */
+static void masks_to_wire(struct board *b, unsigned char *out) {
+    size_t units_size = sizeof(mask_t) * BOARD_WIDTH;
+#ifdef INTERLEAVED_MASKS
+    size_t band_size = sizeof(mask_t) * BLOCK_WIDTH;
+    for (int band = 0; band < BLOCK_WIDTH; band++) {
+        memcpy(out + band * band_size, b->bands[band].rows, band_size);
+        memcpy(out + 2 * units_size + band * band_size, b->bands[band].blocks,
+               band_size);
+    }
+#else
+    memcpy(out, b->row_masks, units_size);
+    memcpy(out + 2 * units_size, b->block_masks, units_size);
+#endif
+    memcpy(out + units_size, b->col_masks, units_size);
+}
+
+static void masks_from_wire(struct board *b, const unsigned char *in) {
+    size_t units_size = sizeof(mask_t) * BOARD_WIDTH;
+#ifdef INTERLEAVED_MASKS
+    size_t band_size = sizeof(mask_t) * BLOCK_WIDTH;
+    for (int band = 0; band < BLOCK_WIDTH; band++) {
+        memcpy(b->bands[band].rows, in + band * band_size, band_size);
+        memcpy(b->bands[band].blocks, in + 2 * units_size + band * band_size,
+               band_size);
+    }
+#else
+    memcpy(b->row_masks, in, units_size);
+    memcpy(b->block_masks, in + 2 * units_size, units_size);
+#endif
+    memcpy(b->col_masks, in + units_size, units_size);
+}
+
+#ifndef NDEBUG
+/* True if the wire masks at in are those of b's cells, which b's masks
+ * are rebuilt from */
+static bool wire_masks_valid(struct sudoku_ctx *ctx, struct board *b,
+                             const unsigned char *in) {
+    unsigned char *rebuilt = malloc(WIRE_MASKS_SIZE);
+    assert(rebuilt != NULL);
+    rebuild_masks(ctx, b);
+    masks_to_wire(b, rebuilt);
+    bool valid = memcmp(rebuilt, in, WIRE_MASKS_SIZE) == 0;
+    free(rebuilt);
+    return valid;
+}
+#endif
+
+size_t board_serialized_size(int flags) {
+    return sizeof(struct board_wire_header) + WIRE_CELLS_SIZE +
+           ((flags & BOARD_WIRE_MASKS) ? WIRE_MASKS_SIZE : 0);
+}
+
+size_t board_serialize(struct board *b, int flags, void *buf) {
+    struct board_wire_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, BOARD_WIRE_MAGIC, sizeof(h.magic));
+    h.version = BOARD_WIRE_VERSION;
+    h.block_width = BLOCK_WIDTH;
+    h.cell_bits = WIRE_CELL_BITS;
+    h.flags = (flags & BOARD_WIRE_MASKS) |
+              (b->propagated ? BOARD_WIRE_PROPAGATED : 0);
+    h.nfilled = b->nfilled;
+    h.depth = b->depth;
+    h.branch_pos = b->branch_pos;
+    h.branch_val = b->branch_val;
+    unsigned char *out = buf;
+    memcpy(out, &h, sizeof(h));
+    out += sizeof(h);
+
+    // Cells are packed into words from the low bits, and stored little-endian
+    // so that the bytes form one bit stream
+    uint64_t word = 0;
+    int nbits = 0;
+    for (int i = 0; i < BOARD_CELLS; i++) {
+        uint64_t val = b->board[i];
+        word |= val << nbits;
+        nbits += WIRE_CELL_BITS;
+        if (nbits >= 64) {
+            store_le64(out, word);
+            out += sizeof(word);
+            nbits -= 64;
+            word = nbits > 0 ? val >> (WIRE_CELL_BITS - nbits) : 0;
+        }
+    }
+    if (nbits > 0) {
+        store_le64(out, word);
+        out += sizeof(word);
+    }
+
+    if (flags & BOARD_WIRE_MASKS) {
+        masks_to_wire(b, out);
+        out += WIRE_MASKS_SIZE;
+    }
+    return out - (unsigned char *)buf;
+}
+
+unsigned char *board_serialize_alloc(struct board *b, int flags) {
+    unsigned char *buf = malloc(board_serialized_size(flags));
+    assert(buf != NULL);
+    board_serialize(b, flags, buf);
+    return buf;
+}
+
+void board_serialized_free(unsigned char *buf) {
+    free(buf);
+}
+
+struct board *board_deserialize(const void *buf, size_t len) {
+    return board_deserialize_ctx(&default_ctx, buf, len);
+}
+
+struct board *board_deserialize_ctx(struct sudoku_ctx *ctx, const void *buf,
+                                    size_t len) {
+    struct board_wire_header h;
+    if (len < sizeof(h)) {
+        fprintf(stderr, "serialized board truncated: %zu bytes\n", len);
+        return NULL;
+    }
+    memcpy(&h, buf, sizeof(h));
+    if (memcmp(h.magic, BOARD_WIRE_MAGIC, sizeof(h.magic)) != 0 ||
+            h.version != BOARD_WIRE_VERSION) {
+        fprintf(stderr, "not a serialized board\n");
+        return NULL;
+    }
+    if (h.block_width != BLOCK_WIDTH || h.cell_bits != WIRE_CELL_BITS) {
+        fprintf(stderr, "serialized board is %dx%d, not %dx%d\n",
+                h.block_width * h.block_width, h.block_width * h.block_width,
+                BOARD_WIDTH, BOARD_WIDTH);
+        return NULL;
+    }
+    if (len < board_serialized_size(h.flags)) {
+        fprintf(stderr, "serialized board truncated: %zu bytes\n", len);
+        return NULL;
+    }
+
+    // Every 8 cells take up WIRE_CELL_BITS bytes, read as one word while
+    // there are 8 bytes left
+    struct board *b = alloc_board(ctx);
+    const unsigned char *in = (const unsigned char *)buf + sizeof(h);
+    int filled = 0, maxval = 0;
+    int i = 0;
+    for (; i + 8 <= BOARD_CELLS &&
+           (size_t)i / 8 * WIRE_CELL_BITS + 8 <= WIRE_CELLS_SIZE; i += 8) {
+        uint64_t word = load_le64(in + i / 8 * WIRE_CELL_BITS);
+        for (int j = 0; j < 8; j++) {
+            int val = (word >> (j * WIRE_CELL_BITS)) & WIRE_CELL_MASK;
+            b->board[i + j] = val;
+            filled += val != 0;
+            maxval = val > maxval ? val : maxval;
+        }
+    }
+    for (; i < BOARD_CELLS; i++) {
+        size_t bit = (size_t)i * WIRE_CELL_BITS;
+        unsigned pair = in[bit / 8];
+        if (bit / 8 + 1 < WIRE_CELLS_SIZE) {
+            pair |= (unsigned)in[bit / 8 + 1] << 8;
+        }
+        int val = (pair >> (bit % 8)) & WIRE_CELL_MASK;
+        b->board[i] = val;
+        filled += val != 0;
+        maxval = val > maxval ? val : maxval;
+    }
+    if (maxval > N_VALUES || filled != (int)h.nfilled) {
+        fprintf(stderr, "serialized board has bad cells\n");
+        free_board_ctx(ctx, b);
+        return NULL;
+    }
+    // Masks are trusted, to save rebuilding them
+    if (h.flags & BOARD_WIRE_MASKS) {
+#ifndef NDEBUG
+        if (!wire_masks_valid(ctx, b, in + WIRE_CELLS_SIZE)) {
+            fprintf(stderr, "serialized board has bad masks\n");
+            free_board_ctx(ctx, b);
+            return NULL;
+        }
+#endif
+        masks_from_wire(b, in + WIRE_CELLS_SIZE);
+    } else {
+        rebuild_masks(ctx, b);
+    }
+    b->nfilled = filled;
+    b->trace_parent = 0;
+    b->depth = h.depth;
+    b->branch_pos = h.branch_pos;
+    b->branch_val = h.branch_val;
+    b->propagated = (h.flags & BOARD_WIRE_PROPAGATED) != 0;
+    return b;
+}
+
 int boardlist_len(struct boardlist *l) {
     return l->len;
 }
 
+long boardlist_spilled(struct boardlist *l) {
+    if (l->spill == NULL) {
+        return 0;
+    }
+    return l->spill->nboards + l->spill->tail_len;
+}
+
+bool boardlist_refill(struct boardlist *l) {
+    assert(solver_init);
+    return boardlist_refill_ctx(&default_ctx, l);
+}
+
+bool boardlist_refill_ctx(struct sudoku_ctx *ctx, struct boardlist *l) {
+    for (int i = 0; i < l->len; i++) {
+        free_entry(ctx, l, i);
+    }
+    l->len = 0;
+    return spill_refill(ctx, l);
+}
+
 struct board *boardlist_get(struct boardlist *l, int i) {
     assert(i < l->len);
+    if (l->arr[i] == NULL && l->nodes != NULL && l->nodes[i] != NULL) {
+        // Materialize in place; the list owns the board as before
+        struct board *b = new_board();
+        materialize_node(l->nodes[i], b);
+        release_node(l->nodes[i]);
+        l->nodes[i] = NULL;
+        l->arr[i] = b;
+    }
     return l->arr[i];
 }
 
@@ -483,25 +2081,57 @@ void print_board_stderr(struct board *b) {
 struct boardlist *sudoku_solver(struct board *start, bool breadthfirst,
                                                             long quota) {
     assert(solver_init);
+    return sudoku_solver_ctx(&default_ctx, start, breadthfirst, quota);
+}
+
+struct boardlist *sudoku_solver_resume(struct boardlist *boards, bool breadthfirst,
+                                                            long quota) {
+    assert(solver_init);
+    return sudoku_solver_resume_ctx(&default_ctx, boards, breadthfirst, quota);
+}
+
+struct boardlist *sudoku_solver_ctx(struct sudoku_ctx *ctx, struct board *start,
+                                    bool breadthfirst, long quota) {
     //fprintf(stderr, "sudoku_solver enter\n");
     // Init number masks
     // Init start board
+#ifdef BITBOARD_ENGINE
+    // The bitboard engine only does complete depth-first searches
+    if (ctx->engine == SOLVER_BITBOARD && !breadthfirst && quota < 0) {
+        return bitboard_solver(ctx, start);
+    }
+#endif
 
     struct boardlist *boards = malloc(sizeof(struct boardlist));
     assert(boards != NULL);
     init_boardlist(boards, 2 * (breadthfirst && quota > 1024 ? quota: 1024));
     add_board(boards, start);
 
-    return sudoku_solver_resume(boards, breadthfirst, quota);
+    return sudoku_solver_resume_ctx(ctx, boards, breadthfirst, quota);
 }
 
-struct boardlist *sudoku_solver_resume(struct boardlist *boards, bool breadthfirst,
-                                                            long quota) {
+struct boardlist *sudoku_solver_resume_ctx(struct sudoku_ctx *ctx,
+        struct boardlist *boards, bool breadthfirst, long quota) {
     // Keep exploring until either we have generated enough candidates or
     // we've exhausted all branches
     bool solved = false;
     long pass = 0;
-    if (breadthfirst) {
+    if (ctx->compact_frontier && boards->nodes == NULL) {
+        boards->nodes = calloc(boards->size, sizeof(struct frontier_node*));
+        assert(boards->nodes != NULL);
+    }
+    bool compact = boards->nodes != NULL;
+    if (boards->len == 0 && boards->spill != NULL) {
+        spill_refill(ctx, boards);
+    }
+    if (breadthfirst && ctx->bfs_threads > 1) {
+        while (!solved && (quota < 0 || boards->len < quota) && boards->len > 0) {
+            solved = parallel_bfs_level(ctx, boards, quota);
+            pass++;
+        }
+    } else if (breadthfirst && ctx->spill_max > 0) {
+        solved = spill_bfs(ctx, boards, quota);
+    } else if (breadthfirst) {
         while (!solved && (quota < 0 || boards->len < quota) && boards->len > 0) {
 #ifndef NDEBUG
             fprintf(stderr, "sudoku_solver start BFS pass %ld: "
@@ -511,16 +2141,19 @@ struct boardlist *sudoku_solver_resume(struct boardlist *boards, bool breadthfir
             int toremove = n;
             int i;
             for (i = 0; i < n; i++) {
-                struct board *curr = boards->arr[i];
+                struct frontier_node *node;
+                struct board *curr = take_entry(ctx, boards, i, &node);
                 DPRINTF("candidate %d/%d %d\n", i+1, n, curr->nfilled);
-#ifndef NDEBUG
-                boards->arr[i] = NULL;
-#endif
                 int oldlen = boards->len;
                 // append new boards to end of array
-                solve_step(curr, boards);
+                if (compact) {
+                    compact_step(ctx, curr, node, boards);
+                } else {
+                    solve_step(ctx, curr, boards);
+                }
 
                 solved = boards->len - oldlen == 1 &&
+                        boards->arr[boards->len - 1] != NULL &&
                         boards->arr[boards->len - 1]->nfilled == BOARD_CELLS;
 
                 if (solved) {
@@ -528,6 +2161,9 @@ struct boardlist *sudoku_solver_resume(struct boardlist *boards, bool breadthfir
 #ifndef NDEBUG
                     fprintf(stderr, "SOLVED!\n");
 #endif
+                    for (int j = i + 1; j < boards->len - 1; j++) {
+                        free_entry(ctx, boards, j);
+                    }
                     toremove = boards->len - 1;
                     break;
                 }
@@ -544,134 +2180,735 @@ struct boardlist *sudoku_solver_resume(struct boardlist *boards, bool breadthfir
             pass++;
         }
     } else {
+        if (ctx->progress_interval > 0) {
+            progress_start(ctx);
+        }
         while ((quota < 0 || boards->len <= 1 ||
                     pass < quota + ((boards->len / 2) * quota))
                             && boards->len > 0 && !solved) {
     #ifndef NDEBUG
             fprintf(stderr, "sudoku_solver start pass %ld: %d candidate boards\n", pass, boards->len);
     #endif
-            struct board *curr = remove_last_board(boards);
+            struct frontier_node *node;
+            struct board *curr = take_entry(ctx, boards, boards->len - 1,
+                                            &node);
+            boards->len--;
             // DFS
             int oldlen = boards->len;
-            solve_step(curr, boards);
+            if (compact) {
+                compact_step(ctx, curr, node, boards);
+            } else {
+                solve_step(ctx, curr, boards);
+            }
 
 
             int newboards = boards->len - oldlen;
             assert(newboards >= 0 && newboards <= N_VALUES);
-            if (newboards == 1 && boards->arr[boards->len-1]->nfilled == BOARD_CELLS) {
+            if (newboards == 1 && boards->arr[boards->len-1] != NULL &&
+                    boards->arr[boards->len-1]->nfilled == BOARD_CELLS) {
                solved = true;
                for (int i=0; i < boards->len - 1; i++) {
-                 free(boards->arr[i]);
-#ifndef NDEBUG
-                 boards->arr[i] = NULL;
-#endif
+                 free_entry(ctx, boards, i);
                }
                assert(boards->arr[boards->len-1] != NULL);
                assert(boards->arr[boards->len-1]->nfilled == BOARD_CELLS);
                bump_boards(boards, boards->len - 1);
+               if (boards->spill != NULL) {
+                   spill_free(ctx, boards->spill);
+                   boards->spill = NULL;
+               }
                assert(boards->len == 1);
                assert(boards->arr[0] != NULL);
                assert(boards->arr[0]->nfilled == BOARD_CELLS);
                assert(boardlist_solved(boards));
             }
+            if (ctx->spill_max > 0 && !solved) {
+                if (boards->len > ctx->spill_max && !ctx->spill_failed) {
+                    // The oldest boards are the bottom of the stack
+                    int batch = spill_batch_size(ctx);
+                    if (spill_entries(ctx, boards, 0, batch, true)) {
+                        bump_boards(boards, batch);
+                    }
+                } else if (boards->len == 0) {
+                    spill_refill(ctx, boards);
+                }
+            }
             pass++;
+            if (ctx->progress_interval > 0 && (pass & 63) == 0) {
+                progress_tick(ctx, boards);
+            }
         }
     }
 
+    if (ctx->trace != NULL) {
+        trace_end_events(ctx, clock_ns());
+    }
+    if (boards->len == 0 && boards->spill != NULL) {
+        spill_refill(ctx, boards);
+    }
     if (boards->len == 0) {
-        free_boardlist(boards, true);
+        free_boardlist_ctx(ctx, boards, true);
         return NULL;
     } else {
         return boards;
     }
 }
 
-bool boardlist_solved(struct boardlist *boards) {
-    if (boards != NULL) {
-        if (boards->len == 1) {
-            if (boards->arr[0]->nfilled == BOARD_CELLS) {
-                return true;
+/*
+ * Expand one BFS level on ctx->bfs_threads threads.  The unexpanded rest
+ * of the level followed by the children, in the order serial BFS would
+ * produce them, become the next level.  Stops at the same entry as serial
+ * BFS, once the next level would exceed quota or an entry is solved, and
+ * leaves the statistics as serial BFS would.  Returns true if solved, in
+ * which case boards holds just the solution.
+ */
+static bool parallel_bfs_level(struct sudoku_ctx *ctx,
+           struct boardlist *boards, long quota) {
+    int nthreads = ctx->bfs_threads;
+    grow_workers(ctx, nthreads - 1);
+    bool compact = boards->nodes != NULL;
+    int n = boards->len;
+
+    struct bfs_level level;
+    level.cur = boards;
+    level.n = n;
+    level.quota = quota;
+    level.next = 0;
+    level.stop = false;
+    level.owner = malloc(sizeof(int) * 3 * n);
+    level.orig = malloc(sizeof(struct board*) * n);
+    level.orig_nodes = malloc(sizeof(struct frontier_node*) * n);
+    level.state = calloc(n, sizeof(char));
+    assert(level.owner != NULL && level.orig != NULL &&
+           level.orig_nodes != NULL && level.state != NULL);
+    level.start = level.owner + n;
+    level.count = level.owner + 2 * n;
+    pthread_mutex_init(&level.lock, NULL);
+    level.prefix = 0;
+    level.prefix_generated = 0;
+    level.cutoff = -1;
+
+    struct bfs_worker *workers = malloc(sizeof(struct bfs_worker) * nthreads);
+    pthread_t *threads = malloc(sizeof(pthread_t) * nthreads);
+    assert(workers != NULL && threads != NULL);
+    for (int t = 0; t < nthreads; t++) {
+        struct bfs_worker *w = &workers[t];
+        w->level = &level;
+        w->id = t;
+        // This thread works as worker 0 with the caller's context
+        w->ctx = (t == 0) ? ctx : ctx->bfs_workers[t - 1];
+        if (t > 0) {
+            w->ctx->branch_heuristic = ctx->branch_heuristic;
+            w->ctx->value_order = ctx->value_order;
+            w->ctx->probe_depth = ctx->probe_depth;
+            w->ctx->probe_width = ctx->probe_width;
+            w->ctx->compact_frontier = ctx->compact_frontier;
+            if (w->ctx->trace != ctx->trace) {
+                set_trace_log_ctx(w->ctx, ctx->trace);
             }
+            memset(&w->ctx->stats, 0, sizeof(struct solver_stats));
         }
+        init_boardlist(&w->out, 1024);
+        if (compact) {
+            w->out.nodes = malloc(sizeof(struct frontier_node*) * w->out.size);
+            assert(w->out.nodes != NULL);
+        }
+        w->claims = NULL;
+        w->claims_head = 0;
+        w->claims_len = 0;
+        w->claims_size = 0;
+    }
+    for (int t = 1; t < nthreads; t++) {
+        pthread_create(&threads[t], NULL, bfs_worker_run, &workers[t]);
+    }
+    bfs_worker_run(&workers[0]);
+    for (int t = 1; t < nthreads; t++) {
+        pthread_join(threads[t], NULL);
     }
-    return false;
-}
 
+    // Without a cut-off every entry was expanded
+    bool solved = level.cutoff >= 0 && level.state[level.cutoff] == BFS_SOLVED;
+    int cutoff = level.cutoff >= 0 ? level.cutoff : n - 1;
+    int claimed = level.next < n ? level.next : n;
 
-/*
- * Look at board start, see which cells can be filled in, and then branch at
- * a cell chosen by a heuristic.  The branches are added to the end of boardlist.
- *
- * Dynamically resizes boards if needed
+    // Take the expansions past the cut-off out of the statistics
+    for (int t = 0; t < nthreads; t++) {
+        struct bfs_worker *w = &workers[t];
+        for (int k = w->claims_head; k < w->claims_len; k++) {
+            if (w->claims[k].i > cutoff) {
+                w->ctx->stats = w->claims[k].stats;
+                break;
+            }
+        }
+        if (t > 0) {
+            add_worker_stats(ctx, w->ctx);
+        }
+        free(w->claims);
+    }
+
+    // Entries up to the cut-off are replaced by their children, those
+    // past it are put back as they were
+    for (int i = 0; i < claimed; i++) {
+        if (i <= cutoff) {
+            if (level.orig[i] != NULL) {
+                free_board_ctx(ctx, level.orig[i]);
+            }
+            release_node(level.orig_nodes[i]);
+            continue;
+        }
+        struct boardlist *out = &workers[level.owner[i]].out;
+        for (int j = 0; j < level.count[i]; j++) {
+            free_entry(ctx, out, level.start[i] + j);
+        }
+        boards->arr[i] = level.orig[i];
+        if (compact) {
+            boards->nodes[i] = level.orig_nodes[i];
+        }
+    }
+
+    int expanded = cutoff + 1;
+    if (solved) {
+        struct boardlist *out = &workers[level.owner[cutoff]].out;
+        struct board *solution = out->arr[level.start[cutoff]];
+        out->arr[level.start[cutoff]] = NULL;
+        for (int i = expanded; i < n; i++) {
+            free_entry(ctx, boards, i);
+        }
+        for (int t = 0; t < nthreads; t++) {
+            for (int i = 0; i < workers[t].out.len; i++) {
+                free_entry(ctx, &workers[t].out, i);
+            }
+        }
+        boards->len = 0;
+        add_board(boards, solution);
+    } else {
+        int len = (n - expanded) + (int)level.prefix_generated;
+        int size = len > 1024 ? len : 1024;
+        struct board **arr = malloc(sizeof(struct board*) * size);
+        struct frontier_node **nodes = NULL;
+        assert(arr != NULL);
+        if (compact) {
+            nodes = malloc(sizeof(struct frontier_node*) * size);
+            assert(nodes != NULL);
+        }
+        int k = 0;
+        for (int i = expanded; i < n; i++, k++) {
+            arr[k] = boards->arr[i];
+            if (compact) {
+                nodes[k] = boards->nodes[i];
+            }
+        }
+        for (int i = 0; i < expanded; i++) {
+            struct boardlist *out = &workers[level.owner[i]].out;
+            int start = level.start[i];
+            memcpy(arr + k, out->arr + start,
+                   sizeof(struct board*) * level.count[i]);
+            if (compact) {
+                memcpy(nodes + k, out->nodes + start,
+                       sizeof(struct frontier_node*) * level.count[i]);
+            }
+            k += level.count[i];
+        }
+        assert(k == len);
+        free(boards->arr);
+        free(boards->nodes);
+        boards->arr = arr;
+        boards->nodes = nodes;
+        boards->size = size;
+        boards->len = len;
+    }
+
+    for (int t = 0; t < nthreads; t++) {
+        free(workers[t].out.arr);
+        free(workers[t].out.nodes);
+    }
+    free(workers);
+    free(threads);
+    free(level.owner);
+    free(level.orig);
+    free(level.orig_nodes);
+    free(level.state);
+    pthread_mutex_destroy(&level.lock);
+    return solved;
+}
+
+/* Claim and expand entries of the current level until none are left or
+ * the cut-off is found */
+static void *bfs_worker_run(void *arg) {
+    struct bfs_worker *w = arg;
+    struct bfs_level *level = w->level;
+    bool compact = level->cur->nodes != NULL;
+    while (!__atomic_load_n(&level->stop, __ATOMIC_ACQUIRE)) {
+        int i = __atomic_fetch_add(&level->next, 1, __ATOMIC_RELAXED);
+        if (i >= level->n) {
+            break;
+        }
+        bfs_claim_push(w, i);
+        struct frontier_node *node;
+        struct board *curr = take_entry(w->ctx, level->cur, i, &node);
+        // Kept in case the entry turns out to be past the cut-off
+        if (node != NULL) {
+            level->orig[i] = NULL;
+            level->orig_nodes[i] = copy_node(node);
+        } else {
+            level->orig[i] = clone_board(w->ctx, curr);
+            level->orig_nodes[i] = NULL;
+        }
+        int oldlen = w->out.len;
+        if (compact) {
+            compact_step(w->ctx, curr, node, &w->out);
+        } else {
+            solve_step(w->ctx, curr, &w->out);
+        }
+        int nnew = w->out.len - oldlen;
+        level->owner[i] = w->id;
+        level->start[i] = oldlen;
+        level->count[i] = nnew;
+        bool solved = nnew == 1 && w->out.arr[oldlen] != NULL &&
+                      w->out.arr[oldlen]->nfilled == BOARD_CELLS;
+
+        // Claims before the entries known to be within the level are final
+        int confirmed = bfs_level_advance(level, i, solved);
+        while (w->claims_head < w->claims_len &&
+               w->claims[w->claims_head].i < confirmed) {
+            w->claims_head++;
+        }
+    }
+    if (w->ctx->trace != NULL) {
+        trace_end_events(w->ctx, clock_ns());
+    }
+    return NULL;
+}
+
+/* Record w's statistics before it expands entry i */
+static void bfs_claim_push(struct bfs_worker *w, int i) {
+    if (w->claims_head > 0 && w->claims_head == w->claims_len) {
+        w->claims_head = w->claims_len = 0;
+    }
+    if (w->claims_len == w->claims_size) {
+        if (w->claims_head > 0) {
+            memmove(w->claims, w->claims + w->claims_head,
+                    sizeof(struct bfs_claim) * (w->claims_len - w->claims_head));
+            w->claims_len -= w->claims_head;
+            w->claims_head = 0;
+        } else {
+            w->claims_size = w->claims_size == 0 ? 16 : 2 * w->claims_size;
+            w->claims = realloc(w->claims,
+                                sizeof(struct bfs_claim) * w->claims_size);
+            assert(w->claims != NULL);
+        }
+    }
+    w->claims[w->claims_len].i = i;
+    w->claims[w->claims_len].stats = w->ctx->stats;
+    w->claims_len++;
+}
+
+/*
+ * Mark entry i expanded, then walk the expanded entries in order, as
+ * serial BFS would, until one is missing or the cut-off is found.
+ * Returns the number of entries known to be before or at the cut-off.
+ */
+static int bfs_level_advance(struct bfs_level *level, int i, bool solved) {
+    pthread_mutex_lock(&level->lock);
+    level->state[i] = solved ? BFS_SOLVED : BFS_EXPANDED;
+    while (level->cutoff < 0 && level->prefix < level->n &&
+           level->state[level->prefix] != BFS_PENDING) {
+        int p = level->prefix;
+        level->prefix_generated += level->count[p];
+        if (level->state[p] == BFS_SOLVED ||
+                (level->quota >= 0 && level->prefix_generated +
+                 (level->n - p - 1) > level->quota)) {
+            level->cutoff = p;
+            __atomic_store_n(&level->stop, true, __ATOMIC_RELEASE);
+        }
+        level->prefix++;
+    }
+    int confirmed = level->prefix;
+    pthread_mutex_unlock(&level->lock);
+    return confirmed;
+}
+/* Make sure ctx has at least n helper contexts */
+static void grow_workers(struct sudoku_ctx *ctx, int n) {
+    if (ctx->n_bfs_workers < n) {
+        ctx->bfs_workers = realloc(ctx->bfs_workers,
+                            sizeof(struct sudoku_ctx *) * n);
+        assert(ctx->bfs_workers != NULL);
+        while (ctx->n_bfs_workers < n) {
+            ctx->bfs_workers[ctx->n_bfs_workers++] = sudoku_ctx_create(0);
+        }
+    }
+}
+
+static void add_worker_stats(struct sudoku_ctx *ctx,
+           struct sudoku_ctx *worker) {
+    struct solver_stats *st = &worker->stats;
+    ctx->stats.nodes += st->nodes;
+    ctx->stats.branches += st->branches;
+    ctx->stats.deadends += st->deadends;
+    ctx->stats.probes += st->probes;
+    ctx->stats.eliminated += st->eliminated;
+    ctx->stats.forced += st->forced;
+    ctx->stats.spilled += st->spilled;
+    ctx->stats.spill_lost += st->spill_lost;
+}
+
+struct board *sudoku_solve_portfolio_ctx(struct sudoku_ctx *ctx,
+                                         struct board *start, int nthreads) {
+    assert(nthreads >= 1);
+    if (nthreads > MAX_PORTFOLIO) {
+        nthreads = MAX_PORTFOLIO;
+    }
+    // Every member runs on a helper context, so that the caller's options
+    // are left alone; this thread runs member 0
+    grow_workers(ctx, nthreads);
+    struct portfolio pf = {false, NULL};
+    struct portfolio_member members[MAX_PORTFOLIO];
+    pthread_t threads[MAX_PORTFOLIO];
+    for (int t = 0; t < nthreads; t++) {
+        struct portfolio_member *m = &members[t];
+        const struct portfolio_strategy *st = &portfolio_strategies[t];
+        m->pf = &pf;
+        m->ctx = ctx->bfs_workers[t];
+        m->ctx->branch_heuristic = st->branch;
+        m->ctx->value_order = st->order;
+        m->ctx->probe_depth = st->probe_depth;
+        m->ctx->probe_width = ctx->probe_width;
+        m->ctx->compact_frontier = false;
+        m->ctx->bfs_threads = 1;
+        if (m->ctx->trace != ctx->trace) {
+            set_trace_log_ctx(m->ctx, ctx->trace);
+        }
+        memset(&m->ctx->stats, 0, sizeof(struct solver_stats));
+        m->start = (t == nthreads - 1) ? start : clone_board(m->ctx, start);
+    }
+    for (int t = 1; t < nthreads; t++) {
+        pthread_create(&threads[t], NULL, portfolio_member_run, &members[t]);
+    }
+    portfolio_member_run(&members[0]);
+    add_worker_stats(ctx, members[0].ctx);
+    for (int t = 1; t < nthreads; t++) {
+        pthread_join(threads[t], NULL);
+        add_worker_stats(ctx, members[t].ctx);
+    }
+    return pf.solution;
+}
+
+/* Search depth-first a slice at a time until this or another member
+ * finishes */
+static void *portfolio_member_run(void *arg) {
+    struct portfolio_member *m = arg;
+    struct portfolio *pf = m->pf;
+    struct boardlist *boards = sudoku_solver_ctx(m->ctx, m->start, false,
+                                                 PORTFOLIO_SLICE);
+    while (boards != NULL && !boardlist_solved(boards) &&
+           !__atomic_load_n(&pf->done, __ATOMIC_ACQUIRE)) {
+        boards = sudoku_solver_resume_ctx(m->ctx, boards, false,
+                                          PORTFOLIO_SLICE);
+    }
+    if (boards == NULL) {
+        // Every branch was a dead end, so there is no solution
+        __atomic_store_n(&pf->done, true, __ATOMIC_RELEASE);
+    } else {
+        if (boardlist_solved(boards)) {
+            struct board *expected = NULL;
+            if (__atomic_compare_exchange_n(&pf->solution, &expected,
+                    boards->arr[0], false, __ATOMIC_ACQ_REL,
+                    __ATOMIC_ACQUIRE)) {
+                boards->len = 0;
+            }
+            __atomic_store_n(&pf->done, true, __ATOMIC_RELEASE);
+        }
+        free_boardlist_ctx(m->ctx, boards, true);
+    }
+    return NULL;
+}
+
+bool boardlist_solved(struct boardlist *boards) {
+    if (boards != NULL) {
+        if (boards->len == 1) {
+            if (boards->arr[0] != NULL &&
+                    boards->arr[0]->nfilled == BOARD_CELLS) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+
+/*
+ * Look at board start, see which cells can be filled in, and then branch at
+ * a cell chosen by a heuristic.  The branches are added to the end of boardlist.
+ *
+ * Dynamically resizes boards if needed
  * This should either copy the pointer to start into the array at a later position, or
  * free start
  */
-void solve_step(struct board *start, struct boardlist *boards) {
+void solve_step(struct sudoku_ctx *ctx, struct board *start,
+           struct boardlist *boards) {
+    struct branch br;
+    mask_t mask;
+    switch (expand_board(ctx, start, &br, &mask)) {
+        case EXPAND_DEADEND:
+            free_board_ctx(ctx, start);
+            break;
+        case EXPAND_SOLVED:
+            // Solved!
+            // put solution in last spot of array
+            add_board(boards, start);
+            DPRINTF("FOUND SOLUTION\n");
+            break;
+        case EXPAND_BRANCH: {
+            struct cell cells[BOARD_WIDTH];
+            int values[BOARD_WIDTH];
+            int n = branch_choices(ctx, start, &br, mask, cells, values);
+            int depth = start->depth + 1;
+            for (int i = 0; i < n; i++) {
+                // The last branch reuses start
+                struct board *newboard = (i == n - 1) ? start :
+                                                clone_board(ctx, start);
+                DPRINTF("branch: ");
+                set_cell(ctx, newboard, cells[i].row, cells[i].col, values[i]);
+                newboard->trace_parent = ctx->trace_id;
+                newboard->depth = depth;
+                newboard->branch_pos = cells[i].row * BOARD_WIDTH + cells[i].col;
+                newboard->branch_val = values[i];
+                add_board(boards, newboard);
+            }
+            ctx->stats.branches += n;
+            break;
+        }
+    }
+}
+
+/*
+ * As solve_step, for a board taken from a compact list.  node is the
+ * board's frontier node, or NULL if it was stored in full.  The branches
+ * are added as nodes that share a parent node holding start's cells.
+ * Takes ownership of start and the reference to node.
+ */
+static void compact_step(struct sudoku_ctx *ctx, struct board *start,
+           struct frontier_node *node, struct boardlist *boards) {
+    if (node != NULL) {
+        memcpy(ctx->before, start->board, CELLS_MEM);
+    }
+    struct branch br;
+    mask_t mask;
+    enum expansion e = expand_board(ctx, start, &br, &mask);
+    if (e == EXPAND_SOLVED) {
+        add_board(boards, start);
+        release_node(node);
+        return;
+    }
+    if (e == EXPAND_DEADEND) {
+        free_board_ctx(ctx, start);
+        release_node(node);
+        return;
+    }
+
+    // Record the cells filled in by propagation and probing in the parent
+    // of the branches: node itself, as nothing else refers to it yet
+    struct frontier_node *parent;
+    if (node == NULL) {
+        parent = new_node(NULL, start->nfilled);
+        int n = 0;
+        for (int i = 0; i < BOARD_CELLS; i++) {
+            if (start->board[i] != 0) {
+                parent->deltas[n].pos = i;
+                parent->deltas[n].val = start->board[i];
+                n++;
+            }
+        }
+        assert(n == start->nfilled);
+    } else {
+        assert(node->refs == 1);
+        int nnew = 0;
+        for (int i = 0; i < BOARD_CELLS; i++) {
+            nnew += start->board[i] != ctx->before[i];
+        }
+        parent = node;
+        if (nnew > 0) {
+            parent = realloc(node, sizeof(struct frontier_node) +
+                         sizeof(struct delta) * (node->ndeltas + nnew));
+            assert(parent != NULL);
+            for (int i = 0; i < BOARD_CELLS; i++) {
+                if (start->board[i] != ctx->before[i]) {
+                    parent->deltas[parent->ndeltas].pos = i;
+                    parent->deltas[parent->ndeltas].val = start->board[i];
+                    parent->ndeltas++;
+                }
+            }
+        }
+    }
+    parent->trace_id = ctx->trace_id;
+    parent->depth = start->depth;
+
+    struct cell cells[BOARD_WIDTH];
+    int values[BOARD_WIDTH];
+    int n = branch_choices(ctx, start, &br, mask, cells, values);
+    for (int i = 0; i < n; i++) {
+        struct frontier_node *child = new_node(parent, 1);
+        child->depth = start->depth + 1;
+        child->deltas[0].pos = cells[i].row * BOARD_WIDTH + cells[i].col;
+        child->deltas[0].val = values[i];
+        add_node(boards, child);
+    }
+    ctx->stats.branches += n;
+    free_board_ctx(ctx, start);
+    release_node(parent);
+}
+
+/*
+ * Fill in what can be deduced on board start, then decide what to branch
+ * on.  Returns EXPAND_BRANCH with the branch in br and, for a cell branch,
+ * its candidates in mask.  Does not free start.
+ */
+static enum expansion expand_board(struct sudoku_ctx *ctx, struct board *start,
+           struct branch *br, mask_t *mask) {
+    if (ctx->trace == NULL) {
+        return expand_untraced(ctx, start, br, mask);
+    }
+    // The first event after the solver returns needs a start time
+    if (ctx->trace_untimed == 0 || ctx->trace_untimed == TRACE_CLOCK_EVENTS) {
+        trace_end_events(ctx, clock_ns());
+    }
+    int before = start->nfilled;
+    enum expansion e = expand_untraced(ctx, start, br, mask);
+    trace_expansion(ctx, start, e, start->nfilled - before,
+                    e == EXPAND_BRANCH ? br->nchoices : 0);
+    return e;
+}
+
+/* expand_board, setting ctx->trace_dead on a dead end */
+static enum expansion expand_untraced(struct sudoku_ctx *ctx,
+           struct board *start, struct branch *br, mask_t *mask) {
     DPRINTF("Enter solve_step\n");
     DPRINT_BOARD(stderr, start);
     assert(start != NULL);
-    assert(boards != NULL);
-    struct changestack stack;
-    stack.size = 1024;
-    stack.len = 0;
-    stack.arr = malloc(sizeof(struct cell) * stack.size);
+    ctx->stats.nodes++;
+    struct changestack *stack = &ctx->stack;
+
+    // Fill in what we can, then branch on the most constrained choice
+    // (least number of possibilities)
+    if (!fill_singles(ctx, start)) {
+        ctx->stats.deadends++;
+        return EXPAND_DEADEND;
+    }
+
+    DPRINTF("Solve_step done propagating constraints, %d filled\n", start->nfilled);
+    DPRINT_BOARD(stderr, start);
+
+    struct refined refined;
+    memset(&refined, 0, sizeof(refined));
+    if (ctx->probe_depth > 0 && start->nfilled < BOARD_CELLS) {
+        ctx->trail.len = 0;
+        if (!probe_board(ctx, start, stack, &ctx->trail, &refined)) {
+            DPRINTF("Not viable after probing\n");
+            ctx->stats.deadends++;
+            ctx->trace_dead = TRACE_DEAD_PROBE;
+            return EXPAND_DEADEND;
+        }
+    }
+
+    if (start->nfilled == BOARD_CELLS) {
+        DPRINTF("FOUND SOLUTION\n");
+        return EXPAND_SOLVED;
+    }
+
+    choose_branch(ctx, start, br);
+    if (!br->unit) {
+        *mask = get_mask(start, br->cell.row, br->cell.col);
+    }
+    if (br->nchoices > 0 && refined.nchoices > 0 &&
+            get_cell(start->board, refined.cell.row, refined.cell.col) == 0) {
+        // Values eliminated by probing stay eliminated as cells are
+        // filled in, so the refined mask is still valid
+        mask_t rmask = get_mask(start, refined.cell.row, refined.cell.col);
+        mask_and(&rmask, refined.mask);
+        int nrefined = mask_popcount(rmask);
+        if (nrefined < br->nchoices ||
+                (!br->unit && br->cell.row == refined.cell.row &&
+                 br->cell.col == refined.cell.col)) {
+            br->unit = false;
+            br->cell = refined.cell;
+            br->nchoices = nrefined;
+            *mask = rmask;
+        }
+    }
+    if (br->nchoices == 0) {
+        DPRINTF("Not viable\n");
+        ctx->stats.deadends++;
+        ctx->trace_dead = TRACE_DEAD_UNIT;
+        return EXPAND_DEADEND;
+    }
+    return EXPAND_BRANCH;
+}
+
+/*
+ * Fill in every cell left with a single candidate, and the cells this
+ * leaves with one, until there are none.  Returns false on a
+ * contradiction, with the reason in ctx->trace_dead.  Boards already
+ * propagated are left alone.
+ */
+static bool fill_singles(struct sudoku_ctx *ctx, struct board *b) {
+    struct changestack *stack = &ctx->stack;
+    stack->len = 0;
+    if (b->propagated) {
+        return true;
+    }
 
     // make initial pass over array until all directly constrained cells
     //  are filled in (those we can determine just by looking at row, column
     //  and block)
-    //  Then branch on the most constrained choice (least number of possibilities)
     for (int row = 0; row < BOARD_WIDTH; row++) {
         for (int col = 0; col < BOARD_WIDTH; col++) {
             DPRINTF("Solve_step: first pass cell[%d][%d]\n", row, col);
-            bool ok = check_cell(start, row, col, &stack, true);
+            bool ok = check_cell(ctx, b, row, col, stack, true, NULL);
             if (!ok) {
                 // no viable solution
                 DPRINTF("Not viable\n");
-                free_board(start);
-                free(stack.arr);
-                return;
+                ctx->trace_dead = TRACE_DEAD_CELL;
+                return false;
             }
         }
     }
 
-    DPRINTF("Solve_step: first pass done, %d items in stack \n", stack.len);
+    DPRINTF("Solve_step: first pass done, %d items in stack \n", stack->len);
 
     // Propagate constraints and see if we can fill out more cells
-    while (stack.len > 0) {
-        struct cell c = change_pop(&stack);
-        bool ok = check_cell(start, c.row, c.col, &stack, false);
-        if (!ok) {
-            // no viable solution
-            DPRINTF("Not viable\n");
-            free_board(start);
-            free(stack.arr);
-            return;
-        }
+    if (!propagate(ctx, b, stack, NULL)) {
+        // no viable solution
+        DPRINTF("Not viable\n");
+        ctx->trace_dead = TRACE_DEAD_PROPAGATE;
+        return false;
     }
+    b->propagated = true;
+    return true;
+}
 
-    DPRINTF("Solve_step done propagating constraints, %d filled\n", start->nfilled);
-    DPRINT_BOARD(stderr, start);
-
-    if (start->nfilled == BOARD_CELLS) {
-        // Solved!
-        // put solution in last spot of array
-        add_board(boards, start);
-        DPRINTF("FOUND SOLUTION\n");
-    } else {
-        struct cell bp = best_branchpoint(start);
-        DDUMP_MASK(get_mask(start, bp.row, bp.col));
-        do_branches(start, bp.row, bp.col,
-                    get_mask(start, bp.row, bp.col),
-                    boards);
+/*
+ * Pick what to branch on according to the current branch_heuristic.
+ * Sets br->nchoices to 0 if the board turns out to have no solution.
+ */
+static void choose_branch(struct sudoku_ctx *ctx, struct board *b,
+        struct branch *br) {
+    br->unit = false;
+    br->value = 0;
+    br->cell = best_branchpoint(ctx, b);
+    br->nchoices = mask_popcount(get_mask(b, br->cell.row, br->cell.col));
+    if (ctx->branch_heuristic == BRANCH_UNIT && br->nchoices > 1) {
+        if (!best_unit_branch(b, br)) {
+            br->nchoices = 0;
+        }
     }
-    free(stack.arr);
 }
 
-static struct cell best_branchpoint(struct board *b) {
+static struct cell best_branchpoint(struct sudoku_ctx *ctx, struct board *b) {
     int bestrow = -1;
     int bestcol = -1;
     int minbranches = N_VALUES + 1;
     int equalbestcount = 0;
+    int bestdegree = -1;
 
     for (int row = 0; row < BOARD_WIDTH; row++) {
         for (int col = 0; col < BOARD_WIDTH; col++) {
@@ -683,6 +2920,20 @@ static struct cell best_branchpoint(struct board *b) {
                     bestcol = col;
                     minbranches = nchoices;
                     equalbestcount = 1;
+                    bestdegree = -1;
+                }
+                else if (nchoices == minbranches &&
+                         ctx->branch_heuristic == BRANCH_MRV_DEGREE) {
+                    // Only compute degrees when there is a tie
+                    if (bestdegree < 0) {
+                        bestdegree = empty_peers(b, bestrow, bestcol);
+                    }
+                    int degree = empty_peers(b, row, col);
+                    if (degree > bestdegree) {
+                        bestrow = row;
+                        bestcol = col;
+                        bestdegree = degree;
+                    }
                 }
 #ifdef RANDOM_BRANCH
                 else if (nchoices == minbranches) {
@@ -691,7 +2942,7 @@ static struct cell best_branchpoint(struct board *b) {
                     // Choose this one with p=1/k, where k is number of
                     // alternatives found so far.  This guarantees each poss
                     // selected with equal probability
-                    int r = rand() % equalbestcount;
+                    int r = ctx_rand(ctx) % equalbestcount;
                     if (r == 0) {
                         bestrow = row;
                         bestcol = col;
@@ -709,8 +2960,95 @@ static struct cell best_branchpoint(struct board *b) {
     return res;
 }
 
-bool check_cell(struct board *b, int row, int col,
-            struct changestack *stack, bool firstpass) {
+/*
+ * Number of empty cells sharing a row, column or block with [row][col].
+ * Empty cells per unit come from the unit masks; cells counted twice
+ * because they share both the block and the row or column are subtracted.
+ */
+static int empty_peers(struct board *b, int row, int col) {
+    int block = get_block(row, col);
+    int count = (BOARD_WIDTH - mask_popcount(ROW_MASK(b, row)))
+              + (BOARD_WIDTH - mask_popcount(COL_MASK(b, col)))
+              + (BOARD_WIDTH - mask_popcount(BLOCK_MASK(b, block)));
+    int startrow = block_start_row(block);
+    int startcol = block_start_col(block);
+    for (int i = 0; i < BLOCK_WIDTH; i++) {
+        if (get_cell(b->board, row, startcol + i) == 0) {
+            count--;
+        }
+        if (get_cell(b->board, startrow + i, col) == 0) {
+            count--;
+        }
+    }
+    // [row][col] itself was counted three times and subtracted twice
+    return count - 1;
+}
+
+/*
+ * Look for a value that has fewer candidate positions within some unit than
+ * br->nchoices.  If one is found, br is replaced with a unit branch.
+ * Returns false if some value has no position left in a unit, i.e. the
+ * board has no solution.
+ */
+static bool best_unit_branch(struct board *b, struct branch *br) {
+    int bestunit = -1;
+    int bestval = -1;
+    int counts[N_VALUES];
+    int values[N_VALUES];
+
+    for (int unit = 0; unit < N_UNITS; unit++) {
+        memset(counts, 0, sizeof(counts));
+        for (int i = 0; i < BOARD_WIDTH; i++) {
+            struct cell c = unit_cell(unit, i);
+            if (get_cell(b->board, c.row, c.col) == 0) {
+                int n = mask_values(get_mask(b, c.row, c.col), values);
+                for (int j = 0; j < n; j++) {
+                    counts[values[j] - 1]++;
+                }
+            }
+        }
+        mask_t used = unit_mask(b, unit);
+        for (int val = 1; val <= N_VALUES; val++) {
+            if (mask_test(used, val)) {
+                continue;
+            }
+            int count = counts[val - 1];
+            if (count == 0) {
+                DPRINTF("Backtracking: no place for %d in unit %d\n", val, unit);
+                return false;
+            } else if (count < br->nchoices) {
+                bestunit = unit;
+                bestval = val;
+                br->nchoices = count;
+            }
+        }
+    }
+
+    if (bestunit >= 0) {
+        br->unit = true;
+        br->value = bestval;
+        int n = 0;
+        for (int i = 0; i < BOARD_WIDTH; i++) {
+            struct cell c = unit_cell(bestunit, i);
+            if (get_cell(b->board, c.row, c.col) == 0 &&
+                    mask_test(get_mask(b, c.row, c.col), bestval)) {
+                br->positions[n++] = c;
+            }
+        }
+        assert(n == br->nchoices);
+    }
+    return true;
+}
+
+/*
+ * If [row][col] has a single candidate, fill it in and push the cells whose
+ * candidates change onto stack.  If trail is non-NULL, filled cells are
+ * pushed onto it so they can be undone.
+ * Returns false if [row][col] has no candidates.
+ */
+bool check_cell(struct sudoku_ctx *ctx, struct board *b, int row, int col,
+            struct changestack *stack, bool firstpass,
+            struct changestack *trail) {
     assert(b != NULL);
     if (get_cell(b->board, row, col) == 0) {
         mask_t mask = get_mask(b, row, col);
@@ -721,9 +3059,9 @@ bool check_cell(struct board *b, int row, int col,
             // No viable solution
             DPRINTF("Backtracking: [%d][%d]\n", row, col);
             DPRINT_BOARD(stderr, b);
-            DPRINTF("  row mask:   "); DDUMP_MASK(b->row_masks[row]);
-            DPRINTF("  col mask:   ");DDUMP_MASK(b->col_masks[col]);
-            DPRINTF("  block mask: ");DDUMP_MASK(b->block_masks[get_block(row,col)]);
+            DPRINTF("  row mask:   "); DDUMP_MASK(ROW_MASK(b, row));
+            DPRINTF("  col mask:   ");DDUMP_MASK(COL_MASK(b, col));
+            DPRINTF("  block mask: ");DDUMP_MASK(CELL_BLOCK_MASK(b, row, col));
             return false;
         } else if (nchoices == 1) {
             DPRINTF("constrained [%d][%d]\n", row, col);
@@ -740,7 +3078,7 @@ bool check_cell(struct board *b, int row, int col,
                 maskelem >>= 1;
                 sol++;
             }
-            mask_t changemask = num_masks[sol-1];
+            mask_t changemask = ctx->num_masks[sol-1];
 
             // Don't need to look forward on first pass
             int maxcol = firstpass ? col : BOARD_WIDTH;
@@ -770,73 +3108,1557 @@ bool check_cell(struct board *b, int row, int col,
                     }
                 }
             }
-            set_cell(b, row, col, sol);
+            set_cell(ctx, b, row, col, sol);
+            if (trail != NULL) {
+                change_push(trail, row, col);
+            }
         }
     }
     return true;
 }
 
+/*
+ * Check cells on stack until no more can be filled in.
+ * Returns false on a contradiction, leaving stack empty.
+ */
+static bool propagate(struct sudoku_ctx *ctx, struct board *b,
+           struct changestack *stack, struct changestack *trail) {
+    while (stack->len > 0) {
+        struct cell c = change_pop(stack);
+        if (!check_cell(ctx, b, c.row, c.col, stack, false, trail)) {
+            stack->len = 0;
+            return false;
+        }
+    }
+    return true;
+}
 
-void do_branches(struct board *start, int row, int col, mask_t mask,
-            struct boardlist *boards) {
-#ifndef NDEBUG
-    fprintf(stderr, "BRANCHING [%d][%d]:\n", row, col);
-#endif
-    int top = -1;
-    for (int i = 0; i < MASK_SIZE; i++) {
-        if (mask.vec[i] != 0) {
-            top = i;
-        }
-    }
-    assert(top >= 0);
-    for(int i = 0; i <= top; i++) {
-        uint64_t maskp = mask.vec[i];
-        int cellchoice = MASK_ELEM_BITS * i + 1;
-        while (maskp != 0) {
-            if ((maskp & 0x1) != 0) {
-                struct board *newboard = NULL;
-                if (maskp == 1 && i == top) {
-                    // LAST
-                    newboard = start;
-                    start = NULL;
-                } else {
-                    // copy board & masks
-                    newboard = clone_board(start);
-                }
-#ifndef NDEBUG
-                fprintf(stderr, "choice: %d\n", cellchoice);
-#endif
-                DPRINTF("branch: ");
-                set_cell(newboard, row, col, cellchoice);
-                add_board(boards, newboard);
+/*
+ * Fill in [row][col] with val and propagate the consequences.
+ * Returns false on a contradiction.
+ */
+static bool assign(struct sudoku_ctx *ctx, struct board *b, int row, int col,
+           int val, struct changestack *stack, struct changestack *trail) {
+    trace_peers(b, row, col, ctx->num_masks[val-1], stack);
+    set_cell(ctx, b, row, col, val);
+    if (trail != NULL) {
+        change_push(trail, row, col);
+    }
+    return propagate(ctx, b, stack, trail);
+}
+
+static void undo_trail(struct sudoku_ctx *ctx, struct board *b,
+           struct changestack *trail) {
+    while (trail->len > 0) {
+        struct cell c = change_pop(trail);
+        unset_cell(ctx, b, c.row, c.col);
+    }
+}
+
+/*
+ * Find the probe_width empty cells with the fewest candidates.
+ * Returns the number found.
+ */
+static int probe_candidates(struct sudoku_ctx *ctx, struct board *b,
+           struct cell *cells) {
+    int probe_width = ctx->probe_width;
+    int counts[MAX_PROBE_WIDTH];
+    int n = 0;
+    for (int row = 0; row < BOARD_WIDTH; row++) {
+        for (int col = 0; col < BOARD_WIDTH; col++) {
+            if (get_cell(b->board, row, col) != 0) {
+                continue;
             }
-            cellchoice++;
-            maskp = maskp >> 1;
+            int nchoices = mask_popcount(get_mask(b, row, col));
+            if (n == probe_width && nchoices >= counts[n - 1]) {
+                continue;
+            }
+            // insert in sorted position, dropping the last if full
+            int i = (n < probe_width) ? n++ : n - 1;
+            while (i > 0 && counts[i - 1] > nchoices) {
+                counts[i] = counts[i - 1];
+                cells[i] = cells[i - 1];
+                i--;
+            }
+            counts[i] = nchoices;
+            cells[i].row = row;
+            cells[i].col = col;
         }
     }
+    return n;
 }
 
-void trace_effects(struct board *b, int row, int col, mask_t changemask,
-           struct changestack *stack) {
-    int block = get_block(row, col);
-    mask_t oldmask = b->row_masks[row];
-    mask_or(&oldmask, b->col_masks[col]);
-    mask_or(&oldmask, b->block_masks[block]);
-    for (int i = 0; i < MASK_SIZE; i++) {
-        uint64_t overlap = oldmask.vec[i] & changemask.vec[i];
-        if (overlap != 0) {
-            return;
+/*
+ * Failed-literal probing: tentatively assign each candidate value of the
+ * most constrained cells and propagate.  Values that lead straight to a
+ * contradiction are eliminated, and cells left with one value are filled
+ * in.  Probes are undone from a trail, so no boards are allocated.
+ * Repeats for up to probe_depth rounds while cells are being filled in.
+ * The probed cell with the fewest remaining values is returned in best.
+ * Returns false if the board has no solution.
+ */
+static bool probe_board(struct sudoku_ctx *ctx, struct board *b,
+           struct changestack *stack, struct changestack *trail,
+           struct refined *best) {
+    for (int round = 0; round < ctx->probe_depth; round++) {
+        struct cell cells[MAX_PROBE_WIDTH];
+        int ncells = probe_candidates(ctx, b, cells);
+        bool forced = false;
+        best->nchoices = 0;
+        for (int i = 0; i < ncells; i++) {
+            int row = cells[i].row;
+            int col = cells[i].col;
+            if (get_cell(b->board, row, col) != 0) {
+                // filled in by an earlier forced cell
+                continue;
+            }
+            int values[N_VALUES];
+            int n = mask_values(get_mask(b, row, col), values);
+            mask_t survivors;
+            memset(&survivors, 0, sizeof(mask_t));
+            int last = 0;
+            for (int j = 0; j < n; j++) {
+                ctx->stats.probes++;
+                assert(trail->len == 0);
+                bool ok = assign(ctx, b, row, col, values[j], stack, trail);
+                if (ok && b->nfilled == BOARD_CELLS) {
+                    // Probe found a solution, keep it
+                    trail->len = 0;
+                    return true;
+                }
+                undo_trail(ctx, b, trail);
+                if (ok) {
+                    mask_or(&survivors, ctx->num_masks[values[j]-1]);
+                    last = values[j];
+                } else {
+                    ctx->stats.eliminated++;
+                }
+            }
+            int nsurvivors = mask_popcount(survivors);
+            DPRINTF("probed [%d][%d]: %d/%d values left\n", row, col,
+                    nsurvivors, n);
+            if (nsurvivors == 0) {
+                return false;
+            } else if (nsurvivors == 1) {
+                ctx->stats.forced++;
+                forced = true;
+                if (!assign(ctx, b, row, col, last, stack, NULL)) {
+                    return false;
+                }
+                if (b->nfilled == BOARD_CELLS) {
+                    return true;
+                }
+            } else if (nsurvivors < n &&
+                       (best->nchoices == 0 || nsurvivors < best->nchoices)) {
+                best->cell = cells[i];
+                best->mask = survivors;
+                best->nchoices = nsurvivors;
+            }
+        }
+        if (!forced) {
+            break;
         }
     }
-    // no overlap - constraints on [row, col] changed
-    change_push(stack, row, col);
+    return true;
 }
 
-static inline int mask_popcount(mask_t mask) {
-    int res = 0;
-    for (int i = 0; i < MASK_SIZE; i++) {
-        res += __builtin_popcountll(mask.vec[i]);
-    }
-//    fprintf(stderr, "popcount %d ", res); DDUMP_MASK(mask);
-    return res;
+
+/*
+ * Fill values with the candidates in mask in the order they should be added
+ * to the boardlist.  The last board added is the first explored by DFS.
+ * Returns the number of values.
+ */
+static int order_values(struct sudoku_ctx *ctx, struct board *b, int row,
+        int col, mask_t mask, int *values) {
+    int n = mask_values(mask, values);
+    if (ctx->value_order == VALUE_ORDER_LOWEST) {
+        for (int i = 0; i < n / 2; i++) {
+            int tmp = values[i];
+            values[i] = values[n - 1 - i];
+            values[n - 1 - i] = tmp;
+        }
+    } else if (ctx->value_order == VALUE_ORDER_LCV) {
+        // Count how many empty peers each value would remove a candidate from
+        int counts[N_VALUES];
+        int peervals[N_VALUES];
+        memset(counts, 0, sizeof(counts));
+        int block = get_block(row, col);
+        int units[3] = {row, BOARD_WIDTH + col, 2 * BOARD_WIDTH + block};
+        for (int u = 0; u < 3; u++) {
+            for (int i = 0; i < BOARD_WIDTH; i++) {
+                struct cell c = unit_cell(units[u], i);
+                if ((c.row == row && c.col == col) ||
+                    get_cell(b->board, c.row, c.col) != 0) {
+                    continue;
+                }
+                // Cells in the block and our row or col were already seen
+                if (u == 2 && (c.row == row || c.col == col)) {
+                    continue;
+                }
+                mask_t peermask = get_mask(b, c.row, c.col);
+                mask_and(&peermask, mask);
+                int npeer = mask_values(peermask, peervals);
+                for (int j = 0; j < npeer; j++) {
+                    counts[peervals[j] - 1]++;
+                }
+            }
+        }
+        // Insertion sort, most constraining first so least constraining is
+        // added last.  Stable, so ties keep the default order
+        for (int i = 1; i < n; i++) {
+            int val = values[i];
+            int j = i - 1;
+            while (j >= 0 && counts[values[j] - 1] < counts[val - 1]) {
+                values[j + 1] = values[j];
+                j--;
+            }
+            values[j + 1] = val;
+        }
+    }
+    return n;
+}
+
+/*
+ * List the boards a branch creates, each as the cell to fill in and its
+ * value, in the order they should be added to the boardlist.  Returns the
+ * number of branches.
+ */
+static int branch_choices(struct sudoku_ctx *ctx, struct board *start,
+            struct branch *br, mask_t mask, struct cell *cells, int *values) {
+    int n;
+    if (br->unit) {
+#ifndef NDEBUG
+        fprintf(stderr, "BRANCHING value %d:\n", br->value);
+#endif
+        n = br->nchoices;
+        for (int i = 0; i < n; i++) {
+            cells[i] = br->positions[i];
+            values[i] = br->value;
+#ifndef NDEBUG
+            fprintf(stderr, "position: [%d][%d]\n", cells[i].row, cells[i].col);
+#endif
+        }
+    } else {
+#ifndef NDEBUG
+        fprintf(stderr, "BRANCHING [%d][%d]:\n", br->cell.row, br->cell.col);
+#endif
+        DDUMP_MASK(mask);
+        n = order_values(ctx, start, br->cell.row, br->cell.col, mask, values);
+        for (int i = 0; i < n; i++) {
+            cells[i] = br->cell;
+#ifndef NDEBUG
+            fprintf(stderr, "choice: %d\n", values[i]);
+#endif
+        }
+    }
+    assert(n > 0);
+    return n;
+}
+
+/*
+ * Push every peer of [row][col] whose candidates change when changemask
+ * is removed from them.
+ */
+static void trace_peers(struct board *b, int row, int col, mask_t changemask,
+           struct changestack *stack) {
+    for (int i = 0; i < BOARD_WIDTH; i++) {
+        if (i != col) {
+            trace_effects(b, row, i, changemask, stack);
+        }
+        if (i != row) {
+            trace_effects(b, i, col, changemask, stack);
+        }
+    }
+    int block = get_block(row, col);
+    int startrow = block_start_row(block);
+    int startcol = block_start_col(block);
+    for (int row2 = startrow; row2 < startrow + BLOCK_WIDTH; row2++) {
+        for (int col2 = startcol; col2 < startcol + BLOCK_WIDTH; col2++) {
+            // Cells sharing a row or column were covered above
+            if (row2 != row && col2 != col) {
+                trace_effects(b, row2, col2, changemask, stack);
+            }
+        }
+    }
+}
+
+void trace_effects(struct board *b, int row, int col, mask_t changemask,
+           struct changestack *stack) {
+    mask_t oldmask = ROW_MASK(b, row);
+    mask_or(&oldmask, COL_MASK(b, col));
+    mask_or(&oldmask, CELL_BLOCK_MASK(b, row, col));
+    for (int i = 0; i < MASK_SIZE; i++) {
+        uint64_t overlap = oldmask.vec[i] & changemask.vec[i];
+        if (overlap != 0) {
+            return;
+        }
+    }
+    // no overlap - constraints on [row, col] changed
+    change_push(stack, row, col);
+}
+
+static inline int mask_popcount(mask_t mask) {
+    int res = 0;
+    for (int i = 0; i < MASK_SIZE; i++) {
+        res += __builtin_popcountll(mask.vec[i]);
+    }
+//    fprintf(stderr, "popcount %d ", res); DDUMP_MASK(mask);
+    return res;
+}
+
+static inline bool mask_test(mask_t mask, int val) {
+    return ((mask.vec[(val-1) / MASK_ELEM_BITS] >>
+             ((val-1) % MASK_ELEM_BITS)) & 1) != 0;
+}
+
+/*
+ * Write the values with a bit set in mask to values in ascending order.
+ * Returns the number of values.
+ */
+static inline int mask_values(mask_t mask, int *values) {
+    int n = 0;
+    for (int i = 0; i < MASK_SIZE; i++) {
+        uint64_t elem = mask.vec[i];
+        while (elem != 0) {
+            values[n++] = MASK_ELEM_BITS * i + __builtin_ctzll(elem) + 1;
+            elem &= elem - 1;
+        }
+    }
+    return n;
+}
+
+/******************************************************************************
+ * Frontier spilling
+ *
+ * Boards are written a batch per file, as plain struct boards, with
+ * vectored writes straight from the boards, and read back the same way.
+ * A file is deleted as soon as it has been read back, so that disk use
+ * shrinks as the frontier does.  If a file can't be written, say because
+ * the disk is full, its boards stay where they were and the context stops
+ * spilling; if one can't be read back, its boards are lost and counted in
+ * the statistics.
+ ******************************************************************************/
+static inline int spill_batch_size(struct sudoku_ctx *ctx) {
+    return ctx->spill_max / SPILL_BATCH_DIVISOR;
+}
+
+static struct frontier_spill *get_spill(struct boardlist *list, bool lifo) {
+    if (list->spill == NULL) {
+        list->spill = calloc(1, sizeof(struct frontier_spill));
+        assert(list->spill != NULL);
+        list->spill->lifo = lifo;
+    }
+    return list->spill;
+}
+
+/* Write n boards to fd, or read them from it, retrying short transfers.
+ * Returns false on an error, or if the file ends first */
+static bool spill_io(int fd, struct board **boards, int n, bool write) {
+    struct iovec *iov = malloc(sizeof(struct iovec) * n);
+    assert(iov != NULL);
+    for (int i = 0; i < n; i++) {
+        iov[i].iov_base = boards[i];
+        iov[i].iov_len = sizeof(struct board);
+    }
+    struct iovec *next = iov;
+    int left = n;
+    while (left > 0) {
+        int k = left < SPILL_IOV_BOARDS ? left : SPILL_IOV_BOARDS;
+        ssize_t done = write ? writev(fd, next, k) : readv(fd, next, k);
+        if (done < 0 && errno == EINTR) {
+            continue;
+        }
+        if (done <= 0) {
+            break;
+        }
+        while (left > 0 && (size_t)done >= next->iov_len) {
+            done -= next->iov_len;
+            next++;
+            left--;
+        }
+        if (done > 0) {
+            next->iov_base = (char *)next->iov_base + done;
+            next->iov_len -= done;
+        }
+    }
+    free(iov);
+    return left == 0;
+}
+
+/* Write n boards to a new batch after the others, and free them.  Returns
+ * false, leaving the boards alone, if the file could not be written */
+static bool spill_write(struct sudoku_ctx *ctx, struct frontier_spill *spill,
+           struct board **boards, int n) {
+    size_t len = strlen(ctx->spill_dir) + 32;
+    char *path = malloc(len);
+    assert(path != NULL);
+    snprintf(path, len, "%s/sudoku-spill-XXXXXX", ctx->spill_dir);
+    int fd = mkstemp(path);
+    bool ok = fd >= 0 && spill_io(fd, boards, n, true);
+    if (fd >= 0 && close(fd) != 0) {
+        ok = false;
+    }
+    if (!ok) {
+        fprintf(stderr, "Could not write spill file %s, keeping the "
+                "frontier in memory\n", path);
+        if (fd >= 0) {
+            unlink(path);
+        }
+        free(path);
+        ctx->spill_failed = true;
+        return false;
+    }
+    for (int i = 0; i < n; i++) {
+        free_board_ctx(ctx, boards[i]);
+    }
+
+    if (spill->nbatches == spill->size) {
+        spill->size = spill->size == 0 ? 16 : 2 * spill->size;
+        spill->batches = realloc(spill->batches,
+                                 sizeof(struct spill_batch) * spill->size);
+        assert(spill->batches != NULL);
+    }
+    spill->batches[spill->nbatches].path = path;
+    spill->batches[spill->nbatches].nboards = n;
+    spill->nbatches++;
+    spill->nboards += n;
+    ctx->stats.spilled += n;
+    return true;
+}
+
+/* Add the boards of batch b to the end of list.  Returns false, and counts
+ * the batch as lost, if the file could not be read */
+static bool spill_read(struct sudoku_ctx *ctx, struct spill_batch *b,
+           struct boardlist *list) {
+    struct board **boards = malloc(sizeof(struct board *) * b->nboards);
+    assert(boards != NULL);
+    for (int i = 0; i < b->nboards; i++) {
+        boards[i] = alloc_board(ctx);
+    }
+    int fd = open(b->path, O_RDONLY);
+    bool ok = false;
+    if (fd >= 0) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        ok = spill_io(fd, boards, b->nboards, false);
+        close(fd);
+    }
+    for (int i = 0; i < b->nboards; i++) {
+        if (ok) {
+            add_board(list, boards[i]);
+        } else {
+            free_board_ctx(ctx, boards[i]);
+        }
+    }
+    free(boards);
+    if (!ok) {
+        fprintf(stderr, "Could not read spill file %s, %d boards lost\n",
+                b->path, b->nboards);
+        ctx->stats.spill_lost += b->nboards;
+    }
+    return ok;
+}
+
+/* Spill entries [from, from + n) of list as a batch, leaving them NULL.
+ * Returns false, leaving them as they were, if the batch wasn't written */
+static bool spill_entries(struct sudoku_ctx *ctx, struct boardlist *list,
+           int from, int n, bool lifo) {
+    struct board **boards = malloc(sizeof(struct board *) * n);
+    struct frontier_node **nodes = malloc(sizeof(struct frontier_node *) * n);
+    assert(boards != NULL && nodes != NULL);
+    for (int i = 0; i < n; i++) {
+        boards[i] = take_entry(ctx, list, from + i, &nodes[i]);
+    }
+    bool ok = spill_write(ctx, get_spill(list, lifo), boards, n);
+    for (int i = 0; i < n; i++) {
+        if (nodes[i] == NULL) {
+            if (!ok) {
+                list->arr[from + i] = boards[i];
+            }
+        } else if (ok) {
+            release_node(nodes[i]);
+        } else {
+            // Put the compact entry back rather than the board built from it
+            free_board_ctx(ctx, boards[i]);
+            list->nodes[from + i] = nodes[i];
+        }
+    }
+    free(boards);
+    free(nodes);
+    return ok;
+}
+
+/* Move entries from the end of list to the tail of its spill, writing the
+ * tail out whenever it fills a batch.  Once spilling has failed the tail
+ * just grows */
+static void spill_children(struct sudoku_ctx *ctx, struct boardlist *list,
+           int from) {
+    struct frontier_spill *spill = list->spill;
+    int batch = spill_batch_size(ctx);
+    for (int i = from; i < list->len; i++) {
+        if (spill->tail_len == spill->tail_size) {
+            spill->tail_size = spill->tail_size == 0 ? batch :
+                                                       2 * spill->tail_size;
+            spill->tail = realloc(spill->tail,
+                                  sizeof(struct board *) * spill->tail_size);
+            assert(spill->tail != NULL);
+        }
+        struct frontier_node *node;
+        spill->tail[spill->tail_len++] = take_entry(ctx, list, i, &node);
+        if (node != NULL) {
+            release_node(node);
+        }
+        if (spill->tail_len == batch && !ctx->spill_failed &&
+                spill_write(ctx, spill, spill->tail, batch)) {
+            spill->tail_len = 0;
+        }
+    }
+    list->len = from;
+}
+
+/* Read the next batch that can be read, or the tail once no batches are
+ * left, into the empty list.  Returns false if no boards were read back */
+static bool spill_refill(struct sudoku_ctx *ctx, struct boardlist *list) {
+    struct frontier_spill *spill = list->spill;
+    assert(list->len == 0);
+    if (spill == NULL) {
+        return false;
+    }
+    while (list->len == 0 && spill->first < spill->nbatches) {
+        struct spill_batch *b = spill->lifo ?
+                                &spill->batches[--spill->nbatches] :
+                                &spill->batches[spill->first++];
+        spill_read(ctx, b, list);
+        unlink(b->path);
+        free(b->path);
+        spill->nboards -= b->nboards;
+    }
+    if (list->len == 0) {
+        for (int i = 0; i < spill->tail_len; i++) {
+            add_board(list, spill->tail[i]);
+        }
+        spill->tail_len = 0;
+    }
+    if (spill->first == spill->nbatches && spill->tail_len == 0) {
+        spill_free(ctx, spill);
+        list->spill = NULL;
+    }
+    return list->len > 0;
+}
+
+/* Delete the files and tail of spill.  ctx may be NULL */
+static void spill_free(struct sudoku_ctx *ctx, struct frontier_spill *spill) {
+    for (int i = spill->first; i < spill->nbatches; i++) {
+        unlink(spill->batches[i].path);
+        free(spill->batches[i].path);
+    }
+    for (int i = 0; i < spill->tail_len; i++) {
+        if (ctx != NULL) {
+            free_board_ctx(ctx, spill->tail[i]);
+        } else {
+            free_board(spill->tail[i]);
+        }
+    }
+    free(spill->batches);
+    free(spill->tail);
+    free(spill);
+}
+
+/*
+ * Breadth-first search with a spilled frontier, which is treated as one
+ * queue rather than level by level.  Boards are expanded from the front
+ * of boards, and their children added at the back, or to the tail of the
+ * spill while there are older boards spilled.  Stops once the frontier
+ * reaches quota.  Returns true if solved, in which case boards holds just
+ * the solution.
+ */
+static bool spill_bfs(struct sudoku_ctx *ctx, struct boardlist *boards,
+           long quota) {
+    bool compact = boards->nodes != NULL;
+    int batch = spill_batch_size(ctx);
+    int head = 0;
+    for (;;) {
+        long total = boards->len - head + boardlist_spilled(boards);
+        if (total == 0 || (quota >= 0 && total >= quota)) {
+            break;
+        }
+        if (head == boards->len) {
+            boards->len = 0;
+            head = 0;
+            spill_refill(ctx, boards);
+            continue;
+        }
+        struct frontier_node *node;
+        struct board *curr = take_entry(ctx, boards, head++, &node);
+        int oldlen = boards->len;
+        if (compact) {
+            compact_step(ctx, curr, node, boards);
+        } else {
+            solve_step(ctx, curr, boards);
+        }
+
+        if (boards->len - oldlen == 1 &&
+                boards->arr[boards->len - 1] != NULL &&
+                boards->arr[boards->len - 1]->nfilled == BOARD_CELLS) {
+            struct board *solution = boards->arr[--boards->len];
+            for (int i = head; i < boards->len; i++) {
+                free_entry(ctx, boards, i);
+            }
+            if (boards->spill != NULL) {
+                spill_free(ctx, boards->spill);
+                boards->spill = NULL;
+            }
+            boards->len = 0;
+            add_board(boards, solution);
+            return true;
+        }
+        if (boardlist_spilled(boards) > 0) {
+            spill_children(ctx, boards, oldlen);
+        } else if (boards->len - head > ctx->spill_max &&
+                   !ctx->spill_failed) {
+            // The newest boards will be expanded last
+            bump_boards(boards, head);
+            head = 0;
+            if (spill_entries(ctx, boards, boards->len - batch, batch,
+                              false)) {
+                boards->len -= batch;
+            }
+        } else if (head > ctx->spill_max) {
+            bump_boards(boards, head);
+            head = 0;
+        }
+    }
+    bump_boards(boards, head);
+    return false;
+}
+
+/******************************************************************************
+ * Search trace log
+ *
+ * An event lasts until the next one on the same context starts, or until
+ * the solver returns.  The clock is only read every TRACE_CLOCK_EVENTS
+ * events, and at the end, and the time in between is split evenly across
+ * the events, so a short event next to a long one is shown as taking
+ * their average.  Contexts take node ids from the log in blocks, and
+ * events are moved to the buffers without going through the cache.  Full
+ * buffers are written to the file by a background thread, so solver
+ * threads only take the log's lock once per TRACE_BLOCK_EVENTS events.
+ ******************************************************************************/
+
+struct trace_log *trace_log_open(const char *path) {
+    FILE *out = fopen(path, "wb");
+    if (out == NULL) {
+        return NULL;
+    }
+    struct trace_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.block_width = BLOCK_WIDTH;
+    header.event_size = sizeof(struct trace_event);
+    if (fwrite(&header, sizeof(header), 1, out) != 1) {
+        fclose(out);
+        return NULL;
+    }
+
+    struct trace_log *log = malloc(sizeof(struct trace_log));
+    assert(log != NULL);
+    memset(log, 0, sizeof(struct trace_log));
+    log->out = out;
+    void *bufs;
+    if (posix_memalign(&bufs, CACHE_LINE_SIZE,
+                       sizeof(struct trace_buf) * TRACE_BLOCKS) != 0) {
+        fclose(out);
+        free(log);
+        return NULL;
+    }
+    log->bufs = bufs;
+    // trace_copy_event moves events 16 bytes at a time
+    assert(sizeof(struct trace_event) % 16 == 0);
+    for (int i = 0; i < TRACE_BLOCKS; i++) {
+        log->free_stack[i] = TRACE_BLOCKS - 1 - i;
+    }
+    log->nfree = TRACE_BLOCKS;
+    pthread_mutex_init(&log->lock, NULL);
+    pthread_cond_init(&log->filled, NULL);
+    pthread_cond_init(&log->freed, NULL);
+    log->start_ns = clock_ns();
+    pthread_create(&log->writer, NULL, trace_writer_run, log);
+    return log;
+}
+
+bool trace_log_close(struct trace_log *log) {
+    assert(log->attached == 0);
+    pthread_mutex_lock(&log->lock);
+    log->closing = true;
+    pthread_cond_signal(&log->filled);
+    pthread_mutex_unlock(&log->lock);
+    pthread_join(log->writer, NULL);
+
+    bool ok = !log->error;
+    if (fclose(log->out) != 0) {
+        ok = false;
+    }
+    pthread_mutex_destroy(&log->lock);
+    pthread_cond_destroy(&log->filled);
+    pthread_cond_destroy(&log->freed);
+    free(log->bufs);
+    free(log);
+    return ok;
+}
+
+/* Take an empty buffer, waiting for the writer if there is none */
+static int trace_take_buf(struct trace_log *log) {
+    pthread_mutex_lock(&log->lock);
+    while (log->nfree == 0) {
+        pthread_cond_signal(&log->filled);
+        pthread_cond_wait(&log->freed, &log->lock);
+    }
+    int buf = log->free_stack[--log->nfree];
+    pthread_mutex_unlock(&log->lock);
+    log->bufs[buf].n = 0;
+    return buf;
+}
+
+/* Queue buf to be written, or return it to the free stack if empty.  The
+ * writer is woken once TRACE_WRITE_BLOCKS are queued, or for the last
+ * buffer of a context, which won't be full: on one core, waking it for
+ * every buffer costs more than writing the events. */
+static void trace_submit(struct trace_log *log, int buf, uint32_t thread) {
+#ifdef __SSE2__
+    // Make the events written by trace_copy_event visible to the writer
+    _mm_sfence();
+#endif
+    pthread_mutex_lock(&log->lock);
+    if (log->bufs[buf].n == 0) {
+        log->free_stack[log->nfree++] = buf;
+        pthread_cond_signal(&log->freed);
+    } else {
+        int slot = (log->full_head + log->nfull) % TRACE_BLOCKS;
+        log->full_ring[slot] = buf;
+        log->full_thread[slot] = thread;
+        log->nfull++;
+        if (log->nfull >= TRACE_WRITE_BLOCKS ||
+                log->bufs[buf].n < TRACE_BLOCK_EVENTS) {
+            pthread_cond_signal(&log->filled);
+        }
+    }
+    pthread_mutex_unlock(&log->lock);
+}
+
+/* Record the expansion of board b.  Its times are set by trace_end_events */
+static void trace_expansion(struct sudoku_ctx *ctx, struct board *b,
+           enum expansion e, int propagated, int nchoices) {
+    if (ctx->trace_id == ctx->trace_id_end) {
+        ctx->trace_id = __atomic_fetch_add(&ctx->trace->next_id,
+                           TRACE_BLOCK_EVENTS, __ATOMIC_RELAXED);
+        ctx->trace_id_end = ctx->trace_id + TRACE_BLOCK_EVENTS;
+    }
+    ctx->trace_id++;
+
+    struct trace_event *ev = &ctx->trace_untimed_events[ctx->trace_untimed];
+    ev->id = ctx->trace_id;
+    ev->parent = b->trace_parent;
+    ev->branch_pos = b->branch_pos;
+    ev->branch_val = b->branch_val;
+    ev->depth = b->depth;
+    ev->propagated = propagated;
+    ev->nchoices = nchoices;
+    // Without a switch, as branches and dead ends come in no set order
+    static const uint8_t outcomes[] = {
+        [EXPAND_SOLVED] = TRACE_SOLVED,
+        [EXPAND_BRANCH] = TRACE_BRANCH,
+    };
+    ev->outcome = e == EXPAND_DEADEND ? ctx->trace_dead : outcomes[e];
+    ev->reserved = 0;
+    ctx->trace_untimed++;
+}
+
+/* Spread the time from the last clock reading to now evenly across the
+ * events recorded since, and move them to the context's buffer, passing
+ * it to the writer when full */
+static void trace_end_events(struct sudoku_ctx *ctx, uint64_t now) {
+    int n = ctx->trace_untimed;
+    uint64_t start = ctx->trace_clock_ns;
+    ctx->trace_untimed = 0;
+    ctx->trace_clock_ns = now;
+    if (n == 0) {
+        return;
+    }
+    struct trace_log *log = ctx->trace;
+    uint64_t duration = (now - start) / n;
+    if (duration > UINT32_MAX) {
+        duration = UINT32_MAX;
+    }
+    for (int i = 0; i < n; i++) {
+        struct trace_event *ev = &ctx->trace_untimed_events[i];
+        ev->start_ns = start - log->start_ns + i * duration;
+        ev->duration_ns = duration;
+        struct trace_buf *buf = &log->bufs[ctx->trace_buf];
+        trace_copy_event(&buf->events[buf->n++], ev);
+        if (buf->n == TRACE_BLOCK_EVENTS) {
+            trace_submit(log, ctx->trace_buf, ctx->trace_thread);
+            ctx->trace_buf = trace_take_buf(log);
+        }
+    }
+}
+
+/* Copy an event to a buffer.  Where possible this bypasses the cache, as
+ * the buffer is only read again by the writer, and on small boards the
+ * events would otherwise push the solver's boards out of it. */
+static inline void trace_copy_event(struct trace_event *dst,
+           const struct trace_event *src) {
+#ifdef __SSE2__
+    __m128i *d = (__m128i *)dst;
+    const __m128i *s = (const __m128i *)src;
+    for (size_t i = 0; i < sizeof(struct trace_event) / 16; i++) {
+        _mm_stream_si128(d + i, _mm_loadu_si128(s + i));
+    }
+#else
+    *dst = *src;
+#endif
+}
+
+/* Write queued buffers until the log is closed and the queue is empty */
+static void *trace_writer_run(void *arg) {
+    struct trace_log *log = arg;
+    pthread_mutex_lock(&log->lock);
+    while (true) {
+        while (log->nfull == 0 && !log->closing) {
+            pthread_cond_wait(&log->filled, &log->lock);
+        }
+        if (log->nfull == 0) {
+            break;
+        }
+        int buf = log->full_ring[log->full_head];
+        struct trace_block block;
+        block.thread = log->full_thread[log->full_head];
+        block.nevents = log->bufs[buf].n;
+        log->full_head = (log->full_head + 1) % TRACE_BLOCKS;
+        log->nfull--;
+        pthread_mutex_unlock(&log->lock);
+
+        if (fwrite(&block, sizeof(block), 1, log->out) != 1 ||
+                fwrite(log->bufs[buf].events, sizeof(struct trace_event),
+                       block.nevents, log->out) != block.nevents) {
+            log->error = true;
+        }
+
+        pthread_mutex_lock(&log->lock);
+        log->free_stack[log->nfree++] = buf;
+        pthread_cond_signal(&log->freed);
+    }
+    pthread_mutex_unlock(&log->lock);
+    return NULL;
+}
+
+/******************************************************************************
+ * Progress estimation
+ *
+ * Knuth's estimator: follow one random branch at each level below a
+ * board, as solve_step would expand it, and add up the products of the
+ * branching factors along the way.  On average this is the size of the
+ * subtree, so the frontier length times the mean over randomly chosen
+ * entries estimates the work left.  It counts the whole tree, where the
+ * search stops at the first solution, so it errs on the high side.
+ ******************************************************************************/
+
+double estimate_subtree(struct board *b, int nprobes) {
+    return estimate_subtree_ctx(&default_ctx, b, nprobes);
+}
+
+double estimate_subtree_ctx(struct sudoku_ctx *ctx, struct board *b,
+                            int nprobes) {
+    assert(nprobes > 0);
+    uint64_t rng = ctx->rng;
+    ctx->rng = ctx->progress_rng;
+    double sum = 0;
+    for (int i = 0; i < nprobes; i++) {
+        sum += probe_path(ctx, clone_board(ctx, b));
+    }
+    ctx->progress_rng = ctx->rng;
+    ctx->rng = rng;
+    return sum / nprobes;
+}
+
+/* Copy of entry i of list, as a full board */
+static struct board *copy_entry(struct sudoku_ctx *ctx,
+           struct boardlist *list, int i) {
+    if (list->arr[i] != NULL) {
+        return clone_board(ctx, list->arr[i]);
+    }
+    struct board *b = alloc_board(ctx);
+    materialize_node(list->nodes[i], b);
+    return b;
+}
+
+/* Estimate of the subtree size below b from one random path.  Frees b
+ * and leaves the solver statistics as they were */
+static double probe_path(struct sudoku_ctx *ctx, struct board *b) {
+    struct solver_stats stats = ctx->stats;
+    double estimate = 0, width = 1;
+    while (true) {
+        estimate += width;
+        struct branch br;
+        mask_t mask;
+        if (expand_untraced(ctx, b, &br, &mask) != EXPAND_BRANCH) {
+            break;
+        }
+        struct cell cells[BOARD_WIDTH];
+        int values[BOARD_WIDTH];
+        int n = branch_choices(ctx, b, &br, mask, cells, values);
+        int i = ctx_rand(ctx) % n;
+        set_cell(ctx, b, cells[i].row, cells[i].col, values[i]);
+        width *= n;
+    }
+    free_board_ctx(ctx, b);
+    ctx->stats = stats;
+    return estimate;
+}
+
+static void progress_start(struct sudoku_ctx *ctx) {
+    struct progress_state *p = &ctx->progress;
+    memset(p, 0, sizeof(struct progress_state));
+    p->start_ns = clock_ns();
+    p->last_report_ns = p->start_ns;
+    p->start_nodes = ctx->stats.nodes;
+    p->last.remaining = -1;
+}
+
+/* Probe random waiting boards while within the CPU budget, and report
+ * if the interval is up */
+static void progress_tick(struct sudoku_ctx *ctx, struct boardlist *boards) {
+    struct progress_state *p = &ctx->progress;
+    uint64_t now = clock_ns();
+    double budget = ctx->progress_cpu * (now - p->start_ns);
+    if (boards->len > 0 && p->probe_ns < budget) {
+        uint64_t rng = ctx->rng;
+        ctx->rng = ctx->progress_rng;
+        while (p->probe_ns < budget) {
+            int i = ctx_rand(ctx) % boards->len;
+            p->sum += probe_path(ctx, copy_entry(ctx, boards, i));
+            p->nsamples++;
+            uint64_t t = clock_ns();
+            p->probe_ns += t - now;
+            now = t;
+        }
+        ctx->progress_rng = ctx->rng;
+        ctx->rng = rng;
+    }
+    if (now - p->last_report_ns < ctx->progress_interval * 1e9) {
+        return;
+    }
+    p->last_report_ns = now;
+
+    struct solver_progress *r = &p->last;
+    r->elapsed = (now - p->start_ns) * 1e-9;
+    r->nodes = ctx->stats.nodes - p->start_nodes;
+    r->nodes_per_sec = r->nodes / r->elapsed;
+    r->frontier = boards->len;
+    if (p->nsamples > 0) {
+        // Estimates from before this interval are for a different frontier
+        r->remaining = boards->len * (p->sum / p->nsamples);
+        r->explored = r->nodes / (r->nodes + r->remaining);
+        r->samples = p->nsamples;
+        p->sum = 0;
+        p->nsamples = 0;
+    }
+    if (r->remaining < 0) {
+        fprintf(stderr, "Progress: %.1fs %ld nodes %.0f nodes/s frontier %d\n",
+                r->elapsed, r->nodes, r->nodes_per_sec, r->frontier);
+    } else {
+        fprintf(stderr, "Progress: %.1fs %ld nodes %.0f nodes/s frontier %d "
+                "remaining %.3g explored %.2f%% eta %.0fs (%ld samples)\n",
+                r->elapsed, r->nodes, r->nodes_per_sec, r->frontier,
+                r->remaining, 100 * r->explored,
+                r->remaining / r->nodes_per_sec, r->samples);
+    }
+}
+
+/******************************************************************************
+ * Bitboard engine for 9x9 and 16x16 boards
+ *
+ * Value-major layout: for each value, a bitset over all cells with a bit
+ * set where the value can still go.  Placing a value clears a cell from
+ * every bitset and the cell's peers from one, and hidden singles are units
+ * where a value's bitset has one bit left.
+ ******************************************************************************/
+#ifdef BITBOARD_ENGINE
+
+static void bitboard_init_tables(void) {
+    memset(bb_units, 0, sizeof(bb_units));
+    for (int unit = 0; unit < N_UNITS; unit++) {
+        for (int i = 0; i < BOARD_WIDTH; i++) {
+            struct cell c = unit_cell(unit, i);
+            bb_set(&bb_units[unit], c.row * BOARD_WIDTH + c.col);
+        }
+    }
+    for (int row = 0; row < BOARD_WIDTH; row++) {
+        for (int col = 0; col < BOARD_WIDTH; col++) {
+            int pos = row * BOARD_WIDTH + col;
+            bitboard_t peers = bb_units[row];
+            bb_or(&peers, bb_units[BOARD_WIDTH + col]);
+            bb_or(&peers, bb_units[2 * BOARD_WIDTH + get_block(row, col)]);
+            bb_peers[pos] = peers;
+        }
+    }
+    memset(&bb_all, 0, sizeof(bb_all));
+    for (int pos = 0; pos < BOARD_CELLS; pos++) {
+        bb_set(&bb_all, pos);
+    }
+}
+
+static inline bool bb_test(bitboard_t b, int pos) {
+    return (b.w[pos / 64] >> (pos % 64)) & 1;
+}
+
+static inline void bb_set(bitboard_t *b, int pos) {
+    b->w[pos / 64] |= ((uint64_t)1) << (pos % 64);
+}
+
+static inline void bb_clear(bitboard_t *b, int pos) {
+    b->w[pos / 64] &= ~(((uint64_t)1) << (pos % 64));
+}
+
+static inline void bb_or(bitboard_t *a, bitboard_t b) {
+    for (int i = 0; i < BB_WORDS; i++) {
+        a->w[i] |= b.w[i];
+    }
+}
+
+static inline void bb_andnot(bitboard_t *a, bitboard_t b) {
+    for (int i = 0; i < BB_WORDS; i++) {
+        a->w[i] &= ~b.w[i];
+    }
+}
+
+static inline bitboard_t bb_and(bitboard_t a, bitboard_t b) {
+    for (int i = 0; i < BB_WORDS; i++) {
+        a.w[i] &= b.w[i];
+    }
+    return a;
+}
+
+static inline bool bb_empty(bitboard_t b) {
+    uint64_t any = 0;
+    for (int i = 0; i < BB_WORDS; i++) {
+        any |= b.w[i];
+    }
+    return any == 0;
+}
+
+static inline int bb_popcount(bitboard_t b) {
+    int n = 0;
+    for (int i = 0; i < BB_WORDS; i++) {
+        n += __builtin_popcountll(b.w[i]);
+    }
+    return n;
+}
+
+// Lowest set position; b must not be empty
+static inline int bb_first(bitboard_t b) {
+    for (int i = 0; i < BB_WORDS - 1; i++) {
+        if (b.w[i] != 0) {
+            return 64 * i + __builtin_ctzll(b.w[i]);
+        }
+    }
+    return 64 * (BB_WORDS - 1) + __builtin_ctzll(b.w[BB_WORDS - 1]);
+}
+
+static inline void bb_place(struct bb_board *b, int pos, int val) {
+    b->cells[pos] = val;
+    b->nfilled++;
+    bb_set(&b->placed[val - 1], pos);
+    for (int v = 0; v < N_VALUES; v++) {
+        bb_clear(&b->cand[v], pos);
+    }
+    bb_andnot(&b->cand[val - 1], bb_peers[pos]);
+}
+
+/* Set up b from cells.  Returns false if the givens conflict */
+static bool bb_load(struct bb_board *b, cell_t *cells) {
+    for (int v = 0; v < N_VALUES; v++) {
+        b->cand[v] = bb_all;
+    }
+    memset(b->placed, 0, sizeof(b->placed));
+    memset(b->cells, 0, sizeof(b->cells));
+    b->nfilled = 0;
+    for (int pos = 0; pos < BOARD_CELLS; pos++) {
+        int val = cells[pos];
+        if (val != 0) {
+            if (!bb_test(b->cand[val - 1], pos)) {
+                return false;
+            }
+            bb_place(b, pos, val);
+        }
+    }
+    return true;
+}
+
+/*
+ * Count candidates per empty cell, bit-sliced: ones, twos and threes have
+ * a bit set for cells with at least one, two and three candidates.
+ */
+static inline void bb_count(struct bb_board *b, bitboard_t *ones,
+                            bitboard_t *twos, bitboard_t *threes) {
+    bitboard_t o, t, th;
+    memset(&o, 0, sizeof(o));
+    memset(&t, 0, sizeof(t));
+    memset(&th, 0, sizeof(th));
+    for (int v = 0; v < N_VALUES; v++) {
+        for (int i = 0; i < BB_WORDS; i++) {
+            uint64_t c = b->cand[v].w[i];
+            th.w[i] |= t.w[i] & c;
+            t.w[i] |= o.w[i] & c;
+            o.w[i] |= c;
+        }
+    }
+    *ones = o;
+    *twos = t;
+    *threes = th;
+}
+
+/*
+ * Fill in naked and hidden singles until none are left.  Returns false if
+ * a cell has no candidates or a unit has nowhere left for a value.
+ */
+static bool bb_propagate(struct bb_board *b) {
+    bool progress = true;
+    while (progress && b->nfilled < BOARD_CELLS) {
+        progress = false;
+
+        bitboard_t ones, twos, threes, empty = bb_all;
+        bb_count(b, &ones, &twos, &threes);
+        for (int v = 0; v < N_VALUES; v++) {
+            bb_andnot(&empty, b->placed[v]);
+        }
+        bitboard_t stuck = empty;
+        bb_andnot(&stuck, ones);
+        if (!bb_empty(stuck)) {
+            return false;
+        }
+
+        // Naked singles: cells with one candidate
+        bitboard_t singles = ones;
+        bb_andnot(&singles, twos);
+        while (!bb_empty(singles)) {
+            int pos = bb_first(singles);
+            bb_clear(&singles, pos);
+            int v = 0;
+            // An earlier single may have taken the only candidate
+            while (v < N_VALUES && !bb_test(b->cand[v], pos)) {
+                v++;
+            }
+            if (v == N_VALUES) {
+                return false;
+            }
+            bb_place(b, pos, v + 1);
+            progress = true;
+        }
+
+        // Hidden singles: values with one place left in a unit
+        for (int v = 0; v < N_VALUES; v++) {
+            for (int unit = 0; unit < N_UNITS; unit++) {
+                if (!bb_empty(bb_and(b->placed[v], bb_units[unit]))) {
+                    continue;
+                }
+                bitboard_t where = bb_and(b->cand[v], bb_units[unit]);
+                int n = bb_popcount(where);
+                if (n == 0) {
+                    return false;
+                } else if (n == 1) {
+                    bb_place(b, bb_first(where), v + 1);
+                    progress = true;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+/* Empty cell with the fewest candidates, preferring any with two */
+static int bb_branch_cell(struct bb_board *b) {
+    bitboard_t ones, twos, threes;
+    bb_count(b, &ones, &twos, &threes);
+    bitboard_t pairs = twos;
+    bb_andnot(&pairs, threes);
+    if (!bb_empty(pairs)) {
+        return bb_first(pairs);
+    }
+    int best = -1, bestcount = N_VALUES + 1;
+    while (!bb_empty(ones)) {
+        int pos = bb_first(ones);
+        bb_clear(&ones, pos);
+        int count = 0;
+        for (int v = 0; v < N_VALUES; v++) {
+            count += bb_test(b->cand[v], pos);
+        }
+        if (count < bestcount) {
+            best = pos;
+            bestcount = count;
+        }
+    }
+    return best;
+}
+
+/*
+ * Solve start depth-first with the bitboard engine, taking ownership of
+ * start.  Returns a list with the solution, or NULL if there is none.
+ */
+static struct boardlist *bitboard_solver(struct sudoku_ctx *ctx,
+                                         struct board *start) {
+    pthread_once(&bb_tables_once, bitboard_init_tables);
+    // Each level leaves at most N_VALUES - 1 boards behind
+    int maxlen = BOARD_CELLS * (N_VALUES - 1) + 1;
+    if (ctx->bb_stack == NULL) {
+        ctx->bb_stack = malloc(sizeof(struct bb_board) * maxlen);
+        assert(ctx->bb_stack != NULL);
+    }
+    struct bb_board *stack = ctx->bb_stack;
+    int len = 0;
+    bool solved = false;
+    if (bb_load(&stack[len], start->board)) {
+        len++;
+    }
+
+    while (len > 0) {
+        struct bb_board *b = &stack[--len];
+        ctx->stats.nodes++;
+        if (!bb_propagate(b)) {
+            ctx->stats.deadends++;
+            continue;
+        }
+        if (b->nfilled == BOARD_CELLS) {
+            solved = true;
+            break;
+        }
+        int pos = bb_branch_cell(b);
+        assert(pos >= 0);
+        int values[N_VALUES], n = 0;
+        for (int v = 0; v < N_VALUES; v++) {
+            if (bb_test(b->cand[v], pos)) {
+                values[n++] = v + 1;
+            }
+        }
+        if (ctx->value_order == VALUE_ORDER_LOWEST) {
+            for (int i = 0; i < n / 2; i++) {
+                int tmp = values[i];
+                values[i] = values[n - 1 - i];
+                values[n - 1 - i] = tmp;
+            }
+        }
+        // b is the top of the stack: the last branch is placed in it
+        // directly, the others are copies pushed below it
+        struct bb_board parent = *b;
+        for (int i = 0; i < n; i++) {
+            assert(len < maxlen);
+            stack[len] = parent;
+            bb_place(&stack[len], pos, values[i]);
+            len++;
+        }
+        ctx->stats.branches += n;
+    }
+
+    if (!solved) {
+        free_board_ctx(ctx, start);
+        return NULL;
+    }
+    free_board_ctx(ctx, start);
+    struct boardlist *boards = malloc(sizeof(struct boardlist));
+    assert(boards != NULL);
+    init_boardlist(boards, 1);
+    add_board(boards, create_board_ctx(ctx, stack[len].cells));
+    return boards;
+}
+
+#endif // BITBOARD_ENGINE
+
+/******************************************************************************
+ * SIMD batch engine for 9x9 boards
+ *
+ * Solves SIMD_LANES puzzles at once, one per lane of 16-bit vectors.  The
+ * layout follows the generic engine: row, col and block masks of used
+ * values, and each cell as the bit of its value.  Lanes sweep the board in
+ * lock-step filling in naked singles; lanes that are stuck, dead or solved
+ * are then handled one at a time, branching onto a per-lane DFS stack or
+ * moving on to the next puzzle.
+ ******************************************************************************/
+#ifdef SIMD_ENGINE
+
+static void simd_init_tables(void) {
+    for (int pos = 0; pos < BOARD_CELLS; pos++) {
+        int row = pos / BOARD_WIDTH, col = pos % BOARD_WIDTH;
+        simd_row[pos] = row;
+        simd_col[pos] = col;
+        simd_block[pos] = get_block(row, col);
+    }
+}
+
+static inline vmask_t vmask_popcount(vmask_t x) {
+    x = x - ((x >> 1) & 0x5555);
+    x = (x & 0x3333) + ((x >> 2) & 0x3333);
+    x = (x + (x >> 4)) & 0x0F0F;
+    return (x + (x >> 8)) & 0x1F;
+}
+
+static inline bool vmask_any(vmask_t x) {
+    uint16_t any = 0;
+    for (int l = 0; l < SIMD_LANES; l++) {
+        any |= x[l];
+    }
+    return any != 0;
+}
+
+static inline void simd_lane_place(struct simd_lanes *s, int l, int pos,
+                                   uint16_t bit) {
+    s->cells[pos][l] = bit;
+    s->row[simd_row[pos]][l] |= bit;
+    s->col[simd_col[pos]][l] |= bit;
+    s->block[simd_block[pos]][l] |= bit;
+}
+
+static inline void simd_lane_save(struct simd_lanes *s, int l,
+                                  struct simd_lane_state *st) {
+    for (int pos = 0; pos < BOARD_CELLS; pos++) {
+        st->cells[pos] = s->cells[pos][l];
+    }
+    for (int i = 0; i < BOARD_WIDTH; i++) {
+        st->row[i] = s->row[i][l];
+        st->col[i] = s->col[i][l];
+        st->block[i] = s->block[i][l];
+    }
+}
+
+static inline void simd_lane_restore(struct simd_lanes *s, int l,
+                                     struct simd_lane_state *st) {
+    for (int pos = 0; pos < BOARD_CELLS; pos++) {
+        s->cells[pos][l] = st->cells[pos];
+    }
+    for (int i = 0; i < BOARD_WIDTH; i++) {
+        s->row[i][l] = st->row[i];
+        s->col[i][l] = st->col[i];
+        s->block[i][l] = st->block[i];
+    }
+}
+
+/* Load puzzle cells into lane l.  Returns false if the givens conflict */
+static bool simd_lane_load(struct simd_lanes *s, int l, cell_t *cells) {
+    for (int i = 0; i < BOARD_WIDTH; i++) {
+        s->row[i][l] = s->col[i][l] = s->block[i][l] = 0;
+    }
+    for (int pos = 0; pos < BOARD_CELLS; pos++) {
+        s->cells[pos][l] = 0;
+    }
+    for (int pos = 0; pos < BOARD_CELLS; pos++) {
+        if (cells[pos] != 0) {
+            uint16_t bit = 1 << (cells[pos] - 1);
+            uint16_t used = s->row[simd_row[pos]][l] |
+                            s->col[simd_col[pos]][l] |
+                            s->block[simd_block[pos]][l];
+            if (used & bit) {
+                return false;
+            }
+            simd_lane_place(s, l, pos, bit);
+        }
+    }
+    return true;
+}
+
+/*
+ * One pass over the board in every active lane, filling in naked singles.
+ * Sets dead for lanes with an empty cell that has no candidates, and
+ * best_cell to the empty cell with the fewest (two or more) candidates,
+ * or 0xFFFF if there is none.  Returns a mask of lanes that changed.
+ */
+static vmask_t simd_sweep(struct simd_lanes *s, vmask_t active,
+                          vmask_t *dead, vmask_t *best_cell) {
+    const vmask_t all = (vmask_t){0} + ((1 << N_VALUES) - 1);
+    vmask_t changed = {0};
+    vmask_t best_count = (vmask_t){0} + (N_VALUES + 1);
+    *best_cell = (vmask_t){0} + 0xFFFF;
+    for (int pos = 0; pos < BOARD_CELLS; pos++) {
+        vmask_t *row = &s->row[simd_row[pos]];
+        vmask_t *col = &s->col[simd_col[pos]];
+        vmask_t *block = &s->block[simd_block[pos]];
+        vmask_t empty = (vmask_t)(s->cells[pos] == 0) & active;
+        vmask_t cand = ~(*row | *col | *block) & all & empty;
+        *dead |= empty & (vmask_t)(cand == 0);
+        vmask_t single = cand & (vmask_t)((cand & (cand - 1)) == 0);
+        s->cells[pos] |= single;
+        *row |= single;
+        *col |= single;
+        *block |= single;
+        changed |= single;
+
+        vmask_t count = vmask_popcount(cand);
+        vmask_t better = (vmask_t)(count >= 2) & (vmask_t)(count < best_count);
+        best_count = (best_count & ~better) | (count & better);
+        *best_cell = (*best_cell & ~better) | (((vmask_t){0} + (uint16_t)pos) & better);
+    }
+    return changed;
+}
+
+int sudoku_solve_batch_ctx(struct sudoku_ctx *ctx, cell_t *puzzles, int n,
+                           cell_t *solutions, bool *solved,
+                           struct solver_stats *stats) {
+    pthread_once(&simd_tables_once, simd_init_tables);
+    // On the stack rather than from malloc, which may not align vectors
+    // wide enough for AVX
+    struct simd_lanes lanes;
+    struct simd_lanes *s = &lanes;
+    memset(s, 0, sizeof(struct simd_lanes));
+
+    // Puzzle in each lane, -1 if idle, and each lane's saved branches
+    int puzzle[SIMD_LANES];
+    struct simd_lane_state *stack[SIMD_LANES];
+    int stack_len[SIMD_LANES], stack_size[SIMD_LANES];
+    struct solver_stats lane_stats[SIMD_LANES];
+    vmask_t active = {0};
+    int next = 0, nsolved = 0;
+
+    for (int l = 0; l < SIMD_LANES; l++) {
+        puzzle[l] = -1;
+        stack_size[l] = BOARD_CELLS;
+        stack[l] = malloc(sizeof(struct simd_lane_state) * stack_size[l]);
+        assert(stack[l] != NULL);
+    }
+
+    while (true) {
+        // Refill idle lanes from the queue
+        for (int l = 0; l < SIMD_LANES; l++) {
+            while (puzzle[l] < 0 && next < n) {
+                int p = next++;
+                solved[p] = false;
+                if (simd_lane_load(s, l, puzzles + (size_t)p * BOARD_CELLS)) {
+                    puzzle[l] = p;
+                    stack_len[l] = 0;
+                    memset(&lane_stats[l], 0, sizeof(struct solver_stats));
+                    lane_stats[l].nodes = 1;
+                    active[l] = 0xFFFF;
+                } else if (stats != NULL) {
+                    memset(&stats[p], 0, sizeof(struct solver_stats));
+                    stats[p].nodes = stats[p].deadends = 1;
+                }
+            }
+        }
+        if (!vmask_any(active)) {
+            break;
+        }
+
+        // Propagate in lock-step until no lane changes
+        vmask_t dead = {0}, best_cell;
+        while (vmask_any(simd_sweep(s, active, &dead, &best_cell))) {
+            active &= ~dead;
+        }
+
+        for (int l = 0; l < SIMD_LANES; l++) {
+            int p = puzzle[l];
+            if (p < 0) {
+                continue;
+            }
+            struct solver_stats *st = &lane_stats[l];
+            bool finished = false;
+            if (dead[l]) {
+                st->deadends++;
+                if (stack_len[l] > 0) {
+                    simd_lane_restore(s, l, &stack[l][--stack_len[l]]);
+                    st->nodes++;
+                    active[l] = 0xFFFF;
+                } else {
+                    finished = true;
+                }
+            } else if (best_cell[l] == 0xFFFF) {
+                cell_t *out = solutions + (size_t)p * BOARD_CELLS;
+                for (int pos = 0; pos < BOARD_CELLS; pos++) {
+                    out[pos] = __builtin_ctz(s->cells[pos][l]) + 1;
+                }
+                solved[p] = true;
+                nsolved++;
+                finished = true;
+            } else {
+                // Save all but the highest value, which this lane tries
+                int pos = best_cell[l];
+                uint16_t cand = ~(s->row[simd_row[pos]][l] |
+                                  s->col[simd_col[pos]][l] |
+                                  s->block[simd_block[pos]][l]) &
+                                ((1 << N_VALUES) - 1);
+                int nvalues = __builtin_popcount(cand);
+                if (stack_len[l] + nvalues > stack_size[l]) {
+                    stack_size[l] = 2 * (stack_len[l] + nvalues);
+                    stack[l] = realloc(stack[l], sizeof(struct simd_lane_state)
+                                                 * stack_size[l]);
+                    assert(stack[l] != NULL);
+                }
+                struct simd_lane_state base;
+                simd_lane_save(s, l, &base);
+                while (__builtin_popcount(cand) > 1) {
+                    uint16_t bit = cand & -cand;
+                    cand &= cand - 1;
+                    struct simd_lane_state *saved = &stack[l][stack_len[l]++];
+                    *saved = base;
+                    saved->cells[pos] = bit;
+                    saved->row[simd_row[pos]] |= bit;
+                    saved->col[simd_col[pos]] |= bit;
+                    saved->block[simd_block[pos]] |= bit;
+                }
+                simd_lane_place(s, l, pos, cand);
+                st->branches += nvalues;
+                st->nodes++;
+            }
+            if (finished) {
+                if (stats != NULL) {
+                    stats[p] = *st;
+                }
+                ctx->stats.nodes += st->nodes;
+                ctx->stats.branches += st->branches;
+                ctx->stats.deadends += st->deadends;
+                puzzle[l] = -1;
+                active[l] = 0;
+            }
+        }
+    }
+
+    for (int l = 0; l < SIMD_LANES; l++) {
+        free(stack[l]);
+    }
+    return nsolved;
+}
+
+#else
+
+int sudoku_solve_batch_ctx(struct sudoku_ctx *ctx, cell_t *puzzles, int n,
+                           cell_t *solutions, bool *solved,
+                           struct solver_stats *stats) {
+    // No lanes for this board size: solve one puzzle at a time
+    int nsolved = 0;
+    for (int p = 0; p < n; p++) {
+        struct solver_stats before = ctx->stats;
+        struct board *start = create_board_ctx(ctx,
+                                    puzzles + (size_t)p * BOARD_CELLS);
+        struct boardlist *l = sudoku_solver_ctx(ctx, start, false, -1);
+        solved[p] = l != NULL;
+        if (l != NULL) {
+            memcpy(solutions + (size_t)p * BOARD_CELLS,
+                   boardlist_get(l, 0)->board, CELLS_MEM);
+            free_boardlist_ctx(ctx, l, true);
+            nsolved++;
+        }
+        if (stats != NULL) {
+            stats[p].nodes = ctx->stats.nodes - before.nodes;
+            stats[p].branches = ctx->stats.branches - before.branches;
+            stats[p].deadends = ctx->stats.deadends - before.deadends;
+            stats[p].probes = ctx->stats.probes - before.probes;
+            stats[p].eliminated = ctx->stats.eliminated - before.eliminated;
+            stats[p].forced = ctx->stats.forced - before.forced;
+        }
+    }
+    return nsolved;
+}
+
+#endif // SIMD_ENGINE
+
+int sudoku_solve_batch(cell_t *puzzles, int n, cell_t *solutions, bool *solved,
+                       struct solver_stats *stats) {
+    assert(solver_init);
+    return sudoku_solve_batch_ctx(&default_ctx, puzzles, n, solutions, solved,
+                                  stats);
 }
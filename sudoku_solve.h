@@ -39,37 +39,320 @@ struct mask {
 typedef struct mask mask_t;
 typedef unsigned char cell_t;
 
-/* each row is stored contiguously
+#define CACHE_LINE_SIZE (64)
+
+#ifdef INTERLEAVED_MASKS
+/* The row and block masks of one band of rows, so that the row and block
+ * masks of a cell share a cache line when they fit in one */
+struct band_masks {
+    mask_t rows[BLOCK_WIDTH];
+    mask_t blocks[BLOCK_WIDTH];
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+#endif
+
+/* The cells and the counters and masks each start a cache line, so that
+ * both blocks are aligned however large the board.  Boards must be
+ * allocated with CACHE_LINE_SIZE alignment.
+ *
+ * each row is stored contiguously
  * board[row *BOARD SIZE + col]
  * char 0x0 -> nothing entered, char 0x1 -> number one in cell, etc */
 struct board {
     cell_t board[BOARD_CELLS];
-    int nfilled;
+    int nfilled __attribute__((aligned(CACHE_LINE_SIZE)));
+    // fill_singles has been run since a cell was last set, so it would
+    // find nothing more to fill in
+    bool propagated;
     // Track which are possible numbers for each cell
     // Masks have a bit set for each number that is already used
-    mask_t col_masks[BOARD_WIDTH];
+#ifdef INTERLEAVED_MASKS
+    struct band_masks bands[BLOCK_WIDTH];
+#else
     mask_t row_masks[BOARD_WIDTH];
     mask_t block_masks[BOARD_WIDTH];
-};
+#endif
+    mask_t col_masks[BOARD_WIDTH];
+    // Position in the search tree, as recorded by the trace log
+    uint64_t trace_parent;  // trace id of the board branched from, 0 if none
+    int depth;              // branches taken since the starting board
+    int branch_pos;         // cell filled in by that branch, -1 if none
+    int branch_val;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+struct frontier_node;
 
 struct boardlist {
     struct board **arr;
     int size;
     int len;
+    // Only for lists built with the compact frontier enabled: entry i is
+    // either a full board in arr[i] or a delta node in nodes[i], and is
+    // turned into a full board by boardlist_get or when it is expanded
+    struct frontier_node **nodes;
+    // Boards written to scratch files when the frontier outgrew the memory
+    // allowed by set_frontier_spill, or NULL.  They follow the len boards
+    // in arr, and are read back by boardlist_refill
+    struct frontier_spill *spill;
+};
+
+/* How solve_step picks what to branch on once propagation stalls */
+enum branch_heuristic {
+    BRANCH_MRV,         // cell with fewest candidates, first found wins ties
+    BRANCH_MRV_DEGREE,  // as above, ties broken by most empty peers
+    BRANCH_UNIT,        // MRV cell, or the positions of a value within a
+                        // row/col/block if that has fewer options
+};
+
+/* Order in which the values of a branch cell are tried by DFS */
+enum value_order {
+    VALUE_ORDER_DEFAULT,      // branches pushed ascending: highest tried first
+    VALUE_ORDER_LOWEST,       // lowest value tried first
+    VALUE_ORDER_LCV,          // least constraining value tried first
+};
+
+/* Search implementation used by sudoku_solver */
+enum solver_engine {
+    SOLVER_GENERIC,     // board of cells and per-unit masks, any size
+    SOLVER_BITBOARD,    // per-value bitsets over the cells, for 9x9 and
+                        // 16x16 boards and unlimited depth-first searches
+                        // only; ignores the branching and probing options
+};
+
+/* Counters accumulated by the solver since the last reset */
+struct solver_stats {
+    long nodes;       // boards expanded by solve_step
+    long branches;    // boards created by branching
+    long deadends;    // boards found to have no solution
+    long probes;      // values tentatively assigned by probing
+    long eliminated;  // probed values that led to a contradiction
+    long forced;      // cells filled in because probing left one value
+    long spilled;     // boards written to scratch files
+    long spill_lost;  // spilled boards that could not be read back
+};
+
+/* How triage suggests solving a puzzle */
+enum solve_route {
+    ROUTE_INLINE,       // depth-first search with the context's options
+    ROUTE_STRONG,       // depth-first search with unit branching
+    ROUTE_PORTFOLIO,    // several strategies at once, on separate threads
+};
+
+/* What propagation alone leaves of a puzzle */
+struct triage {
+    int empty;                      // empty cells, -1 on a contradiction
+    int candidates[N_VALUES + 1];   // empty cells by number of candidates
+    enum solve_route route;
+};
+
+/* Progress of a depth-first search, as last estimated by the reporter */
+struct solver_progress {
+    double elapsed;         // seconds since the solver was called
+    long nodes;             // boards expanded since then
+    double nodes_per_sec;
+    int frontier;           // boards waiting to be expanded
+    double remaining;       // estimated boards left to expand, -1 if unknown
+    double explored;        // estimated fraction of the search tree done
+    long samples;           // random probes the estimate is based on
 };
 
+/* Search trace log: one event per board expanded by the generic engine.
+ * The file is a struct trace_header followed by blocks, each a struct
+ * trace_block and then nevents events.  Blocks from different threads are
+ * interleaved; events within a block are in order. */
+#define TRACE_MAGIC "SDKTRACE"
+#define TRACE_VERSION 1
+
+enum trace_outcome {
+    TRACE_BRANCH,           // branched into nchoices boards
+    TRACE_SOLVED,
+    TRACE_DEAD_CELL,        // a cell had no candidates before propagating
+    TRACE_DEAD_PROPAGATE,   // propagation left a cell with no candidates
+    TRACE_DEAD_PROBE,       // every value of a probed cell failed
+    TRACE_DEAD_UNIT,        // a value had no position left in a unit
+};
+
+struct trace_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t block_width;
+    uint32_t event_size;    // sizeof(struct trace_event)
+    uint32_t reserved;
+};
+
+struct trace_block {
+    uint32_t thread;        // numbered from 0 in the order contexts attached
+    uint32_t nevents;
+};
+
+struct trace_event {
+    uint64_t id;            // from 1, unique across threads; each
+                            // thread takes them in blocks, so there
+                            // can be gaps
+    uint64_t parent;        // 0 for a starting board
+    uint64_t start_ns;      // since the log was opened
+    uint32_t duration_ns;   // until the next event of the thread starts,
+                            // or the solver returns; averaged over the
+                            // events between two clock reads
+    int32_t branch_pos;     // cell filled in by the parent's branch, as
+                            // row * width + col; -1 for a starting board
+    uint32_t branch_val;    // value it was given
+    uint32_t depth;
+    uint32_t propagated;    // cells filled in by propagation and probing
+    uint16_t nchoices;      // boards branched into
+    uint8_t outcome;        // enum trace_outcome
+    uint8_t reserved;
+};
+
+struct trace_log;
+
+/* Board wire format written by board_serialize: a struct
+ * board_wire_header, the cells packed cell_bits each into a little-endian
+ * bit stream padded to a multiple of 8 bytes, then the row, column and
+ * block masks if BOARD_WIRE_MASKS is set.  The header and masks are in
+ * host byte order.  There are no pointers, so a board can be sent to
+ * another process or stored. */
+#define BOARD_WIRE_MAGIC "SDKB"
+#define BOARD_WIRE_VERSION 1
+
+enum board_wire_flags {
+    BOARD_WIRE_MASKS = 1,       // masks included, so they needn't be
+                                // rebuilt from the cells
+    BOARD_WIRE_PROPAGATED = 2,  // set from the board, not by the caller
+};
+
+struct board_wire_header {
+    char magic[4];
+    uint8_t version;
+    uint8_t block_width;
+    uint8_t cell_bits;      // bits per packed cell
+    uint8_t flags;          // enum board_wire_flags
+    uint32_t nfilled;
+    int32_t depth;
+    int32_t branch_pos;
+    int32_t branch_val;
+    uint32_t reserved;
+};
+
+/* Solver state: precomputed tables, options, statistics, random number
+ * generator and a pool of boards for reuse.  Contexts are independent, so
+ * threads can solve concurrently if each uses its own context.  Functions
+ * without a _ctx suffix use a default context set up by init_solver. */
+struct sudoku_ctx;
+
 
 /******************************************************************************
  * Public functions
  ******************************************************************************/
 void init_solver(unsigned seed);
-// Parse text description with '.' meaning 0
+void set_branch_heuristic(enum branch_heuristic h);
+void set_value_order(enum value_order o);
+// Failed-literal probing before branching: up to depth rounds, each probing
+// every value of the width most constrained cells.  depth 0 disables probing
+#define MAX_PROBE_WIDTH 64
+void set_probing(int depth, int width);
+// Store boards the solver adds to a boardlist as a reference to their
+// parent plus the cells assigned since, instead of a full struct board
+void set_compact_frontier(bool enable);
+// Expand each breadth-first level on nthreads threads (default 1)
+void set_bfs_threads(int nthreads);
+// Falls back to the generic engine where the bitboard engine can't be used
+void set_solver_engine(enum solver_engine e);
+// Every interval seconds, estimate how much of a depth-first search is
+// left and print it to stderr.  The estimate samples random paths below
+// waiting boards, spending at most cpu_fraction of the solver's time on
+// them.  interval 0 disables reporting
+void set_progress(double interval, double cpu_fraction);
+// Triage routes puzzles with at most inline_empty cells left empty by
+// propagation to ROUTE_INLINE, with at most strong_empty to ROUTE_STRONG
+// and the rest to ROUTE_PORTFOLIO
+void set_triage_thresholds(int inline_empty, int strong_empty);
+// Keep at most max_bytes of boards waiting in a boardlist, counting the
+// pool of freed boards, in memory, and write the rest in batches to
+// scratch files in dir, to be read back in search order as the in-memory
+// part drains.  If a file can't be written the boards stay in memory; if
+// one can't be read back its boards are lost and counted in spill_lost.
+// max_bytes 0 keeps everything in memory (the default).  Parallel
+// breadth-first expansion doesn't spill
+void set_frontier_spill(const char *dir, size_t max_bytes);
+// Record every board expanded in log, or stop if log is NULL.  Contexts
+// can share a log; each must be detached, or freed, before it is closed
+void set_trace_log(struct trace_log *log);
+// Lookup by name, e.g. "mrv", "degree", "unit" / "default", "lowest", "lcv" /
+// "generic", "bitboard".
+// Return -1 if name is not recognised
+int branch_heuristic_from_name(const char *name);
+int value_order_from_name(const char *name);
+int solver_engine_from_name(const char *name);
+const char *branch_heuristic_name(enum branch_heuristic h);
+const char *value_order_name(enum value_order o);
+const char *solver_engine_name(enum solver_engine e);
+const char *solve_route_name(enum solve_route r);
+void get_solver_stats(struct solver_stats *out);
+void reset_solver_stats(void);
+void get_solver_progress(struct solver_progress *out);
+
+struct sudoku_ctx *sudoku_ctx_create(unsigned seed);
+void sudoku_ctx_free(struct sudoku_ctx *ctx);
+// Context used by the functions without a _ctx suffix
+struct sudoku_ctx *default_sudoku_ctx(void);
+void set_branch_heuristic_ctx(struct sudoku_ctx *ctx, enum branch_heuristic h);
+void set_value_order_ctx(struct sudoku_ctx *ctx, enum value_order o);
+void set_probing_ctx(struct sudoku_ctx *ctx, int depth, int width);
+void set_compact_frontier_ctx(struct sudoku_ctx *ctx, bool enable);
+void set_bfs_threads_ctx(struct sudoku_ctx *ctx, int nthreads);
+void set_solver_engine_ctx(struct sudoku_ctx *ctx, enum solver_engine e);
+void set_trace_log_ctx(struct sudoku_ctx *ctx, struct trace_log *log);
+void set_frontier_spill_ctx(struct sudoku_ctx *ctx, const char *dir,
+                            size_t max_bytes);
+void set_progress_ctx(struct sudoku_ctx *ctx, double interval,
+                      double cpu_fraction);
+void get_solver_progress_ctx(struct sudoku_ctx *ctx,
+                             struct solver_progress *out);
+void set_triage_thresholds_ctx(struct sudoku_ctx *ctx, int inline_empty,
+                               int strong_empty);
+// Propagate on a copy of b and pick a route.  b is left unchanged
+void triage_board(struct board *b, struct triage *out);
+void triage_board_ctx(struct sudoku_ctx *ctx, struct board *b,
+                      struct triage *out);
+// Estimated number of boards a complete search below b would expand, from
+// nprobes random paths.  b is left unchanged
+double estimate_subtree(struct board *b, int nprobes);
+double estimate_subtree_ctx(struct sudoku_ctx *ctx, struct board *b,
+                            int nprobes);
+void get_solver_stats_ctx(struct sudoku_ctx *ctx, struct solver_stats *out);
+void reset_solver_stats_ctx(struct sudoku_ctx *ctx);
+// Events are buffered and written by a background thread.  Returns NULL
+// if path can't be created
+struct trace_log *trace_log_open(const char *path);
+// Returns false if writing the log failed
+bool trace_log_close(struct trace_log *log);
+// Parse text description with '.' meaning 0, or NULL if src is not a
+// board.  Nothing is printed; callers report the failure
 cell_t *board_text_to_bin(char *src);
+// As board_text_to_bin, into the BOARD_CELLS cells at dst.  Returns false
+// if src is not a board
+bool board_text_read(char *src, cell_t *dst);
+// As board_text_read, but on failure describes the problem in why, which
+// holds size bytes
+bool board_text_read_explain(char *src, cell_t *dst, char *why,
+                             size_t size);
 char *board_bin_to_text(cell_t *src);
 void free_cells(cell_t *cells);
 uint64_t ptr_convert(cell_t *cells);
 cell_t *cells_convert(uint64_t ptr);
 
+// True if solution is complete, every row, column and block holds each
+// value once, and, unless puzzle is NULL, the givens of puzzle are kept
+bool board_verify(cell_t *puzzle, cell_t *solution);
+// As board_verify, but on failure describes the first problem found in
+// why, which holds size bytes
+bool board_verify_explain(cell_t *puzzle, cell_t *solution, char *why,
+                          size_t size);
+// False if a value is given twice in a row, column or block of puzzle, in
+// which case it has no solution.  Unless why is NULL, the first repeat is
+// described in why, which holds size bytes
+bool board_givens_consistent(cell_t *puzzle, char *why, size_t size);
+
 cell_t *read_sudoku_file(char *file);
 size_t cells_mem();
 struct board *create_board(cell_t *init_board);
@@ -86,7 +369,59 @@ bool boardlist_solved(struct boardlist *boards);
 
 struct board *boardlist_get(struct boardlist *l, int i);
 int boardlist_len(struct boardlist *l);
+// Boards of l waiting in scratch files, not counted by boardlist_len
+long boardlist_spilled(struct boardlist *l);
+// Free the boards left in memory in l and read back the next spilled ones
+// in their place.  Returns false if none were spilled
+bool boardlist_refill(struct boardlist *l);
 int board_nfilled(struct board *b);
+// Bytes board_serialize writes with the given flags
+size_t board_serialized_size(int flags);
+// Write b to buf, which must hold board_serialized_size(flags) bytes.
+// Only BOARD_WIRE_MASKS is taken from flags.  Returns the bytes written
+size_t board_serialize(struct board *b, int flags, void *buf);
+// As board_serialize, into a malloced buffer that glue code can pass on
+// as a blob with ptr_convert.  Free with free or board_serialized_free
+unsigned char *board_serialize_alloc(struct board *b, int flags);
+void board_serialized_free(unsigned char *buf);
+// Board read from the len bytes at buf, or NULL if they don't hold a
+// board of this size.  Masks sent with the board are used as they are, so
+// they must come from board_serialize on a trusted peer; only debug builds
+// check them against the cells
+struct board *board_deserialize(const void *buf, size_t len);
 void free_boardlist(struct boardlist *l, bool free_boards);
 
+struct board *create_board_ctx(struct sudoku_ctx *ctx, cell_t *init_board);
+// Boards freed with the _ctx variants are kept for reuse by ctx.  Any board
+// can be freed either way
+void free_board_ctx(struct sudoku_ctx *ctx, struct board *board);
+void free_boardlist_ctx(struct sudoku_ctx *ctx, struct boardlist *l,
+                        bool free_boards);
+bool boardlist_refill_ctx(struct sudoku_ctx *ctx, struct boardlist *l);
+// Decodes buf straight into a board from ctx's pool
+struct board *board_deserialize_ctx(struct sudoku_ctx *ctx, const void *buf,
+                                    size_t len);
+
+// Solve n puzzles of BOARD_CELLS cells each, stored back to back.  For 9x9
+// boards the puzzles are solved SIMD_LANES at a time in vector lanes,
+// otherwise one at a time with sudoku_solver.  Solutions are written back
+// to back to solutions, with solved[i] set for each puzzle that has one.
+// stats, if not NULL, gets each puzzle's counters.  Returns number solved
+int sudoku_solve_batch(cell_t *puzzles, int n, cell_t *solutions, bool *solved,
+                       struct solver_stats *stats);
+int sudoku_solve_batch_ctx(struct sudoku_ctx *ctx, cell_t *puzzles, int n,
+                           cell_t *solutions, bool *solved,
+                           struct solver_stats *stats);
+// Search start depth-first with nthreads strategies at once, each on its
+// own thread and context, until one finds a solution or shows there is
+// none.  Takes ownership of start and returns the solution, or NULL.  The
+// statistics of every strategy are added to ctx's
+#define MAX_PORTFOLIO 8
+struct board *sudoku_solve_portfolio_ctx(struct sudoku_ctx *ctx,
+                                         struct board *start, int nthreads);
+struct boardlist *sudoku_solver_ctx(struct sudoku_ctx *ctx, struct board *start,
+                                    bool breadthfirst, long quota);
+struct boardlist *sudoku_solver_resume_ctx(struct sudoku_ctx *ctx,
+        struct boardlist *boards, bool breadthfirst, long quota);
+
 #endif //__SUDOKU_SOLVE_H
@@ -1,14 +1,61 @@
 namespace eval sudoku {
 
+    # Boards are passed between tasks as blobs in the board wire format,
+    # with masks (BOARD_WIRE_MASKS) so they needn't be rebuilt on arrival
+    variable wire_flags 1
+
+    # A blob is a list of pointer and length.  Blobs passed in are
+    # task-local copies that the Swift/T wrapper frees after the task, so
+    # they are only read here.  Blobs returned are copied by Turbine when
+    # it stores them after the task, so their buffers are kept in
+    # out_bufs and freed at the start of the next call on this worker
+    variable out_bufs [ list ]
+
+    # Board blob as a list of pointer and length
+    proc board_blob { board } {
+        variable wire_flags
+        variable out_bufs
+        set buf [ board_serialize_alloc $board $wire_flags ]
+        lappend out_bufs $buf
+        return [ list [ ptr_convert $buf ] \
+                     [ board_serialized_size $wire_flags ] ]
+    }
+
+    # Free the blobs returned by the last call, which Turbine has stored
+    proc free_out_bufs { } {
+        variable out_bufs
+        foreach buf $out_bufs {
+            board_serialized_free $buf
+        }
+        set out_bufs [ list ]
+    }
+
+    # Board decoded from blob, or an error if it is not a valid board
+    proc blob_board { blob } {
+        set board [ board_deserialize [ cells_convert [ lindex $blob 0 ] ] \
+                        [ lindex $blob 1 ] ]
+        if { $board == {NULL} } {
+            error "sudoku: could not decode board blob of [ lindex $blob 1 ] bytes"
+        }
+        return $board
+    }
+
     proc parse_board { fname } {
-        set board_ptr [ ptr_convert [ read_sudoku_file $fname ] ]
-        return [ list $board_ptr [ cells_mem ] ]
+        free_out_bufs
+        set cells [ read_sudoku_file $fname ]
+        set board_internal [ create_board $cells ]
+        free_cells $cells
+        set blob [ board_blob $board_internal ]
+        free_board $board_internal
+        return $blob
     }
 
     proc sudoku_step { solved board breadthfirst quota } {
 
         #turbine::log "sudoku_step_body $board $breadthfirst $quota => $output"
 
+        free_out_bufs
+
         # use standard seed for now
         init_solver 0
 
@@ -25,7 +72,7 @@ namespace eval sudoku {
         #puts stderr "Retrieved board string ${board_str}"
         #puts stderr "breadthfirst: ${breadthfirst_val} quota: ${quota_val}"
 
-        set board_internal [ create_board [ cells_convert [ lindex $board 0 ] ] ]
+        set board_internal [ blob_board $board ]
 
         set boardl [ sudoku_solver $board_internal $breadthfirst $quota ]
         # board_internal ref taken over by solver
@@ -39,19 +86,18 @@ namespace eval sudoku {
 
             for { set i 0 } { $i < $n } { incr i } {
                 set board [ boardlist_get $boardl $i ]
-                set board_cells [ board_board_get $board ]
                 set filled [ board_nfilled $board ]
                 #puts stderr "Next board: ${board_text} filled ${filled}"
 
                 # Set the blob
-                set board [ list [ ptr_convert $board_cells ] [ cells_mem ] ]
+                set board [ board_blob $board ]
 
                 set struct [ dict create "board" $board "filledSquares" $filled ]
                 dict append result $i $struct
             }
             
-            # Free list but not boards
-            free_boardlist $boardl 0
+            # Boards were copied into the blobs
+            free_boardlist $boardl 1
 
         } else {
             # puts stderr "Dead end at [ clock clicks -milliseconds ]!"
@@ -63,7 +109,9 @@ namespace eval sudoku {
     }
 
     proc print_board_tcl { board } {
-        set board_internal [ create_board [ cells_convert [ lindex $board 0 ] ] ]
+        free_out_bufs
+        set board_internal [ blob_board $board ]
         print_board_stderr $board_internal
+        free_board $board_internal
     }
 }
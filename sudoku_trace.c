@@ -0,0 +1,316 @@
+/*
+ * Copyright 2012-2015 University of Chicago and Argonne National Laboratory
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License
+ */
+
+/*
+ * Convert a search trace written by sudoku --trace.
+ *
+ *   depth    per search depth: boards expanded, outcomes, cells filled in
+ *            by propagation and time (default)
+ *   folded   time aggregated by depth, branch cell and outcome, as folded
+ *            stacks for flamegraph.pl or speedscope
+ *   chrome   one event per expansion plus a depth counter, in the Chrome
+ *            trace event format for chrome://tracing or Perfetto
+ *
+ * Cells are named r<row>c<col>, counting from 0.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "sudoku_solve.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <getopt.h>
+
+enum format {
+  FORMAT_DEPTH,
+  FORMAT_FOLDED,
+  FORMAT_CHROME,
+};
+
+static const char *format_names[] = {"depth", "folded", "chrome"};
+static const char *outcome_names[] = {"branch", "solved", "dead-cell",
+    "dead-propagate", "dead-probe", "dead-unit"};
+#define N_OUTCOMES ((int)(sizeof(outcome_names) / sizeof(outcome_names[0])))
+
+struct depth_stats {
+  long nodes;
+  long outcomes[N_OUTCOMES];
+  long propagated;
+  uint64_t time_ns;
+};
+
+// Folded stack totals, in an open-addressed table keyed by
+// depth, branch cell and outcome
+struct folded_entry {
+  uint64_t key;       // 0 if the slot is empty
+  uint64_t time_ns;
+};
+
+static int board_width;
+static struct depth_stats *depths = NULL;
+static int ndepths = 0;
+static struct folded_entry *folded = NULL;
+static size_t folded_size = 0, folded_len = 0;
+
+static void usage(char *prog) {
+  fprintf(stderr, "usage: %s [options] trace file\n"
+      "  -f, --format=depth|folded|chrome  output format (default depth)\n"
+      "  -n, --limit=N                     expansions written in chrome\n"
+      "                                    format (default 1000000)\n",
+      prog);
+}
+
+static const char *cell_name(int pos, char *buf, size_t size) {
+  if (pos < 0) {
+    snprintf(buf, size, "root");
+  } else {
+    snprintf(buf, size, "r%dc%d", pos / board_width, pos % board_width);
+  }
+  return buf;
+}
+
+static void add_depth(struct trace_event *ev) {
+  if ((int)ev->depth >= ndepths) {
+    int n = ev->depth + 1 > 2 * ndepths ? ev->depth + 1 : 2 * ndepths;
+    depths = realloc(depths, sizeof(struct depth_stats) * n);
+    assert(depths != NULL);
+    memset(depths + ndepths, 0, sizeof(struct depth_stats) * (n - ndepths));
+    ndepths = n;
+  }
+  struct depth_stats *d = &depths[ev->depth];
+  d->nodes++;
+  d->outcomes[ev->outcome]++;
+  d->propagated += ev->propagated;
+  d->time_ns += ev->duration_ns;
+}
+
+static inline size_t folded_slot(struct folded_entry *table, size_t size,
+                                 uint64_t key) {
+  size_t i = (key * 0x9E3779B97F4A7C15ULL) & (size - 1);
+  while (table[i].key != 0 && table[i].key != key) {
+    i = (i + 1) & (size - 1);
+  }
+  return i;
+}
+
+static void add_folded(struct trace_event *ev) {
+  if (2 * (folded_len + 1) > folded_size) {
+    size_t size = folded_size == 0 ? 1024 : 2 * folded_size;
+    struct folded_entry *table = calloc(size, sizeof(struct folded_entry));
+    assert(table != NULL);
+    for (size_t i = 0; i < folded_size; i++) {
+      if (folded[i].key != 0) {
+        table[folded_slot(table, size, folded[i].key)] = folded[i];
+      }
+    }
+    free(folded);
+    folded = table;
+    folded_size = size;
+  }
+  uint64_t key = ((uint64_t)ev->depth << 32) |
+                 ((uint64_t)(ev->branch_pos + 1) << 3) | ev->outcome;
+  // Depth 0 of the root would make a zero key
+  key++;
+  size_t i = folded_slot(folded, folded_size, key);
+  if (folded[i].key == 0) {
+    folded[i].key = key;
+    folded_len++;
+  }
+  folded[i].time_ns += ev->duration_ns;
+}
+
+static void print_chrome(struct trace_event *ev, uint32_t thread,
+                         bool first) {
+  char name[32];
+  cell_name(ev->branch_pos, name, sizeof(name));
+  if (ev->branch_pos >= 0) {
+    size_t len = strlen(name);
+    snprintf(name + len, sizeof(name) - len, "=%u", ev->branch_val);
+  }
+  double ts = ev->start_ns / 1000.0;
+  printf("%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,"
+         "\"dur\":%.3f,\"pid\":1,\"tid\":%u,\"args\":{\"id\":%llu,"
+         "\"parent\":%llu,\"depth\":%u,\"propagated\":%u,\"choices\":%u}},"
+         "\n{\"name\":\"depth\",\"ph\":\"C\",\"ts\":%.3f,\"pid\":1,"
+         "\"tid\":%u,\"args\":{\"depth\":%u}}",
+         first ? "" : ",", name, outcome_names[ev->outcome], ts,
+         ev->duration_ns / 1000.0, thread, (unsigned long long)ev->id,
+         (unsigned long long)ev->parent, ev->depth, ev->propagated,
+         ev->nchoices, ts, thread, ev->depth);
+}
+
+static void print_depths(void) {
+  uint64_t total = 0;
+  for (int d = 0; d < ndepths; d++) {
+    total += depths[d].time_ns;
+  }
+  printf("%6s %10s %10s %8s %10s %10s %12s %6s\n", "depth", "nodes",
+         "branches", "solved", "deadends", "filled", "time(ms)", "time%");
+  for (int d = 0; d < ndepths; d++) {
+    struct depth_stats *s = &depths[d];
+    if (s->nodes == 0) {
+      continue;
+    }
+    long dead = s->nodes - s->outcomes[TRACE_BRANCH] -
+                s->outcomes[TRACE_SOLVED];
+    printf("%6d %10ld %10ld %8ld %10ld %10.1f %12.3f %6.2f\n", d, s->nodes,
+           s->outcomes[TRACE_BRANCH], s->outcomes[TRACE_SOLVED], dead,
+           (double)s->propagated / s->nodes, s->time_ns / 1e6,
+           total > 0 ? 100.0 * s->time_ns / total : 0.0);
+  }
+}
+
+static void print_folded(void) {
+  for (size_t i = 0; i < folded_size; i++) {
+    if (folded[i].key == 0) {
+      continue;
+    }
+    uint64_t key = folded[i].key - 1;
+    int depth = key >> 32;
+    int pos = (int)((key & 0xffffffff) >> 3) - 1;
+    int outcome = key & 7;
+    char name[32];
+    // Zero-padded so that depths sort in order
+    printf("depth %05d;%s;%s %llu\n", depth,
+           cell_name(pos, name, sizeof(name)), outcome_names[outcome],
+           (unsigned long long)folded[i].time_ns);
+  }
+}
+
+int main(int argc, char **argv) {
+  static struct option long_opts[] = {
+    {"format", required_argument, NULL, 'f'},
+    {"limit", required_argument, NULL, 'n'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0}
+  };
+  enum format format = FORMAT_DEPTH;
+  long limit = 1000000;
+  int opt;
+  while ((opt = getopt_long(argc, argv, "f:n:h", long_opts, NULL)) != -1) {
+    switch (opt) {
+      case 'f': {
+        int f;
+        for (f = 0; f < 3; f++) {
+          if (strcmp(optarg, format_names[f]) == 0) {
+            break;
+          }
+        }
+        if (f == 3) {
+          fprintf(stderr, "Unknown format %s\n", optarg);
+          exit(1);
+        }
+        format = f;
+        break;
+      }
+      case 'n':
+        limit = atol(optarg);
+        break;
+      case 'h':
+        usage(argv[0]);
+        return 0;
+      default:
+        usage(argv[0]);
+        exit(1);
+    }
+  }
+  if (optind != argc - 1) {
+    usage(argv[0]);
+    exit(1);
+  }
+
+  FILE *in = fopen(argv[optind], "rb");
+  if (in == NULL) {
+    fprintf(stderr, "Could not open trace file %s\n", argv[optind]);
+    exit(1);
+  }
+  struct trace_header header;
+  if (fread(&header, sizeof(header), 1, in) != 1 ||
+      memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0) {
+    fprintf(stderr, "%s is not a trace file\n", argv[optind]);
+    exit(1);
+  }
+  if (header.version != TRACE_VERSION ||
+      header.event_size != sizeof(struct trace_event)) {
+    fprintf(stderr, "Unsupported trace version %u\n", header.version);
+    exit(1);
+  }
+  board_width = header.block_width * header.block_width;
+
+  if (format == FORMAT_CHROME) {
+    printf("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+  }
+  struct trace_event *events = NULL;
+  uint32_t events_size = 0;
+  struct trace_block block;
+  long nevents = 0;
+  bool truncated = false;
+  while (fread(&block, sizeof(block), 1, in) == 1) {
+    if (block.nevents > events_size) {
+      events_size = block.nevents;
+      events = realloc(events, sizeof(struct trace_event) * events_size);
+      assert(events != NULL);
+    }
+    if (fread(events, sizeof(struct trace_event), block.nevents, in)
+        != block.nevents) {
+      fprintf(stderr, "Trace file truncated after %ld events\n", nevents);
+      truncated = true;
+      break;
+    }
+    for (uint32_t i = 0; i < block.nevents; i++) {
+      struct trace_event *ev = &events[i];
+      if (ev->outcome >= N_OUTCOMES) {
+        fprintf(stderr, "Bad event %llu in trace file\n",
+                (unsigned long long)ev->id);
+        exit(1);
+      }
+      switch (format) {
+        case FORMAT_DEPTH:
+          add_depth(ev);
+          break;
+        case FORMAT_FOLDED:
+          add_folded(ev);
+          break;
+        case FORMAT_CHROME:
+          if (nevents < limit) {
+            print_chrome(ev, block.thread, nevents == 0);
+          }
+          break;
+      }
+      nevents++;
+    }
+  }
+  fclose(in);
+
+  switch (format) {
+    case FORMAT_DEPTH:
+      print_depths();
+      break;
+    case FORMAT_FOLDED:
+      print_folded();
+      break;
+    case FORMAT_CHROME:
+      printf("\n]}\n");
+      break;
+  }
+  fprintf(stderr, "%ld events\n", nevents);
+  free(events);
+  free(depths);
+  free(folded);
+  return truncated ? 1 : 0;
+}